@@ -0,0 +1,212 @@
+//
+// bench.cpp - Relay throughput benchmark
+//
+// Only built by km232_bench.vcxproj, which builds main.cpp with
+// KM232_BENCHMARK, so the relay's own main is out of the way.
+//
+// Storms of synthetic key and mouse events go through the same handlers
+// the console feeds, into the mock device, and we report how many
+// commands a second came back, and the latency percentiles, so pipeline
+// and encoder changes can be compared without any hardware.
+//
+//   km232_bench [--keys N] [--motion N] [--mock latency_us[,jitter_us[,drop_percent[,exclusive]]]]
+//               [--device ASC232|KM232] [--window N]
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serial.h"
+#include "latency.h"
+
+//-----------------------------------------------------------------------------
+// The relay's handlers, in main.cpp
+VOID KeyEventProc(KEY_EVENT_RECORD);
+VOID MouseEventProc(MOUSE_EVENT_RECORD);
+void MouseMotionProc(int dx, int dy);
+
+static const int BenchHighWater = 256;	// commands waiting, before the storm holds off
+static const DWORD BenchDrainMs = 10000;
+
+//-----------------------------------------------------------------------------
+//
+// Keep the queue full, but not overflowing, so what's measured is the
+// device, and not dropped commands
+//
+static void BenchPace()
+{
+	while (SerialBacklog() >= BenchHighWater)
+		Sleep(0);
+}
+
+// Wait for everything to be echoed, or given up on
+static void BenchDrain()
+{
+	DWORD start = GetTickCount();
+
+	while (SerialBacklog() && ((GetTickCount() - start) < BenchDrainMs))
+		Sleep(1);
+}
+
+//-----------------------------------------------------------------------------
+
+static void BenchReport(const char* pName, LONGLONG start, unsigned int echoed, unsigned int lost, unsigned int resent)
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	double seconds = (double)(LatencyNow() - start) / (double)freq.QuadPart;
+
+	echoed = SerialEchoed() - echoed;
+	lost   = SerialLost() - lost;
+	resent = SerialResent() - resent;
+
+	printf("%-8s %8u commands  %8u lost  %8u resent  %8.3f s  %10.1f commands/s\n",
+		   pName, echoed, lost, resent, seconds, (seconds > 0.0) ? (echoed / seconds) : 0.0);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Make and break, in a frame, for every letter, over and over
+//
+static void BenchKeys(int count)
+{
+	LONGLONG start = LatencyNow();
+	unsigned int echoed = SerialEchoed();
+	unsigned int lost = SerialLost();
+	unsigned int resent = SerialResent();
+
+	KEY_EVENT_RECORD ker;
+	memset(&ker, 0, sizeof(ker));
+	ker.wRepeatCount = 1;
+
+	for (int idx = 0; idx < count; ++idx)
+	{
+		ker.wVirtualKeyCode = (WORD)('A' + (idx % 26));
+
+		SerialBeginFrame();
+		SerialCaptureTime(LatencyNow());
+
+		ker.bKeyDown = TRUE;
+		KeyEventProc(ker);
+		ker.bKeyDown = FALSE;
+		KeyEventProc(ker);
+
+		SerialEndFrame();
+
+		BenchPace();
+	}
+
+	BenchDrain();
+	BenchReport("keys", start, echoed, lost, resent);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Right button down, to turn on tracking, then a wiggle, one report at a
+// time, the way Raw Input hands them over
+//
+static void BenchMotion(int count)
+{
+	LONGLONG start = LatencyNow();
+	unsigned int echoed = SerialEchoed();
+	unsigned int lost = SerialLost();
+	unsigned int resent = SerialResent();
+
+	MOUSE_EVENT_RECORD mer;
+	memset(&mer, 0, sizeof(mer));
+	mer.dwButtonState = RIGHTMOST_BUTTON_PRESSED;
+	MouseEventProc(mer);
+
+	for (int idx = 0; idx < count; ++idx)
+	{
+		SerialBeginFrame();
+		SerialCaptureTime(LatencyNow());
+
+		MouseMotionProc((idx % 7) - 3, ((idx / 7) % 5) - 2);
+
+		SerialEndFrame();
+
+		BenchPace();
+	}
+
+	mer.dwButtonState = 0;
+	MouseEventProc(mer);
+
+	BenchDrain();
+	BenchReport("motion", start, echoed, lost, resent);
+}
+
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+	int numKeys = 10000;
+	int numMotion = 10000;
+
+	// Exclusive, so the open goes the way it does on a real port
+	MockConfig config = { 200, 100, 0, 1 };
+
+	for (int arg = 1; arg < argc; ++arg)
+	{
+		if ((0 == strcmp(argv[arg], "--keys")) && (arg + 1 < argc))
+		{
+			numKeys = atoi(argv[++arg]);
+		}
+		else if ((0 == strcmp(argv[arg], "--motion")) && (arg + 1 < argc))
+		{
+			numMotion = atoi(argv[++arg]);
+		}
+		else if ((0 == strcmp(argv[arg], "--mock")) && (arg + 1 < argc))
+		{
+			if (!MockParseConfig(argv[++arg], config))
+			{
+				printf("Bad mock device %s\n", argv[arg]);
+				return 1;
+			}
+		}
+		else if ((0 == strcmp(argv[arg], "--device")) && (arg + 1 < argc))
+		{
+			if (!SerialSetProfile(argv[++arg]))
+			{
+				printf("Unknown device %s\n", argv[arg]);
+				return 1;
+			}
+		}
+		else if ((0 == strcmp(argv[arg], "--window")) && (arg + 1 < argc))
+		{
+			SerialSetWindow(atoi(argv[++arg]));
+		}
+	}
+
+	MockSetConfig(config);
+	SerialSetBackend(SerialBackendMock);
+
+	if (!InitSerialPort("MOCK"))
+	{
+		printf("Mock device didn't answer\n");
+		return 1;
+	}
+
+	printf("%s, window %d, latency %dus, jitter %dus, drop %d%%\n\n",
+		   SerialProfileName(0), SerialGetWindow(), config.latencyUs, config.jitterUs, config.dropPercent);
+
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+	SerialStart();
+
+	if (numKeys > 0)
+		BenchKeys(numKeys);
+
+	if (numMotion > 0)
+		BenchMotion(numMotion);
+
+	SerialStop();
+
+	LatencyDump(stdout);
+
+	return 0;
+}
+
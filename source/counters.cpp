@@ -0,0 +1,141 @@
+//
+// counters.cpp - Relay counters, in shared memory
+//
+
+#include "counters.h"
+
+//-----------------------------------------------------------------------------
+
+static HANDLE hCounterMapping = nullptr;
+static CounterBlock* pCounterBlock = nullptr;
+
+// When there's no mapping, the counters still need somewhere to go
+static CounterBlock privateBlock;
+
+static CounterBlock& Counters()
+{
+	return pCounterBlock ? *pCounterBlock : privateBlock;
+}
+
+//-----------------------------------------------------------------------------
+
+void CountersStart()
+{
+	if (pCounterBlock)
+		return;
+
+	hCounterMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+										 0, sizeof(CounterBlock), KM232_COUNTERS_NAME);
+
+	if (hCounterMapping && (ERROR_ALREADY_EXISTS == GetLastError()))
+	{
+		// Someone else's, leave it alone
+		CloseHandle(hCounterMapping);
+		hCounterMapping = nullptr;
+	}
+
+	if (hCounterMapping)
+	{
+		pCounterBlock = (CounterBlock*)MapViewOfFile(hCounterMapping, FILE_MAP_WRITE, 0, 0, sizeof(CounterBlock));
+	}
+
+	CounterBlock& block = Counters();
+
+	// A new mapping is already zero
+	block.version = CountersVersion;
+	block.size = sizeof(CounterBlock);
+	block.processId = GetCurrentProcessId();
+
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	block.startTime = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+	// Last, so a monitor never sees a half filled in header
+	MemoryBarrier();
+	block.magic = CountersMagic;
+}
+
+// After SerialStop, nothing is counting by then
+void CountersStop()
+{
+	if (pCounterBlock)
+	{
+		UnmapViewOfFile(pCounterBlock);
+		pCounterBlock = nullptr;
+	}
+
+	if (hCounterMapping)
+	{
+		CloseHandle(hCounterMapping);
+		hCounterMapping = nullptr;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+CounterLink* CountersLink(int port, const char* portName)
+{
+	if ((port < 0) || (port >= SerialMaxPorts))
+		port = SerialMaxPorts - 1;
+
+	CounterBlock& block = Counters();
+	CounterLink& link = block.links[ port ];
+
+	snprintf(link.portName, sizeof(link.portName), "%s", portName ? portName : "");
+
+	if (block.portCount <= port)
+		block.portCount = port + 1;
+
+	return &link;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CountersDump(FILE* pFile)
+{
+	HANDLE hMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, KM232_COUNTERS_NAME);
+
+	if (!hMapping)
+		return false;
+
+	const CounterBlock* pBlock = (const CounterBlock*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, sizeof(CounterBlock));
+
+	bool bOk = pBlock && (CountersMagic == pBlock->magic) && (CountersVersion == pBlock->version);
+
+	if (bOk)
+	{
+		FILETIME now;
+		GetSystemTimeAsFileTime(&now);
+		ULONGLONG upTime = ((((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime) - pBlock->startTime) / 10000000;
+
+		fprintf(pFile, "km232 pid %u, up %llu:%02llu:%02llu\n", (unsigned)pBlock->processId,
+				upTime / 3600, (upTime / 60) % 60, upTime % 60);
+
+		for (int port = 0; (port < pBlock->portCount) && (port < SerialMaxPorts); ++port)
+		{
+			const CounterLink& link = pBlock->links[ port ];
+
+			fprintf(pFile, "%d %s\n", port, link.portName);
+			fprintf(pFile, "  wire:   %llu bytes, %llu writes, %llu echoed, %llu timeouts, %llu resent\n",
+					link.bytesWritten, link.writes, link.echoed, link.timeouts, link.retransmits);
+			fprintf(pFile, "  rate:   window %llu, %llu backoffs, %llu in flight at most, %llu LED reads\n",
+					link.window, link.congestion, link.inFlightHighWater, link.ledReads);
+			fprintf(pFile, "  input:  %llu queued, %llu dropped, %llu deepest queue\n",
+					link.queued, link.dropped, link.queueHighWater);
+			fprintf(pFile, "  mouse:  %llu pixels, %llu wheel notches\n",
+					link.motionPixels, link.wheelNotches);
+		}
+	}
+	else
+	{
+		fprintf(pFile, "km232 counters, not a version this understands\n");
+	}
+
+	if (pBlock)
+		UnmapViewOfFile(pBlock);
+
+	CloseHandle(hMapping);
+
+	return bOk;
+}
+
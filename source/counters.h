@@ -0,0 +1,84 @@
+//
+// counters.h - Relay counters, in shared memory
+//
+// The counters live in a named mapping, Local\km232.counters, so a
+// monitor can open it, read-only, and watch a relay that has been up for
+// days, without stopping it.  km232 --counters does just that.
+//
+// Every counter has one thread that writes it, the writer thread for its
+// port, or the input thread, so an update is a plain add, no locks, and
+// no interlocked operations.  The fields are 64 bit aligned, on x64 a
+// reader always sees a whole value, just not always the latest one.
+//
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "serial.h"
+
+#define KM232_COUNTERS_NAME "Local\\km232.counters"
+
+const DWORD CountersMagic	= 0x54434D4B;	// 'KMCT'
+const DWORD CountersVersion = 1;
+
+struct CounterLink
+{
+	char portName[ 32 ];
+
+	// Writer thread
+	volatile ULONGLONG bytesWritten;	// every command is one byte, resends included
+	volatile ULONGLONG writes;			// calls into the driver that took something
+	volatile ULONGLONG echoed;
+	volatile ULONGLONG timeouts;		// never echoed
+	volatile ULONGLONG retransmits;
+	volatile ULONGLONG congestion;		// times the rate controller backed off
+	volatile ULONGLONG ledReads;
+	volatile ULONGLONG inFlightHighWater;
+	volatile ULONGLONG window;			// where the rate controller is right now
+
+	// Input thread
+	volatile ULONGLONG queued;			// commands handed to the writer
+	volatile ULONGLONG dropped;			// the queue was full
+	volatile ULONGLONG queueHighWater;	// deepest the queue has been, after a hand off
+	volatile ULONGLONG motionPixels;	// |dx| + |dy|, coalesced into the motion
+	volatile ULONGLONG wheelNotches;
+};
+
+struct CounterBlock
+{
+	DWORD magic;
+	DWORD version;
+	DWORD size;			// sizeof(CounterBlock), more may be added at the end
+	DWORD processId;
+	ULONGLONG startTime;	// FILETIME, UTC
+	LONG portCount;
+	LONG reserved;
+
+	CounterLink links[ SerialMaxPorts ];
+};
+
+// Create the mapping, before SerialStart.  If another relay already has
+// it, or it can't be made, the counters are still kept, just not where
+// anyone can see them
+void CountersStart();
+void CountersStop();	// only once nothing can count, not on the way out
+
+// Where a port's counters go, never nullptr
+CounterLink* CountersLink(int port, const char* portName);
+
+// The owning thread, and only the owning thread, calls these
+inline void CounterAdd(volatile ULONGLONG& counter, ULONGLONG amount)
+{
+	counter = counter + amount;
+}
+
+inline void CounterMax(volatile ULONGLONG& counter, ULONGLONG value)
+{
+	if (value > counter)
+		counter = value;
+}
+
+// Open another relay's counters, and print them, false if there is none
+bool CountersDump(FILE* pFile);
+
@@ -0,0 +1,97 @@
+//
+// device.h - Serial device backends
+//
+// The serial layer only needs a handful of operations from the port, so
+// those are pulled out here, and the port can be libserialport, the
+// native Windows overlapped I/O backend, a port on another machine, or
+// a mock device, that answers like a KM232, for when there's no hardware.
+//
+#pragma once
+
+#include <windows.h>
+
+// Open results
+const int SERIAL_OK          = 0;
+const int SERIAL_NOT_FOUND   = -1;
+const int SERIAL_OPEN_FAILED = -2;
+
+enum SerialBackend
+{
+	SerialBackendLibSerialPort,
+	SerialBackendOverlapped,
+	SerialBackendMock,
+	SerialBackendNet,
+};
+
+class SerialDevice
+{
+public:
+	virtual ~SerialDevice() {}
+
+	// 8N1, at the given baud, returns SERIAL_OK, or one of the errors above
+	virtual int  Open(const char* portName, int baudrate, bool bRtsCts) = 0;
+	virtual void Close() = 0;
+
+	// Wait up to timeoutMs for at least one byte, returns the number of
+	// bytes read, 0 on timeout, < 0 on error
+	virtual int Read(unsigned char* pBytes, int count, unsigned int timeoutMs) = 0;
+
+	// Whatever has already arrived, never blocks
+	virtual int ReadAvailable(unsigned char* pBytes, int count) = 0;
+
+	// Write everything, waiting up to timeoutMs, returns bytes written
+	virtual int Write(const unsigned char* pBytes, int count, unsigned int timeoutMs) = 0;
+
+	// Hand as much as the driver will take right now, returns bytes taken
+	virtual int WriteNonBlocking(const unsigned char* pBytes, int count) = 0;
+
+	// Sleep until input shows up, hWake is signaled, or timeoutMs goes by
+	virtual void WaitInput(HANDLE hWake, DWORD timeoutMs) = 0;
+
+	// Bytes the driver has yet to put on the wire, 0 if there's no telling
+	virtual int  OutputWaiting() { return 0; }
+
+	// The device is ready for more (CTS), true if there's no telling
+	virtual bool ClearToSend() { return true; }
+};
+
+// Every serial port on the system, returns how many names were filled in
+const int SerialPortNameMax = 32;
+int SerialListPorts(char portNames[][ SerialPortNameMax ], int maxPorts);
+
+//
+// How the mock device behaves, every byte written is echoed back, after
+// the time it takes on the wire at the baud rate, plus latencyUs, plus
+// up to jitterUs more, and dropPercent of them are never echoed at all.
+// With exclusive, a second open of the same name fails, like a COM port
+//
+struct MockConfig
+{
+	int latencyUs;
+	int jitterUs;
+	int dropPercent;
+	int exclusive;
+};
+
+// Devices opened after this, get this config
+void MockSetConfig(const MockConfig& config);
+
+// "latency[,jitter[,drop[,exclusive]]]", false if it doesn't parse
+bool MockParseConfig(const char* pSpec, MockConfig& config);
+
+SerialDevice* CreateLibSerialDevice();
+SerialDevice* CreateOverlappedDevice();
+SerialDevice* CreateMockDevice();
+SerialDevice* CreateNetDevice();
+
+inline SerialDevice* CreateSerialDevice(SerialBackend backend)
+{
+	switch (backend)
+	{
+	case SerialBackendOverlapped: return CreateOverlappedDevice();
+	case SerialBackendMock:		  return CreateMockDevice();
+	case SerialBackendNet:		  return CreateNetDevice();
+	default:					  return CreateLibSerialDevice();
+	}
+}
+
@@ -0,0 +1,143 @@
+//
+// device_libsp.cpp - libserialport backend
+//
+// This is how the port has always been driven, blocking calls with
+// timeouts.  libserialport can't wait on our wake event along with the
+// port, so WaitInput comes back around every millisecond.
+//
+
+#include "device.h"
+
+#include <stdio.h>
+
+#include <libserialport.h>
+
+//-----------------------------------------------------------------------------
+
+class LibSerialDevice : public SerialDevice
+{
+public:
+	LibSerialDevice() : pPort(nullptr) {}
+	~LibSerialDevice() { Close(); }
+
+	int  Open(const char* portName, int baudrate, bool bRtsCts) override;
+	void Close() override;
+
+	int Read(unsigned char* pBytes, int count, unsigned int timeoutMs) override
+	{
+		// sp_blocking_read waits for all of them, we only want the first
+		int num_bytes = sp_blocking_read(pPort, pBytes, 1, timeoutMs);
+
+		if ((1 == num_bytes) && (count > 1))
+		{
+			int more = sp_nonblocking_read(pPort, pBytes + 1, count - 1);
+			if (more > 0) num_bytes += more;
+		}
+
+		return num_bytes;
+	}
+
+	int ReadAvailable(unsigned char* pBytes, int count) override
+	{
+		return sp_nonblocking_read(pPort, pBytes, count);
+	}
+
+	int Write(const unsigned char* pBytes, int count, unsigned int timeoutMs) override
+	{
+		return sp_blocking_write(pPort, pBytes, count, timeoutMs);
+	}
+
+	int WriteNonBlocking(const unsigned char* pBytes, int count) override
+	{
+		return sp_nonblocking_write(pPort, pBytes, count);
+	}
+
+	void WaitInput(HANDLE hWake, DWORD timeoutMs) override
+	{
+		WaitForSingleObject(hWake, (timeoutMs < 1) ? timeoutMs : 1);
+	}
+
+	int OutputWaiting() override
+	{
+		int num_bytes = sp_output_waiting(pPort);
+		return (num_bytes > 0) ? num_bytes : 0;
+	}
+
+	bool ClearToSend() override
+	{
+		enum sp_signal signals;
+
+		if (SP_OK != sp_get_signals(pPort, &signals))
+			return true;
+
+		return 0 != (signals & SP_SIG_CTS);
+	}
+
+private:
+	struct sp_port* pPort;
+};
+
+//-----------------------------------------------------------------------------
+
+int LibSerialDevice::Open(const char* portName, int baudrate, bool bRtsCts)
+{
+	Close();
+
+	sp_get_port_by_name(portName, &pPort);
+
+	if (!pPort)
+		return SERIAL_NOT_FOUND;
+
+	if (SP_OK != sp_open(pPort, SP_MODE_READ_WRITE))
+	{
+		sp_free_port(pPort);
+		pPort = nullptr;
+		return SERIAL_OPEN_FAILED;
+	}
+
+	sp_set_baudrate(pPort, baudrate);
+	sp_set_bits(pPort, 8);
+	sp_set_parity(pPort, SP_PARITY_NONE);
+	sp_set_stopbits(pPort, 1);
+	sp_set_flowcontrol(pPort, bRtsCts ? SP_FLOWCONTROL_RTSCTS : SP_FLOWCONTROL_NONE);
+
+	return SERIAL_OK;
+}
+
+void LibSerialDevice::Close()
+{
+	if (pPort)
+	{
+		sp_close(pPort);
+		sp_free_port(pPort);
+		pPort = nullptr;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int SerialListPorts(char portNames[][ SerialPortNameMax ], int maxPorts)
+{
+	struct sp_port** ports = nullptr;
+	int count = 0;
+
+	if (SP_OK == sp_list_ports(&ports))
+	{
+		for (int idx = 0; ports[ idx ] && (count < maxPorts); ++idx)
+		{
+			snprintf(portNames[ count++ ], SerialPortNameMax, "%s", sp_get_port_name(ports[ idx ]));
+		}
+
+		sp_free_port_list(ports);
+	}
+
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+
+SerialDevice* CreateLibSerialDevice()
+{
+	return new LibSerialDevice();
+}
+
@@ -0,0 +1,327 @@
+//
+// device_mock.cpp - A pretend KM232, for when there's no hardware
+//
+// Nothing is really sent anywhere, each byte written is given the time
+// it would have come back, from the baud rate, the latency, and some
+// random jitter, and a read hands it back once that time has passed.
+// Enough like the real thing to run the whole pipeline on any machine,
+// and to compare one change against another.
+//
+
+#include "device.h"
+#include "km232.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mutex>
+
+//-----------------------------------------------------------------------------
+
+static MockConfig mockConfig = { 0, 0, 0, 0 };
+
+// What's open, for exclusive, the probe threads open ports at the same time
+static std::mutex openMutex;
+static char openNames[ 16 ][ SerialPortNameMax ];
+
+void MockSetConfig(const MockConfig& config)
+{
+	mockConfig = config;
+}
+
+bool MockParseConfig(const char* pSpec, MockConfig& config)
+{
+	MockConfig parsed = { 0, 0, 0, 0 };
+
+	int count = sscanf_s(pSpec, "%d,%d,%d,%d", &parsed.latencyUs, &parsed.jitterUs, &parsed.dropPercent, &parsed.exclusive);
+
+	if ((count < 1) || (parsed.latencyUs < 0) || (parsed.jitterUs < 0) ||
+		(parsed.dropPercent < 0) || (parsed.dropPercent > 100) ||
+		(parsed.exclusive < 0) || (parsed.exclusive > 1))
+	{
+		return false;
+	}
+
+	config = parsed;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+class MockDevice : public SerialDevice
+{
+public:
+	MockDevice();
+	~MockDevice() { Close(); }
+
+	int  Open(const char* portName, int baudrate, bool bRtsCts) override;
+	void Close() override;
+
+	int  Read(unsigned char* pBytes, int count, unsigned int timeoutMs) override;
+	int  ReadAvailable(unsigned char* pBytes, int count) override;
+	int  Write(const unsigned char* pBytes, int count, unsigned int timeoutMs) override;
+	int  WriteNonBlocking(const unsigned char* pBytes, int count) override;
+	void WaitInput(HANDLE hWake, DWORD timeoutMs) override;
+	int  OutputWaiting() override;
+
+private:
+	unsigned int Random();
+	LONGLONG     UsToQpc(int us) const { return ((LONGLONG)us * frequency) / 1000000; }
+
+	// Milliseconds until the oldest echo is due, 0 if it already is
+	DWORD        NextDueMs() const;
+
+	static const unsigned int EchoMax = 4096;	// must be a power of 2
+
+	struct Echo
+	{
+		unsigned char byte;
+		LONGLONG      due;	// QPC
+	};
+
+	bool bOpen;
+	int  openSlot;	// in openNames, -1 if it isn't holding one
+	MockConfig config;
+	LONGLONG frequency;
+	LONGLONG byteTime;	// QPC ticks for one byte, 8N1
+	LONGLONG wireFree;	// when the last byte written is all the way out
+	LONGLONG lastDue;	// echoes come back in order, jitter or not
+	unsigned int seed;
+
+	Echo echoes[ EchoMax ];
+	unsigned int echoHead;
+	unsigned int echoTail;
+};
+
+//-----------------------------------------------------------------------------
+
+MockDevice::MockDevice()
+	: bOpen(false)
+	, openSlot(-1)
+	, frequency(1)
+	, byteTime(0)
+	, wireFree(0)
+	, lastDue(0)
+	, seed(0x2545F491)
+	, echoHead(0)
+	, echoTail(0)
+{
+	memset(&config, 0, sizeof(config));
+}
+
+int MockDevice::Open(const char* portName, int baudrate, bool bRtsCts)
+{
+	Close();
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	frequency = freq.QuadPart;
+
+	// Start, 8 data, and a stop bit
+	byteTime = (frequency * 10) / ((baudrate > 0) ? baudrate : 9600);
+
+	config = mockConfig;
+
+	if (config.exclusive)
+	{
+		std::lock_guard<std::mutex> lock(openMutex);
+
+		int freeSlot = -1;
+
+		for (int slot = 0; slot < 16; ++slot)
+		{
+			if (!openNames[ slot ][ 0 ])
+			{
+				if (freeSlot < 0)
+					freeSlot = slot;
+			}
+			else if (0 == _stricmp(openNames[ slot ], portName))
+			{
+				return SERIAL_OPEN_FAILED;	// someone has it already
+			}
+		}
+
+		if (freeSlot < 0)
+			return SERIAL_OPEN_FAILED;
+
+		snprintf(openNames[ freeSlot ], SerialPortNameMax, "%s", portName);
+		openSlot = freeSlot;
+	}
+
+	wireFree = lastDue = 0;
+	echoHead = echoTail = 0;
+	bOpen = true;
+
+	return SERIAL_OK;
+}
+
+void MockDevice::Close()
+{
+	if (openSlot >= 0)
+	{
+		std::lock_guard<std::mutex> lock(openMutex);
+		openNames[ openSlot ][ 0 ] = 0;
+		openSlot = -1;
+	}
+
+	bOpen = false;
+	echoHead = echoTail = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// xorshift, only has to look random
+unsigned int MockDevice::Random()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+DWORD MockDevice::NextDueMs() const
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	LONGLONG wait = echoes[ echoHead & (EchoMax-1) ].due - now.QuadPart;
+
+	if (wait <= 0)
+		return 0;
+
+	return (DWORD)(((wait * 1000) + frequency - 1) / frequency);
+}
+
+//-----------------------------------------------------------------------------
+
+int MockDevice::ReadAvailable(unsigned char* pBytes, int count)
+{
+	if (!bOpen)
+		return -1;
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	int num_bytes = 0;
+
+	while ((num_bytes < count) && (echoHead != echoTail))
+	{
+		const Echo& echo = echoes[ echoHead & (EchoMax-1) ];
+
+		if (echo.due > now.QuadPart)
+			break;
+
+		pBytes[ num_bytes++ ] = echo.byte;
+		echoHead++;
+	}
+
+	return num_bytes;
+}
+
+int MockDevice::Read(unsigned char* pBytes, int count, unsigned int timeoutMs)
+{
+	DWORD start = GetTickCount();
+
+	for (;;)
+	{
+		int num_bytes = ReadAvailable(pBytes, count);
+
+		if (num_bytes != 0)
+			return num_bytes;
+
+		DWORD elapsed = GetTickCount() - start;
+
+		if (elapsed >= timeoutMs)
+			return 0;
+
+		// Sleep(1) is as fine as it gets, spin out anything shorter
+		if ((echoHead == echoTail) || (NextDueMs() > 1))
+			Sleep(1);
+		else
+			Sleep(0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int MockDevice::WriteNonBlocking(const unsigned char* pBytes, int count)
+{
+	if (!bOpen)
+		return -1;
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	if (wireFree < now.QuadPart)
+		wireFree = now.QuadPart;
+
+	int written = 0;
+
+	while ((written < count) && ((echoTail - echoHead) < EchoMax))
+	{
+		unsigned char byte = pBytes[ written++ ];
+
+		wireFree += byteTime;
+
+		if (config.dropPercent && ((int)(Random() % 100) < config.dropPercent))
+			continue;
+
+		LONGLONG due = wireFree + byteTime + UsToQpc(config.latencyUs);
+
+		if (config.jitterUs)
+			due += UsToQpc((int)(Random() % (unsigned int)(config.jitterUs + 1)));
+
+		if (due < lastDue)
+			due = lastDue;
+		lastDue = due;
+
+		// Everything is echoed, except the LED read, which answers with the LEDs
+		Echo& echo = echoes[ echoTail++ & (EchoMax-1) ];
+		echo.byte = (USB_StatusLEDRead == byte) ? 0x30 : byte;
+		echo.due  = due;
+	}
+
+	return written;
+}
+
+int MockDevice::Write(const unsigned char* pBytes, int count, unsigned int timeoutMs)
+{
+	return WriteNonBlocking(pBytes, count);
+}
+
+//-----------------------------------------------------------------------------
+
+void MockDevice::WaitInput(HANDLE hWake, DWORD timeoutMs)
+{
+	if (echoHead != echoTail)
+	{
+		DWORD dueMs = NextDueMs();
+
+		if (dueMs < timeoutMs)
+			timeoutMs = dueMs;
+	}
+
+	WaitForSingleObject(hWake, timeoutMs);
+}
+
+//-----------------------------------------------------------------------------
+
+// Whatever hasn't gone out at the baud rate yet
+int MockDevice::OutputWaiting()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	if (!byteTime || (wireFree <= now.QuadPart))
+		return 0;
+
+	return (int)((wireFree - now.QuadPart + byteTime - 1) / byteTime);
+}
+
+//-----------------------------------------------------------------------------
+
+SerialDevice* CreateMockDevice()
+{
+	return new MockDevice();
+}
+
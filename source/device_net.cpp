@@ -0,0 +1,345 @@
+//
+// device_net.cpp - Network backend, a serial port on another machine
+//
+// The port name is host[:port], of a km232 --serve.  Open sends the line
+// settings, and the server opens its port with them, so the profile probe
+// works the same as it does on a local port.
+//
+
+#include "netproto.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+//-----------------------------------------------------------------------------
+
+static std::atomic<unsigned int> netRoundTripUs(0);
+
+unsigned int NetRoundTripUs()
+{
+	return netRoundTripUs.load(std::memory_order_relaxed);
+}
+
+//-----------------------------------------------------------------------------
+
+class NetDevice : public SerialDevice
+{
+public:
+	NetDevice();
+	~NetDevice() { Close(); }
+
+	int  Open(const char* portName, int baudrate, bool bRtsCts) override;
+	void Close() override;
+
+	int  Read(unsigned char* pBytes, int count, unsigned int timeoutMs) override;
+	int  ReadAvailable(unsigned char* pBytes, int count) override;
+	int  Write(const unsigned char* pBytes, int count, unsigned int timeoutMs) override;
+	int  WriteNonBlocking(const unsigned char* pBytes, int count) override;
+	void WaitInput(HANDLE hWake, DWORD timeoutMs) override;
+
+private:
+	bool Connect(const char* portName);
+	void Pump();
+	int  TakeReceived(unsigned char* pBytes, int count);
+
+	static const int RxSize = 1024;
+	static const DWORD OpenTimeoutMs = 2000;
+
+	SOCKET hSocket;
+	HANDLE hEvent;	// the socket has something to read
+	bool   bError;
+
+	unsigned int sequence;
+	int openResult;	// from the server, 1 until it answers
+
+	NetReceiver receiver;
+
+	// Echoes, that have come in, but not handed out yet
+	unsigned char received[ RxSize ];
+	int receivedCount;
+};
+
+//-----------------------------------------------------------------------------
+
+NetDevice::NetDevice()
+	: hSocket(INVALID_SOCKET)
+	, hEvent(nullptr)
+	, bError(false)
+	, sequence(0)
+	, openResult(1)
+	, receivedCount(0)
+{
+	receiver.count = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+bool NetDevice::Connect(const char* portName)
+{
+	char host[ 64 ];
+	char port[ 8 ];
+
+	snprintf(host, sizeof(host), "%s", portName);
+	snprintf(port, sizeof(port), "%u", NetDefaultPort);
+
+	char* pColon = strrchr(host, ':');
+
+	if (pColon)
+	{
+		*pColon = 0;
+		snprintf(port, sizeof(port), "%s", pColon + 1);
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	addrinfo* pInfo = nullptr;
+
+	if (!NetStartup() || (0 != getaddrinfo(host, port, &hints, &pInfo)))
+		return false;
+
+	for (addrinfo* pAddr = pInfo; pAddr && (INVALID_SOCKET == hSocket); pAddr = pAddr->ai_next)
+	{
+		hSocket = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+
+		if ((INVALID_SOCKET != hSocket) && (SOCKET_ERROR == connect(hSocket, pAddr->ai_addr, (int)pAddr->ai_addrlen)))
+		{
+			closesocket(hSocket);
+			hSocket = INVALID_SOCKET;
+		}
+	}
+
+	freeaddrinfo(pInfo);
+
+	return INVALID_SOCKET != hSocket;
+}
+
+int NetDevice::Open(const char* portName, int baudrate, bool bRtsCts)
+{
+	Close();
+
+	if (!Connect(portName))
+		return SERIAL_NOT_FOUND;
+
+	// Every frame is a handful of bytes, don't let any of them sit
+	BOOL bNoDelay = TRUE;
+	setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&bNoDelay, sizeof(bNoDelay));
+
+	hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	WSAEventSelect(hSocket, hEvent, FD_READ | FD_CLOSE);
+
+	bError = false;
+	openResult = 1;
+
+	NetOpenRequest request;
+	request.baudrate = baudrate;
+	request.bRtsCts = bRtsCts ? 1 : 0;
+
+	if (!NetSendFrame(hSocket, NetOpen, &request, sizeof(request), ++sequence, NetNowUs()))
+	{
+		Close();
+		return SERIAL_OPEN_FAILED;
+	}
+
+	DWORD start = GetTickCount();
+
+	while ((1 == openResult) && !bError && ((GetTickCount() - start) < OpenTimeoutMs))
+	{
+		WaitForSingleObject(hEvent, OpenTimeoutMs - (GetTickCount() - start));
+		Pump();
+	}
+
+	int result = (1 == openResult) ? SERIAL_OPEN_FAILED : openResult;
+
+	if (SERIAL_OK != result)
+		Close();
+
+	return result;
+}
+
+void NetDevice::Close()
+{
+	if (INVALID_SOCKET != hSocket)
+	{
+		closesocket(hSocket);
+		hSocket = INVALID_SOCKET;
+	}
+
+	if (hEvent)
+	{
+		CloseHandle(hEvent);
+		hEvent = nullptr;
+	}
+
+	receiver.count = 0;
+	receivedCount = 0;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Take in everything that has come from the server
+//
+void NetDevice::Pump()
+{
+	if (INVALID_SOCKET == hSocket)
+		return;
+
+	WSANETWORKEVENTS events;
+	WSAEnumNetworkEvents(hSocket, hEvent, &events);	// resets the event
+
+	if (!NetReceive(hSocket, receiver))
+		bError = true;
+
+	NetFrameHeader header;
+	unsigned char payload[ NetMaxPayload ];
+	int frameResult;
+
+	while ((frameResult = NetNextFrame(receiver, header, payload)) > 0)
+	{
+		if (NetData == header.type)
+		{
+			int count = header.length;
+
+			if (count > (RxSize - receivedCount))
+				count = RxSize - receivedCount;	// the pipeline will count these as lost
+
+			memcpy(received + receivedCount, payload, count);
+			receivedCount += count;
+
+			if (header.timeUs)
+			{
+				netRoundTripUs.store((unsigned int)(NetNowUs() - header.timeUs), std::memory_order_relaxed);
+			}
+		}
+		else if ((NetOpenResult == header.type) && (header.length == sizeof(int)))
+		{
+			memcpy(&openResult, payload, sizeof(int));
+		}
+	}
+
+	// Nothing after a bad length can be trusted, the link is gone
+	if (frameResult < 0)
+		bError = true;
+}
+
+int NetDevice::TakeReceived(unsigned char* pBytes, int count)
+{
+	if (count > receivedCount)
+		count = receivedCount;
+
+	if (count > 0)
+	{
+		memcpy(pBytes, received, count);
+		receivedCount -= count;
+		memmove(received, received + count, receivedCount);
+	}
+
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+
+int NetDevice::Read(unsigned char* pBytes, int count, unsigned int timeoutMs)
+{
+	if (INVALID_SOCKET == hSocket)
+		return -1;
+
+	DWORD start = GetTickCount();
+
+	Pump();
+
+	while (0 == receivedCount)
+	{
+		if (bError)
+			return -1;
+
+		DWORD elapsed = GetTickCount() - start;
+
+		if (elapsed >= timeoutMs)
+			return 0;
+
+		WaitForSingleObject(hEvent, timeoutMs - elapsed);
+		Pump();
+	}
+
+	return TakeReceived(pBytes, count);
+}
+
+int NetDevice::ReadAvailable(unsigned char* pBytes, int count)
+{
+	if (INVALID_SOCKET == hSocket)
+		return -1;
+
+	Pump();
+
+	if ((0 == receivedCount) && bError)
+		return -1;
+
+	return TakeReceived(pBytes, count);
+}
+
+//-----------------------------------------------------------------------------
+
+int NetDevice::WriteNonBlocking(const unsigned char* pBytes, int count)
+{
+	if ((INVALID_SOCKET == hSocket) || bError)
+		return -1;
+
+	// The whole write frame fits in one network frame
+	if (count > NetMaxPayload)
+		count = NetMaxPayload;
+
+	if (!NetSendFrame(hSocket, NetData, pBytes, count, ++sequence, NetNowUs()))
+	{
+		bError = true;
+		return -1;
+	}
+
+	return count;
+}
+
+int NetDevice::Write(const unsigned char* pBytes, int count, unsigned int timeoutMs)
+{
+	int written = 0;
+
+	while (written < count)
+	{
+		int num_bytes = WriteNonBlocking(pBytes + written, count - written);
+
+		if (num_bytes < 0)
+			return (written > 0) ? written : -1;
+
+		written += num_bytes;
+	}
+
+	return written;
+}
+
+//-----------------------------------------------------------------------------
+
+void NetDevice::WaitInput(HANDLE hWake, DWORD timeoutMs)
+{
+	if (receivedCount || !hEvent)
+	{
+		if (!receivedCount && timeoutMs)
+			WaitForSingleObject(hWake, timeoutMs);
+		return;
+	}
+
+	HANDLE handles[ 2 ] = { hWake, hEvent };
+
+	WaitForMultipleObjects(2, handles, FALSE, timeoutMs);
+}
+
+//-----------------------------------------------------------------------------
+
+SerialDevice* CreateNetDevice()
+{
+	return new NetDevice();
+}
+
@@ -0,0 +1,426 @@
+//
+// device_overlapped.cpp - Native Windows serial backend
+//
+// The port is opened FILE_FLAG_OVERLAPPED, and tied to an I/O completion
+// port.  There is always one read outstanding, so an echo is picked up
+// the moment the driver has it, and the writer thread can sleep on the
+// read along with its wake event, instead of coming back around every
+// millisecond to poll.
+//
+
+#include "device.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+
+class OverlappedDevice : public SerialDevice
+{
+public:
+	OverlappedDevice();
+	~OverlappedDevice() { Close(); }
+
+	int  Open(const char* portName, int baudrate, bool bRtsCts) override;
+	void Close() override;
+
+	int  Read(unsigned char* pBytes, int count, unsigned int timeoutMs) override;
+	int  ReadAvailable(unsigned char* pBytes, int count) override;
+	int  Write(const unsigned char* pBytes, int count, unsigned int timeoutMs) override;
+	int  WriteNonBlocking(const unsigned char* pBytes, int count) override;
+	void WaitInput(HANDLE hWake, DWORD timeoutMs) override;
+	int  OutputWaiting() override;
+	bool ClearToSend() override;
+
+private:
+	void IssueRead();
+	bool Pump(DWORD timeoutMs);
+	int  TakeReceived(unsigned char* pBytes, int count);
+
+	static const int RxSize = 256;
+	static const int TxSize = 256;
+
+	HANDLE hPort;
+	HANDLE hCompletion;
+
+	OVERLAPPED readOverlapped;
+	OVERLAPPED writeOverlapped;
+	bool bReadPending;
+	bool bWritePending;
+	bool bError;
+
+	unsigned char readBuffer[ RxSize ];		// owned by the driver while bReadPending
+	unsigned char writeBuffer[ TxSize ];	// owned by the driver while bWritePending
+
+	// What has been read, but not handed out yet
+	unsigned char received[ RxSize ];
+	int receivedCount;
+};
+
+//-----------------------------------------------------------------------------
+
+OverlappedDevice::OverlappedDevice()
+	: hPort(INVALID_HANDLE_VALUE)
+	, hCompletion(nullptr)
+	, bReadPending(false)
+	, bWritePending(false)
+	, bError(false)
+	, receivedCount(0)
+{
+	memset(&readOverlapped, 0, sizeof(readOverlapped));
+	memset(&writeOverlapped, 0, sizeof(writeOverlapped));
+}
+
+//-----------------------------------------------------------------------------
+
+int OverlappedDevice::Open(const char* portName, int baudrate, bool bRtsCts)
+{
+	Close();
+
+	// COM10 and up only open with the device namespace prefix
+	char path[ 64 ];
+	snprintf(path, sizeof(path), "\\\\.\\%s", portName);
+
+	hPort = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+						OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+
+	if (INVALID_HANDLE_VALUE == hPort)
+	{
+		DWORD error = GetLastError();
+		return ((ERROR_FILE_NOT_FOUND == error) || (ERROR_PATH_NOT_FOUND == error))
+			   ? SERIAL_NOT_FOUND : SERIAL_OPEN_FAILED;
+	}
+
+	DCB dcb;
+	memset(&dcb, 0, sizeof(dcb));
+	dcb.DCBlength = sizeof(dcb);
+	GetCommState(hPort, &dcb);
+
+	dcb.BaudRate = (DWORD)baudrate;
+	dcb.ByteSize = 8;
+	dcb.Parity   = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.fBinary  = TRUE;
+	dcb.fParity  = FALSE;
+	dcb.fOutxDsrFlow = FALSE;
+	dcb.fDsrSensitivity = FALSE;
+	dcb.fOutX = FALSE;
+	dcb.fInX  = FALSE;
+	dcb.fDtrControl  = DTR_CONTROL_ENABLE;
+	dcb.fOutxCtsFlow = bRtsCts ? TRUE : FALSE;
+	dcb.fRtsControl  = bRtsCts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
+
+	// A read completes as soon as there is at least one byte, or after a
+	// second with nothing, then it's just issued again
+	COMMTIMEOUTS timeouts;
+	timeouts.ReadIntervalTimeout = MAXDWORD;
+	timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+	timeouts.ReadTotalTimeoutConstant = 1000;
+	timeouts.WriteTotalTimeoutMultiplier = 0;
+	timeouts.WriteTotalTimeoutConstant = 0;
+
+	if (!SetCommState(hPort, &dcb) || !SetCommTimeouts(hPort, &timeouts))
+	{
+		Close();
+		return SERIAL_OPEN_FAILED;
+	}
+
+	PurgeComm(hPort, PURGE_RXCLEAR | PURGE_TXCLEAR | PURGE_RXABORT | PURGE_TXABORT);
+
+	hCompletion = CreateIoCompletionPort(hPort, nullptr, 0, 1);
+
+	// The read also signals an event, so it can be waited on with the wake
+	readOverlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+	if (!hCompletion || !readOverlapped.hEvent)
+	{
+		Close();
+		return SERIAL_OPEN_FAILED;
+	}
+
+	bError = false;
+	IssueRead();
+
+	return SERIAL_OK;
+}
+
+//-----------------------------------------------------------------------------
+
+void OverlappedDevice::Close()
+{
+	if (INVALID_HANDLE_VALUE != hPort)
+	{
+		// Cancel, then collect, the buffers belong to the driver until then
+		CancelIoEx(hPort, nullptr);
+
+		DWORD start = GetTickCount();
+
+		while ((bReadPending || bWritePending) && hCompletion && ((GetTickCount() - start) < 250))
+		{
+			Pump(50);
+		}
+
+		CloseHandle(hPort);
+		hPort = INVALID_HANDLE_VALUE;
+	}
+
+	if (hCompletion)
+	{
+		CloseHandle(hCompletion);
+		hCompletion = nullptr;
+	}
+
+	if (readOverlapped.hEvent)
+	{
+		CloseHandle(readOverlapped.hEvent);
+		readOverlapped.hEvent = nullptr;
+	}
+
+	bReadPending = false;
+	bWritePending = false;
+	receivedCount = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void OverlappedDevice::IssueRead()
+{
+	if (bReadPending || bError || (INVALID_HANDLE_VALUE == hPort))
+		return;
+
+	readOverlapped.Internal = 0;
+	readOverlapped.InternalHigh = 0;
+	readOverlapped.Offset = 0;
+	readOverlapped.OffsetHigh = 0;
+
+	// Don't read more than there is room to keep
+	DWORD room = (DWORD)(RxSize - receivedCount);
+
+	if (0 == room)
+		return;
+
+	// Even if it finishes right away, the completion is still queued
+	if (ReadFile(hPort, readBuffer, room, nullptr, &readOverlapped) ||
+		(ERROR_IO_PENDING == GetLastError()))
+	{
+		bReadPending = true;
+	}
+	else
+	{
+		bError = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Collect one completion, returns false if nothing completed in time
+//
+bool OverlappedDevice::Pump(DWORD timeoutMs)
+{
+	DWORD num_bytes = 0;
+	ULONG_PTR key = 0;
+	LPOVERLAPPED pOverlapped = nullptr;
+
+	BOOL bOk = GetQueuedCompletionStatus(hCompletion, &num_bytes, &key, &pOverlapped, timeoutMs);
+
+	if (!pOverlapped)
+		return false;	// timeout
+
+	if (pOverlapped == &readOverlapped)
+	{
+		bReadPending = false;
+
+		if (bOk)
+		{
+			memcpy(received + receivedCount, readBuffer, num_bytes);
+			receivedCount += (int)num_bytes;
+		}
+		else if (ERROR_OPERATION_ABORTED != GetLastError())
+		{
+			bError = true;	// unplugged, most likely
+		}
+
+		IssueRead();
+	}
+	else if (pOverlapped == &writeOverlapped)
+	{
+		bWritePending = false;
+
+		if (!bOk && (ERROR_OPERATION_ABORTED != GetLastError()))
+		{
+			bError = true;
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+int OverlappedDevice::TakeReceived(unsigned char* pBytes, int count)
+{
+	if (count > receivedCount)
+		count = receivedCount;
+
+	if (count > 0)
+	{
+		memcpy(pBytes, received, count);
+		receivedCount -= count;
+		memmove(received, received + count, receivedCount);
+
+		// There's room again, if the read was held back
+		IssueRead();
+	}
+
+	return count;
+}
+
+//-----------------------------------------------------------------------------
+
+int OverlappedDevice::Read(unsigned char* pBytes, int count, unsigned int timeoutMs)
+{
+	if (INVALID_HANDLE_VALUE == hPort)
+		return -1;
+
+	DWORD start = GetTickCount();
+
+	while (0 == receivedCount)
+	{
+		if (bError)
+			return -1;
+
+		DWORD elapsed = GetTickCount() - start;
+
+		if (elapsed >= timeoutMs)
+			return 0;
+
+		Pump(timeoutMs - elapsed);
+	}
+
+	return TakeReceived(pBytes, count);
+}
+
+int OverlappedDevice::ReadAvailable(unsigned char* pBytes, int count)
+{
+	if (INVALID_HANDLE_VALUE == hPort)
+		return -1;
+
+	while (Pump(0))
+		;
+
+	if ((0 == receivedCount) && bError)
+		return -1;
+
+	return TakeReceived(pBytes, count);
+}
+
+//-----------------------------------------------------------------------------
+
+int OverlappedDevice::WriteNonBlocking(const unsigned char* pBytes, int count)
+{
+	if ((INVALID_HANDLE_VALUE == hPort) || bError)
+		return -1;
+
+	while (bWritePending && Pump(0))
+		;
+
+	// One write at a time, the driver is still working on the last one
+	if (bWritePending)
+		return 0;
+
+	if (count > TxSize)
+		count = TxSize;
+
+	memcpy(writeBuffer, pBytes, count);
+	memset(&writeOverlapped, 0, sizeof(writeOverlapped));
+
+	if (WriteFile(hPort, writeBuffer, (DWORD)count, nullptr, &writeOverlapped) ||
+		(ERROR_IO_PENDING == GetLastError()))
+	{
+		bWritePending = true;
+		return count;
+	}
+
+	bError = true;
+	return -1;
+}
+
+int OverlappedDevice::Write(const unsigned char* pBytes, int count, unsigned int timeoutMs)
+{
+	DWORD start = GetTickCount();
+	int written = 0;
+
+	while (written < count)
+	{
+		int num_bytes = WriteNonBlocking(pBytes + written, count - written);
+
+		if (num_bytes < 0)
+			return (written > 0) ? written : -1;
+
+		written += num_bytes;
+
+		DWORD elapsed = GetTickCount() - start;
+
+		if (elapsed >= timeoutMs)
+			break;
+
+		if (0 == num_bytes)
+			Pump(timeoutMs - elapsed);
+	}
+
+	// Blocking means it's out of our hands when we return
+	while (bWritePending && ((GetTickCount() - start) < timeoutMs))
+	{
+		Pump(timeoutMs - (GetTickCount() - start));
+	}
+
+	return written;
+}
+
+//-----------------------------------------------------------------------------
+
+void OverlappedDevice::WaitInput(HANDLE hWake, DWORD timeoutMs)
+{
+	if (receivedCount || !bReadPending)
+	{
+		// Nothing to wait on, the data is already here, or the port is gone
+		if (!receivedCount && timeoutMs)
+			WaitForSingleObject(hWake, timeoutMs);
+		return;
+	}
+
+	HANDLE handles[ 2 ] = { hWake, readOverlapped.hEvent };
+
+	WaitForMultipleObjects(2, handles, FALSE, timeoutMs);
+}
+
+//-----------------------------------------------------------------------------
+
+int OverlappedDevice::OutputWaiting()
+{
+	DWORD errors = 0;
+	COMSTAT stat;
+
+	if ((INVALID_HANDLE_VALUE == hPort) || !ClearCommError(hPort, &errors, &stat))
+		return 0;
+
+	return (int)stat.cbOutQue;
+}
+
+bool OverlappedDevice::ClearToSend()
+{
+	DWORD status = 0;
+
+	if ((INVALID_HANDLE_VALUE == hPort) || !GetCommModemStatus(hPort, &status))
+		return true;
+
+	return 0 != (status & MS_CTS_ON);
+}
+
+//-----------------------------------------------------------------------------
+
+SerialDevice* CreateOverlappedDevice()
+{
+	return new OverlappedDevice();
+}
+
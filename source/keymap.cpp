@@ -0,0 +1,733 @@
+//
+// keymap.cpp - Windows Virtual Key to KM232 key code
+//
+// KM232 codes are the IBM key position numbers, so a layout only changes
+// which VK lands on which position.
+//
+
+#include "keymap.h"
+#include "km232.h"
+#include "serial.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+//
+// US, every named VK, in VK order
+//
+static constexpr KeyDesc keysUS[] =
+{
+	//  VK    name                                code  ext
+	{ 0x01, "VK_LBUTTON",                          0      },
+	{ 0x02, "VK_RBUTTON",                          0      },
+	{ 0x03, "VK_CANCEL",                           0      },
+	{ 0x04, "VK_MBUTTON",                          0      },	// not contiguous with L & RBUTTON
+	{ 0x05, "VK_XBUTTON1",                         0      },	// not contiguous with L & RBUTTON
+	{ 0x06, "VK_XBUTTON2",                         0      },	// not contiguous with L & RBUTTON
+	{ 0x08, "VK_BACK",                            15      },
+	{ 0x09, "VK_TAB",                             16      },
+	{ 0x0C, "VK_CLEAR",                            0      },
+	{ 0x0D, "VK_RETURN",                          43, 108 },	// Keypad Enter when extended
+	{ 0x10, "VK_SHIFT",                           44      },	// Left Shift
+	{ 0x11, "VK_CONTROL",                         58,  64 },	// Left Control, Right Control when extended
+	{ 0x12, "VK_MENU",                            60,  62 },	// Left Alt, Right Alt when extended
+	{ 0x13, "VK_PAUSE",                            0      },
+	{ 0x14, "VK_CAPITAL",                         30      },
+	{ 0x15, "VK_KANA",                             0      },	// VK_HANGEUL,VK_HANGUL
+	{ 0x17, "VK_JUNJA",                            0      },
+	{ 0x18, "VK_FINAL",                            0      },
+	{ 0x19, "VK_HANJA",                            0      },	// VK_KANJI
+	{ 0x1B, "VK_ESCAPE",                         110      },
+	{ 0x1C, "VK_CONVERT",                          0      },
+	{ 0x1D, "VK_NONCONVERT",                       0      },
+	{ 0x1E, "VK_ACCEPT",                           0      },
+	{ 0x1F, "VK_MODECHANGE",                       0      },
+	{ 0x20, "VK_SPACE",                           61      },
+	{ 0x21, "VK_PRIOR",                           85      },	// Page Up
+	{ 0x22, "VK_NEXT",                            86      },	// Page Down
+	{ 0x23, "VK_END",                             81      },
+	{ 0x24, "VK_HOME",                            80      },
+	{ 0x25, "VK_LEFT",                            79      },
+	{ 0x26, "VK_UP",                              83      },
+	{ 0x27, "VK_RIGHT",                           89      },
+	{ 0x28, "VK_DOWN",                            84      },
+	{ 0x29, "VK_SELECT",                           0      },
+	{ 0x2A, "VK_PRINT",                            0      },
+	{ 0x2B, "VK_EXECUTE",                          0      },
+	{ 0x2C, "VK_SNAPSHOT",                         0      },
+	{ 0x2D, "VK_INSERT",                          75      },
+	{ 0x2E, "VK_DELETE",                          76      },
+	{ 0x2F, "VK_HELP",                             0      },
+	{ 0x30, "VK_0",                               11      },
+	{ 0x31, "VK_1",                                2      },
+	{ 0x32, "VK_2",                                3      },
+	{ 0x33, "VK_3",                                4      },
+	{ 0x34, "VK_4",                                5      },
+	{ 0x35, "VK_5",                                6      },
+	{ 0x36, "VK_6",                                7      },
+	{ 0x37, "VK_7",                                8      },
+	{ 0x38, "VK_8",                                9      },
+	{ 0x39, "VK_9",                               10      },
+	{ 0x41, "VK_A",                               31      },
+	{ 0x42, "VK_B",                               50      },
+	{ 0x43, "VK_C",                               48      },
+	{ 0x44, "VK_D",                               33      },
+	{ 0x45, "VK_E",                               19      },
+	{ 0x46, "VK_F",                               34      },
+	{ 0x47, "VK_G",                               35      },
+	{ 0x48, "VK_H",                               36      },
+	{ 0x49, "VK_I",                               24      },
+	{ 0x4A, "VK_J",                               37      },
+	{ 0x4B, "VK_K",                               38      },
+	{ 0x4C, "VK_L",                               39      },
+	{ 0x4D, "VK_M",                               52      },
+	{ 0x4E, "VK_N",                               51      },
+	{ 0x4F, "VK_O",                               25      },
+	{ 0x50, "VK_P",                               26      },
+	{ 0x51, "VK_Q",                               17      },
+	{ 0x52, "VK_R",                               20      },
+	{ 0x53, "VK_S",                               32      },
+	{ 0x54, "VK_T",                               21      },
+	{ 0x55, "VK_U",                               23      },
+	{ 0x56, "VK_V",                               49      },
+	{ 0x57, "VK_W",                               18      },
+	{ 0x58, "VK_X",                               47      },
+	{ 0x59, "VK_Y",                               22      },
+	{ 0x5A, "VK_Z",                               46      },
+	{ 0x5B, "VK_LWIN",                            70      },
+	{ 0x5C, "VK_RWIN",                            71      },
+	{ 0x5D, "VK_APPS",                             0      },
+	{ 0x5F, "VK_SLEEP",                            0      },
+	{ 0x60, "VK_NUMPAD0",                         99      },
+	{ 0x61, "VK_NUMPAD1",                         93      },
+	{ 0x62, "VK_NUMPAD2",                         98      },
+	{ 0x63, "VK_NUMPAD3",                        103      },
+	{ 0x64, "VK_NUMPAD4",                         92      },
+	{ 0x65, "VK_NUMPAD5",                         97      },
+	{ 0x66, "VK_NUMPAD6",                        102      },
+	{ 0x67, "VK_NUMPAD7",                         91      },
+	{ 0x68, "VK_NUMPAD8",                         96      },
+	{ 0x69, "VK_NUMPAD9",                        101      },
+	{ 0x6A, "VK_MULTIPLY",                       100      },
+	{ 0x6B, "VK_ADD",                            106      },
+	{ 0x6C, "VK_SEPARATOR",                        0      },
+	{ 0x6D, "VK_SUBTRACT",                       105      },
+	{ 0x6E, "VK_DECIMAL",                        104      },
+	{ 0x6F, "VK_DIVIDE",                          95      },
+	{ 0x70, "VK_F1",                             112      },
+	{ 0x71, "VK_F2",                             113      },
+	{ 0x72, "VK_F3",                             114      },
+	{ 0x73, "VK_F4",                             115      },
+	{ 0x74, "VK_F5",                             116      },
+	{ 0x75, "VK_F6",                             117      },
+	{ 0x76, "VK_F7",                             118      },
+	{ 0x77, "VK_F8",                             119      },
+	{ 0x78, "VK_F9",                             120      },
+	{ 0x79, "VK_F10",                            121      },
+	{ 0x7A, "VK_F11",                            122      },
+	{ 0x7B, "VK_F12",                            124      },
+	{ 0x7C, "VK_F13",                              0      },
+	{ 0x7D, "VK_F14",                              0      },
+	{ 0x7E, "VK_F15",                              0      },
+	{ 0x7F, "VK_F16",                              0      },
+	{ 0x80, "VK_F17",                              0      },
+	{ 0x81, "VK_F18",                              0      },
+	{ 0x82, "VK_F19",                              0      },
+	{ 0x83, "VK_F20",                              0      },
+	{ 0x84, "VK_F21",                              0      },
+	{ 0x85, "VK_F22",                              0      },
+	{ 0x86, "VK_F23",                              0      },
+	{ 0x87, "VK_F24",                              0      },
+	{ 0x88, "VK_NAVIGATION_VIEW",                  0      },	// reserved
+	{ 0x89, "VK_NAVIGATION_MENU",                  0      },	// reserved
+	{ 0x8A, "VK_NAVIGATION_UP",                    0      },	// reserved
+	{ 0x8B, "VK_NAVIGATION_DOWN",                  0      },	// reserved
+	{ 0x8C, "VK_NAVIGATION_LEFT",                  0      },	// reserved
+	{ 0x8D, "VK_NAVIGATION_RIGHT",                 0      },	// reserved
+	{ 0x8E, "VK_NAVIGATION_ACCEPT",                0      },	// reserved
+	{ 0x8F, "VK_NAVIGATION_CANCEL",                0      },	// reserved
+	{ 0x90, "VK_NUMLOCK",                         90      },
+	{ 0x91, "VK_SCROLL",                         125      },	// Scroll Lock
+	{ 0x92, "VK_OEM_NEC_EQUAL",                    0      },	// '=' key on numpad, VK_OEM_FJ_JISHO 'Dictionary' key
+	{ 0x93, "VK_OEM_FJ_MASSHOU",                   0      },	// 'Unregister word' key
+	{ 0x94, "VK_OEM_FJ_TOUROKU",                   0      },	// 'Register word' key
+	{ 0x95, "VK_OEM_FJ_LOYA",                      0      },	// 'Left OYAYUBI' key
+	{ 0x96, "VK_OEM_FJ_ROYA",                      0      },	// 'Right OYAYUBI' key
+	{ 0xA0, "VK_LSHIFT",                          44      },
+	{ 0xA1, "VK_RSHIFT",                          57      },
+	{ 0xA2, "VK_LCONTROL",                        58      },
+	{ 0xA3, "VK_RCONTROL",                        64      },
+	{ 0xA4, "VK_LMENU",                           60      },	// L-Alt
+	{ 0xA5, "VK_RMENU",                           62      },	// R-Alt
+	{ 0xA6, "VK_BROWSER_BACK",                     0      },
+	{ 0xA7, "VK_BROWSER_FORWARD",                  0      },
+	{ 0xA8, "VK_BROWSER_REFRESH",                  0      },
+	{ 0xA9, "VK_BROWSER_STOP",                     0      },
+	{ 0xAA, "VK_BROWSER_SEARCH",                   0      },
+	{ 0xAB, "VK_BROWSER_FAVORITES",                0      },
+	{ 0xAC, "VK_BROWSER_HOME",                     0      },
+	{ 0xAD, "VK_VOLUME_MUTE",                      0      },
+	{ 0xAE, "VK_VOLUME_DOWN",                      0      },
+	{ 0xAF, "VK_VOLUME_UP",                        0      },
+	{ 0xB0, "VK_MEDIA_NEXT_TRACK",                 0      },
+	{ 0xB1, "VK_MEDIA_PREV_TRACK",                 0      },
+	{ 0xB2, "VK_MEDIA_STOP",                       0      },
+	{ 0xB3, "VK_MEDIA_PLAY_PAUSE",                 0      },
+	{ 0xB4, "VK_LAUNCH_MAIL",                      0      },
+	{ 0xB5, "VK_LAUNCH_MEDIA_SELECT",              0      },
+	{ 0xB6, "VK_LAUNCH_APP1",                      0      },
+	{ 0xB7, "VK_LAUNCH_APP2",                      0      },
+	{ 0xBA, "VK_OEM_1",                           40      },	// ';:' for US
+	{ 0xBB, "VK_OEM_PLUS",                        13      },	// '=+' any country
+	{ 0xBC, "VK_OEM_COMMA",                       53      },	// ',<' any country
+	{ 0xBD, "VK_OEM_MINUS",                       12      },	// '-_' any country
+	{ 0xBE, "VK_OEM_PERIOD",                      54      },	// '.>' any country
+	{ 0xBF, "VK_OEM_2",                           55      },	// '/?' for US
+	{ 0xC0, "VK_OEM_3",                            1      },	// '`~' for US
+	{ 0xC3, "VK_GAMEPAD_A",                        0      },	// reserved
+	{ 0xC4, "VK_GAMEPAD_B",                        0      },	// reserved
+	{ 0xC5, "VK_GAMEPAD_X",                        0      },	// reserved
+	{ 0xC6, "VK_GAMEPAD_Y",                        0      },	// reserved
+	{ 0xC7, "VK_GAMEPAD_RIGHT_SHOULDER",           0      },	// reserved
+	{ 0xC8, "VK_GAMEPAD_LEFT_SHOULDER",            0      },	// reserved
+	{ 0xC9, "VK_GAMEPAD_LEFT_TRIGGER",             0      },	// reserved
+	{ 0xCA, "VK_GAMEPAD_RIGHT_TRIGGER",            0      },	// reserved
+	{ 0xCB, "VK_GAMEPAD_DPAD_UP",                  0      },	// reserved
+	{ 0xCC, "VK_GAMEPAD_DPAD_DOWN",                0      },	// reserved
+	{ 0xCD, "VK_GAMEPAD_DPAD_LEFT",                0      },	// reserved
+	{ 0xCE, "VK_GAMEPAD_DPAD_RIGHT",               0      },	// reserved
+	{ 0xCF, "VK_GAMEPAD_MENU",                     0      },	// reserved
+	{ 0xD0, "VK_GAMEPAD_VIEW",                     0      },	// reserved
+	{ 0xD1, "VK_GAMEPAD_LEFT_THUMBSTICK_BUTTON",   0      },	// reserved
+	{ 0xD2, "VK_GAMEPAD_RIGHT_THUMBSTICK_BUTTON",   0      },	// reserved
+	{ 0xD3, "VK_GAMEPAD_LEFT_THUMBSTICK_UP",       0      },	// reserved
+	{ 0xD4, "VK_GAMEPAD_LEFT_THUMBSTICK_DOWN",     0      },	// reserved
+	{ 0xD5, "VK_GAMEPAD_LEFT_THUMBSTICK_RIGHT",    0      },	// reserved
+	{ 0xD6, "VK_GAMEPAD_LEFT_THUMBSTICK_LEFT",     0      },	// reserved
+	{ 0xD7, "VK_GAMEPAD_RIGHT_THUMBSTICK_UP",      0      },	// reserved
+	{ 0xD8, "VK_GAMEPAD_RIGHT_THUMBSTICK_DOWN",    0      },	// reserved
+	{ 0xD9, "VK_GAMEPAD_RIGHT_THUMBSTICK_RIGHT",   0      },	// reserved
+	{ 0xDA, "VK_GAMEPAD_RIGHT_THUMBSTICK_LEFT",    0      },	// reserved
+	{ 0xDB, "VK_OEM_4",                           27      },	// '[{' for US
+	{ 0xDC, "VK_OEM_5",                           29      },	// '\|' for US
+	{ 0xDD, "VK_OEM_6",                           28      },	// ']}' for US
+	{ 0xDE, "VK_OEM_7",                           41      },	// ''"' for US
+	{ 0xDF, "VK_OEM_8",                            0      },
+	{ 0xE1, "VK_OEM_AX",                           0      },	// 'AX' key on Japanese AX kbd
+	{ 0xE2, "VK_OEM_102",                          0      },	// "<>" or "\|" on RT 102-key kbd.
+	{ 0xE3, "VK_ICO_HELP",                         0      },	// Help key on ICO
+	{ 0xE4, "VK_ICO_00",                           0      },	// 00 key on ICO
+	{ 0xE5, "VK_PROCESSKEY",                       0      },
+	{ 0xE6, "VK_ICO_CLEAR",                        0      },
+	{ 0xE7, "VK_PACKET",                           0      },
+	{ 0xE9, "VK_OEM_RESET",                        0      },
+	{ 0xEA, "VK_OEM_JUMP",                         0      },
+	{ 0xEB, "VK_OEM_PA1",                          0      },
+	{ 0xEC, "VK_OEM_PA2",                          0      },
+	{ 0xED, "VK_OEM_PA3",                          0      },
+	{ 0xEE, "VK_OEM_WSCTRL",                       0      },
+	{ 0xEF, "VK_OEM_CUSEL",                        0      },
+	{ 0xF0, "VK_OEM_ATTN",                         0      },
+	{ 0xF1, "VK_OEM_FINISH",                       0      },
+	{ 0xF2, "VK_OEM_COPY",                         0      },
+	{ 0xF3, "VK_OEM_AUTO",                         0      },
+	{ 0xF4, "VK_OEM_ENLW",                         0      },
+	{ 0xF5, "VK_OEM_BACKTAB",                      0      },
+	{ 0xF6, "VK_ATTN",                             0      },
+	{ 0xF7, "VK_CRSEL",                            0      },
+	{ 0xF8, "VK_EXSEL",                            0      },
+	{ 0xF9, "VK_EREOF",                            0      },
+	{ 0xFA, "VK_PLAY",                             0      },
+	{ 0xFB, "VK_ZOOM",                             0      },
+	{ 0xFC, "VK_NONAME",                           0      },
+	{ 0xFD, "VK_PA1",                              0      },
+	{ 0xFE, "VK_OEM_CLEAR",                        0      },
+};
+
+//
+// German, the letters Y/Z swap, and the OEM keys move around
+//
+static constexpr KeyDesc movesDE[] =
+{
+	{ 0x59, "VK_Y",        46 },
+	{ 0x5A, "VK_Z",        22 },
+	{ 0xBA, "VK_OEM_1",    27 },	// 'Ü'
+	{ 0xBB, "VK_OEM_PLUS", 28 },	// '+*'
+	{ 0xBD, "VK_OEM_MINUS",55 },	// '-_'
+	{ 0xBF, "VK_OEM_2",    42 },	// '#', next to Enter
+	{ 0xC0, "VK_OEM_3",    40 },	// 'Ö'
+	{ 0xDB, "VK_OEM_4",    12 },	// 'ß?'
+	{ 0xDC, "VK_OEM_5",     1 },	// '^°'
+	{ 0xDD, "VK_OEM_6",    13 },	// '´`'
+	{ 0xDE, "VK_OEM_7",    41 },	// 'Ä'
+	{ 0xE2, "VK_OEM_102",  45 },	// '<>'
+};
+
+//-----------------------------------------------------------------------------
+
+template <> struct KeyLayout<KeyLayoutUS>
+{
+	static constexpr KeyTable table = KeyBuildTable(keysUS);
+};
+
+template <> struct KeyLayout<KeyLayoutDE>
+{
+	static constexpr KeyTable table = KeyMoveTable(KeyLayout<KeyLayoutUS>::table, movesDE);
+};
+
+constexpr KeyTable KeyLayout<KeyLayoutUS>::table;
+constexpr KeyTable KeyLayout<KeyLayoutDE>::table;
+
+//-----------------------------------------------------------------------------
+//
+// Coverage checks
+//
+template <size_t Count>
+constexpr bool KeysInOrder(const KeyDesc (&keys)[ Count ])
+{
+	for (size_t idx = 1; idx < Count; ++idx)
+	{
+		if (keys[ idx - 1 ].vk >= keys[ idx ].vk)
+			return false;
+	}
+	return true;
+}
+
+// The commands live in the gaps between the key codes, so the two can't overlap
+constexpr bool KeyCodeValid(unsigned char code)
+{
+	return (code < USB_BREAK) &&
+		   (code != USB_BufferClear) &&
+		   ((code < USB_MouseLeft) || (code > USB_MouseDown)) &&
+		   (code != USB_MouseLeftButton) && (code != USB_MouseRightButton) && (code != USB_MouseMiddleButton) &&
+		   (code != USB_ScrollWheelUp) && (code != USB_ScrollWheelDown) &&
+		   (code != USB_MouseSlow) && (code != USB_MouseFast) &&
+		   (code != USB_StatusLEDRead);
+}
+
+constexpr bool KeyTableValid(const KeyTable& table)
+{
+	for (int vk = 0; vk < 256; ++vk)
+	{
+		if ((table.code[ vk ] && !KeyCodeValid(table.code[ vk ])) ||
+			(table.extCode[ vk ] && !KeyCodeValid(table.extCode[ vk ])))
+			return false;
+	}
+	return true;
+}
+
+// No two VKs on the same key position, other than the left / right aliases
+constexpr bool KeyTableUnique(const KeyTable& table)
+{
+	for (int vk = 0; vk < 256; ++vk)
+	{
+		if (!table.code[ vk ] || (vk == VK_SHIFT) || (vk == VK_CONTROL) || (vk == VK_MENU))
+			continue;
+
+		for (int other = vk + 1; other < 256; ++other)
+		{
+			if (table.code[ other ] == table.code[ vk ])
+				return false;
+		}
+	}
+	return true;
+}
+
+static_assert(KeysInOrder(keysUS), "keysUS has to be in VK order, with no repeats");
+static_assert(KeysInOrder(movesDE), "movesDE has to be in VK order, with no repeats");
+static_assert(KeyTableValid(KeyLayout<KeyLayoutUS>::table), "US key code collides with a command");
+static_assert(KeyTableValid(KeyLayout<KeyLayoutDE>::table), "DE key code collides with a command");
+static_assert(KeyTableUnique(KeyLayout<KeyLayoutUS>::table), "US has two keys on one position");
+static_assert(KeyTableUnique(KeyLayout<KeyLayoutDE>::table), "DE has two keys on one position");
+
+// The aliases have to agree with the left hand keys
+static_assert(KeyLayout<KeyLayoutUS>::table.code[ VK_SHIFT ] == KeyLayout<KeyLayoutUS>::table.code[ VK_LSHIFT ], "VK_SHIFT");
+static_assert(KeyLayout<KeyLayoutUS>::table.code[ VK_CONTROL ] == KeyLayout<KeyLayoutUS>::table.code[ VK_LCONTROL ], "VK_CONTROL");
+static_assert(KeyLayout<KeyLayoutUS>::table.code[ VK_MENU ] == KeyLayout<KeyLayoutUS>::table.code[ VK_LMENU ], "VK_MENU");
+static_assert(KeyLayout<KeyLayoutUS>::table.extCode[ VK_CONTROL ] == KeyLayout<KeyLayoutUS>::table.code[ VK_RCONTROL ], "VK_CONTROL extended");
+static_assert(KeyLayout<KeyLayoutUS>::table.extCode[ VK_MENU ] == KeyLayout<KeyLayoutUS>::table.code[ VK_RMENU ], "VK_MENU extended");
+
+// Every letter and digit, nothing can be missing there
+constexpr bool KeyRangeMapped(const KeyTable& table, int first, int last)
+{
+	for (int vk = first; vk <= last; ++vk)
+	{
+		if (!table.code[ vk ])
+			return false;
+	}
+	return true;
+}
+
+static_assert(KeyRangeMapped(KeyLayout<KeyLayoutUS>::table, '0', '9'), "digit missing");
+static_assert(KeyRangeMapped(KeyLayout<KeyLayoutUS>::table, 'A', 'Z'), "letter missing");
+static_assert(KeyRangeMapped(KeyLayout<KeyLayoutUS>::table, VK_F1, VK_F12), "function key missing");
+static_assert(KeyRangeMapped(KeyLayout<KeyLayoutUS>::table, VK_NUMPAD0, VK_MULTIPLY), "keypad key missing");
+
+//-----------------------------------------------------------------------------
+
+static const KeyTable* layoutTables[ KeyLayoutCount ] =
+{
+	&KeyLayout<KeyLayoutUS>::table,
+	&KeyLayout<KeyLayoutDE>::table,
+};
+
+static const char* layoutNames[ KeyLayoutCount ] =
+{
+	"us",
+	"de",
+};
+
+static const KeyTable* pLayoutTable = &KeyLayout<KeyLayoutUS>::table;
+
+//
+// --keys, a table per target, built from the layout when it's loaded
+//
+static const int KeyChordMax = 64;
+
+static KeyTable remapTables[ SerialMaxPorts ];
+static const KeyTable* targetTables[ SerialMaxPorts ];	// remapTables, nullptr for just the layout
+static int  remapCount = 0;
+
+static KeyChord chords[ KeyChordMax ];
+static int chordCount = 0;
+
+static unsigned char chordHeads[ SerialMaxPorts ][ 256 ];	// 1 + the first chord each key finishes, 0 for none
+
+bool KeySetLayout(const char* name)
+{
+	for (int idx = 0; idx < KeyLayoutCount; ++idx)
+	{
+		if (0 == _stricmp(name, layoutNames[ idx ]))
+		{
+			pLayoutTable = layoutTables[ idx ];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+unsigned char KeyToMakeCode(int target, WORD vkCode, bool bExtended)
+{
+	const KeyTable* pTable = ((unsigned int)target < (unsigned int)SerialMaxPorts) ? targetTables[ target ] : nullptr;
+
+	if (!pTable)
+		pTable = pLayoutTable;
+
+	return bExtended ? pTable->extCode[ vkCode & 0xFF ] : pTable->code[ vkCode & 0xFF ];
+}
+
+unsigned char KeyToLayoutCode(WORD vkCode, bool bExtended)
+{
+	return bExtended ? pLayoutTable->extCode[ vkCode & 0xFF ] : pLayoutTable->code[ vkCode & 0xFF ];
+}
+
+//-----------------------------------------------------------------------------
+//
+// VK from a name, with or without the VK_, 0 if there's no such key
+//
+static int KeyFromName(const char* pName)
+{
+	if (0 == _strnicmp(pName, "VK_", 3))
+		pName += 3;
+
+	for (int vk = 1; vk < 256; ++vk)
+	{
+		const char* pKeyName = pLayoutTable->name[ vk ];
+
+		if (pKeyName && (0 == _stricmp(pName, pKeyName + 3)))
+			return vk;
+	}
+
+	return 0;
+}
+
+// Make code from a name, "#code", or "none", -1 if it's none of those
+static int KeyCodeFromName(const char* pName)
+{
+	if (0 == _stricmp(pName, "none"))
+		return 0;
+
+	int code = 0;
+
+	if ('#' == pName[ 0 ])
+	{
+		char* pEnd = nullptr;
+		code = (int)strtol(pName + 1, &pEnd, 10);
+
+		if (!pEnd || *pEnd)
+			return -1;
+	}
+	else
+	{
+		int vk = KeyFromName(pName);
+		code = vk ? pLayoutTable->code[ vk ] : 0;
+	}
+
+	// Can't let a remap turn into a command
+	if ((code <= 0) || (code > 0xFF) || !KeyCodeValid((unsigned char)code))
+		return -1;
+
+	return code;
+}
+
+// Strip the spaces off both ends, in place
+static char* KeyTrim(char* pText)
+{
+	while (' ' == *pText || '\t' == *pText)
+		pText++;
+
+	size_t len = strlen(pText);
+
+	while (len && ((' ' == pText[ len - 1 ]) || ('\t' == pText[ len - 1 ])))
+		pText[ --len ] = 0;
+
+	return pText;
+}
+
+//-----------------------------------------------------------------------------
+//
+// One key onto another position, the console only reports the generic
+// modifiers, so the sided ones carry over to those too, the right hand
+// one to the extended code.  The layout has Left Shift for both, so an
+// extended Shift is Left Shift, until RSHIFT is remapped
+//
+static void KeyRemap(KeyTable& table, int vk, unsigned char code)
+{
+	table.code[ vk ] = code;
+	table.extCode[ vk ] = code;
+
+	switch (vk)
+	{
+	case VK_LSHIFT:   table.code[ VK_SHIFT ] = code; break;
+	case VK_RSHIFT:   table.extCode[ VK_SHIFT ] = code; break;
+	case VK_LCONTROL: table.code[ VK_CONTROL ] = code; break;
+	case VK_RCONTROL: table.extCode[ VK_CONTROL ] = code; break;
+	case VK_LMENU:    table.code[ VK_MENU ] = code; break;
+	case VK_RMENU:    table.extCode[ VK_MENU ] = code; break;
+	}
+}
+
+// "HELD+HELD+KEY -> OUT+OUT", false if it doesn't parse
+static bool KeyParseChord(char* pSpec, int target)
+{
+	char* pArrow = strstr(pSpec, "->");
+
+	if (!pArrow || (chordCount >= KeyChordMax))
+		return false;
+
+	*pArrow = 0;
+
+	KeyChord chord;
+	memset(&chord, 0, sizeof(chord));
+
+	// Everything before the last key is held
+	int keyCount = 0;
+	int lastVk = 0;
+
+	for (char* pName = strtok(pSpec, "+"); pName; pName = strtok(nullptr, "+"))
+	{
+		int vk = KeyFromName(KeyTrim(pName));
+
+		if (!vk)
+			return false;
+
+		if (lastVk)
+		{
+			if (keyCount >= (int)sizeof(chord.held))
+				return false;
+
+			chord.held[ keyCount++ ] = (unsigned char)lastVk;
+		}
+
+		lastVk = vk;
+	}
+
+	for (char* pName = strtok(pArrow + 2, "+"); pName; pName = strtok(nullptr, "+"))
+	{
+		int code = KeyCodeFromName(KeyTrim(pName));
+
+		if ((code <= 0) || (chord.codeCount >= sizeof(chord.codes)))
+			return false;
+
+		chord.codes[ chord.codeCount++ ] = (unsigned char)code;
+	}
+
+	if (!lastVk || !chord.codeCount)
+		return false;
+
+	// In front, so [keys COM4] wins over [keys]
+	chord.next = chordHeads[ target ][ lastVk ];
+	chords[ chordCount++ ] = chord;
+	chordHeads[ target ][ lastVk ] = (unsigned char)chordCount;
+
+	return true;
+}
+
+// One section, false on the first line that doesn't make sense
+static bool KeyLoadSection(const char* pIniPath, const char* pSection, int target,
+						   char* pBadLine, size_t badLineSize)
+{
+	// Lines, each ends in a 0, and there's an extra 0 at the end
+	static char section[ 16 * 1024 ];
+
+	DWORD len = GetPrivateProfileSectionA(pSection, section, sizeof(section), pIniPath);
+
+	for (char* pLine = section; (pLine < section + len) && *pLine; pLine += strlen(pLine) + 1)
+	{
+		char line[ 256 ];
+		snprintf(line, sizeof(line), "%s", pLine);
+
+		char* pEquals = strchr(line, '=');
+		bool bOk = false;
+
+		if (pEquals)
+		{
+			*pEquals = 0;
+
+			char* pFrom = KeyTrim(line);
+			char* pTo   = KeyTrim(pEquals + 1);
+
+			if (0 == _stricmp(pFrom, "chord"))
+			{
+				bOk = KeyParseChord(pTo, target);
+			}
+			else
+			{
+				int vk = KeyFromName(pFrom);
+				int code = KeyCodeFromName(pTo);
+
+				// none parses as 0, and a key can be relayed as nothing
+				if (vk && ((code > 0) || (0 == _stricmp(pTo, "none"))))
+				{
+					KeyRemap(remapTables[ target ], vk, (unsigned char)code);
+					bOk = true;
+				}
+			}
+		}
+
+		if (!bOk)
+		{
+			snprintf(pBadLine, badLineSize, "[%s] %s", pSection, pLine);
+			return false;
+		}
+
+		remapCount++;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool KeyLoadRemap(const char* pFileName, int target, const char* targetName,
+				  char* pBadLine, size_t badLineSize)
+{
+	if ((target < 0) || (target >= SerialMaxPorts))
+		return false;
+
+	// Without a directory, the profile calls look in the Windows directory
+	char iniPath[ MAX_PATH ];
+
+	if (!GetFullPathNameA(pFileName, sizeof(iniPath), iniPath, nullptr) ||
+		(INVALID_FILE_ATTRIBUTES == GetFileAttributesA(iniPath)))
+	{
+		snprintf(pBadLine, badLineSize, "can't read %s", pFileName);
+		return false;
+	}
+
+	remapTables[ target ] = *pLayoutTable;
+	targetTables[ target ] = &remapTables[ target ];
+
+	char section[ 64 ];
+	snprintf(section, sizeof(section), "keys %s", targetName ? targetName : "");
+
+	return KeyLoadSection(iniPath, "keys", target, pBadLine, badLineSize) &&
+		   KeyLoadSection(iniPath, section, target, pBadLine, badLineSize);
+}
+
+//-----------------------------------------------------------------------------
+//
+// The hook says which Control, the console only says Control
+//
+static bool KeyHeld(const KeySet& keys, WORD vkCode)
+{
+	if (keys.Contains(vkCode))
+		return true;
+
+	switch (vkCode)
+	{
+	case VK_SHIFT:    return keys.Contains(VK_LSHIFT) || keys.Contains(VK_RSHIFT);
+	case VK_CONTROL:  return keys.Contains(VK_LCONTROL) || keys.Contains(VK_RCONTROL);
+	case VK_MENU:     return keys.Contains(VK_LMENU) || keys.Contains(VK_RMENU);
+	case VK_LSHIFT:
+	case VK_RSHIFT:   return keys.Contains(VK_SHIFT);
+	case VK_LCONTROL:
+	case VK_RCONTROL: return keys.Contains(VK_CONTROL);
+	case VK_LMENU:
+	case VK_RMENU:    return keys.Contains(VK_MENU);
+	}
+
+	return false;
+}
+
+const KeyChord* KeyFindChord(int target, WORD vkCode, const KeySet& keys)
+{
+	if ((target < 0) || (target >= SerialMaxPorts))
+		return nullptr;
+
+	for (int idx = chordHeads[ target ][ vkCode & 0xFF ]; idx; idx = chords[ idx - 1 ].next)
+	{
+		const KeyChord& chord = chords[ idx - 1 ];
+		bool bMatch = true;
+
+		for (int held = 0; held < (int)sizeof(chord.held) && chord.held[ held ]; ++held)
+		{
+			if (!KeyHeld(keys, chord.held[ held ]))
+				bMatch = false;
+		}
+
+		if (bMatch)
+			return &chord;
+	}
+
+	return nullptr;
+}
+
+int KeyRemapCount()
+{
+	return remapCount;
+}
+
+//-----------------------------------------------------------------------------
+
+const char* KeyToString(WORD vkCode)
+{
+	// Anything without a name is just the hex
+	static char hexNames[ 256 ][ 5 ];
+
+	const char* pName = pLayoutTable->name[ vkCode & 0xFF ];
+
+	if (!pName)
+	{
+		char* pHex = hexNames[ vkCode & 0xFF ];
+
+		if (!pHex[ 0 ])
+		{
+			static const char hex[] = "0123456789ABCDEF";
+			pHex[ 0 ] = '0';
+			pHex[ 1 ] = 'x';
+			pHex[ 2 ] = hex[ (vkCode >> 4) & 0xF ];
+			pHex[ 3 ] = hex[ vkCode & 0xF ];
+		}
+
+		pName = pHex;
+	}
+
+	return pName;
+}
+
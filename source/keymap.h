@@ -0,0 +1,128 @@
+//
+// keymap.h - Windows Virtual Key to KM232 key code
+//
+// There is one list of key descriptors, and the make code and name
+// tables are built from it by the compiler.  A layout is a
+// specialization of KeyLayout, usually the US list with a few keys moved,
+// so adding one doesn't mean another pair of 256 entry tables to keep in
+// sync by hand.
+//
+#pragma once
+
+#include <windows.h>
+
+#include "keyset.h"
+
+struct KeyDesc
+{
+	unsigned char vk;
+	const char*   name;
+	unsigned char code;		// KM232 make code, 0 if the key isn't relayed
+	unsigned char extCode;	// make code for the extended (right hand / keypad) key, 0 if it's the same
+};
+
+// Everything a lookup needs, built at compile time
+struct KeyTable
+{
+	unsigned char code[ 256 ];
+	unsigned char extCode[ 256 ];
+	const char*   name[ 256 ];
+};
+
+enum KeyLayoutId
+{
+	KeyLayoutUS,
+	KeyLayoutDE,	// QWERTZ, the host is set to German
+
+	KeyLayoutCount
+};
+
+// Each specialization has a static constexpr KeyTable table
+template <KeyLayoutId Layout> struct KeyLayout;
+
+//-----------------------------------------------------------------------------
+//
+// Table builders, for the specializations
+//
+template <size_t Count>
+constexpr KeyTable KeyBuildTable(const KeyDesc (&keys)[ Count ])
+{
+	KeyTable table {};
+
+	for (size_t idx = 0; idx < Count; ++idx)
+	{
+		table.code[ keys[ idx ].vk ]    = keys[ idx ].code;
+		table.extCode[ keys[ idx ].vk ] = keys[ idx ].extCode ? keys[ idx ].extCode : keys[ idx ].code;
+		table.name[ keys[ idx ].vk ]    = keys[ idx ].name;
+	}
+
+	return table;
+}
+
+// Same keys, some of them in different places, names and extCode aren't touched
+template <size_t Count>
+constexpr KeyTable KeyMoveTable(const KeyTable& base, const KeyDesc (&moves)[ Count ])
+{
+	KeyTable table = base;
+
+	for (size_t idx = 0; idx < Count; ++idx)
+	{
+		table.code[ moves[ idx ].vk ]    = moves[ idx ].code;
+		table.extCode[ moves[ idx ].vk ] = moves[ idx ].code;
+	}
+
+	return table;
+}
+
+//-----------------------------------------------------------------------------
+
+// false if there's no layout by that name (us, de)
+bool KeySetLayout(const char* name);
+
+// 0 if the key isn't relayed to the target, with the target's remaps
+unsigned char KeyToMakeCode(int target, WORD vkCode, bool bExtended = false);
+
+// Same, but only the layout, for typing text, and finding the lock keys
+unsigned char KeyToLayoutCode(WORD vkCode, bool bExtended = false);
+
+//-----------------------------------------------------------------------------
+//
+// Remaps and chords, from an ini file.  [keys] is for every target, and
+// [keys COM4] only for the target on COM4, on top of [keys]
+//
+//   LWIN=LMENU        the Windows key is Alt on the target
+//   F12=none          not relayed at all
+//   PAUSE=#126        a make code, when there's no VK for it
+//   chord=RCONTROL+BACK -> LCONTROL+LMENU+DELETE
+//
+// A chord is sent instead of the last key, when it goes down with the
+// others held, and broken in reverse when it comes back up.  The held
+// keys are still down on the target.  Names are the VK names, with or
+// without the VK_.  LSHIFT, RCONTROL and the like work from the console
+// too, it only says Shift, but the scan code says which one.
+//
+// It all gets compiled into a KeyTable per target, so a key is still one
+// load, and the chords hang off the key that finishes them.  Load after
+// --layout, false on a line that doesn't make sense, and it's copied
+// into pBadLine.
+//
+struct KeyChord
+{
+	unsigned char held[ 3 ];	// VKs, 0 for none
+	unsigned char codeCount;
+	unsigned char codes[ 4 ];	// make codes, in the order they go down
+	unsigned char next;			// 1 + the next chord for the same key, 0 at the end
+};
+
+bool KeyLoadRemap(const char* pFileName, int target, const char* targetName,
+				  char* pBadLine, size_t badLineSize);
+
+// The chord vkCode finishes on the target, with what's in keys, nullptr
+// if there isn't one
+const KeyChord* KeyFindChord(int target, WORD vkCode, const KeySet& keys);
+
+// Remap lines, and chords, across all the targets
+int KeyRemapCount();
+
+const char* KeyToString(WORD vkCode);
+
@@ -0,0 +1,97 @@
+//
+// keyset.h - Set of keys that are down
+//
+// A 256 bit map, for asking if a key is down, plus an intrusive doubly
+// linked list through the same 256 slots, so we know which keys are the
+// oldest, to simulate rollover.  Press and release are O(1), and
+// nothing is ever allocated.
+//
+#pragma once
+
+#include <windows.h>
+
+class KeySet
+{
+public:
+	KeySet()
+	{
+		Clear();
+	}
+
+	void Clear()
+	{
+		for (int idx = 0; idx < 8; ++idx)
+			bits[ idx ] = 0;
+
+		head = tail = -1;
+		count = 0;
+	}
+
+	bool Contains(WORD vkCode) const
+	{
+		unsigned int vk = vkCode & 0xFF;
+		return 0 != (bits[ vk >> 5 ] & (1u << (vk & 31)));
+	}
+
+	// Add as the newest key, false if it was already down
+	bool Add(WORD vkCode)
+	{
+		if (Contains(vkCode))
+			return false;
+
+		short vk = (short)(vkCode & 0xFF);
+		bits[ vk >> 5 ] |= (1u << (vk & 31));
+
+		prev[ vk ] = tail;
+		next[ vk ] = -1;
+
+		if (tail >= 0)
+			next[ tail ] = vk;
+		else
+			head = vk;
+
+		tail = vk;
+		count++;
+		return true;
+	}
+
+	// false if it wasn't down
+	bool Remove(WORD vkCode)
+	{
+		if (!Contains(vkCode))
+			return false;
+
+		short vk = (short)(vkCode & 0xFF);
+		bits[ vk >> 5 ] &= ~(1u << (vk & 31));
+
+		if (prev[ vk ] >= 0)
+			next[ prev[ vk ] ] = next[ vk ];
+		else
+			head = next[ vk ];
+
+		if (next[ vk ] >= 0)
+			prev[ next[ vk ] ] = prev[ vk ];
+		else
+			tail = prev[ vk ];
+
+		count--;
+		return true;
+	}
+
+	bool Empty() const { return 0 == count; }
+	int  Count() const { return count; }
+
+	// Walk in age order, oldest first, -1 at the end
+	int Oldest() const { return head; }
+	int Newest() const { return tail; }
+	int Next(int vk) const { return next[ vk & 0xFF ]; }
+
+private:
+	unsigned int bits[ 8 ];
+	short prev[ 256 ];
+	short next[ 256 ];
+	short head;		// oldest
+	short tail;		// newest
+	int   count;
+};
+
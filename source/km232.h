@@ -0,0 +1,45 @@
+//
+// km232.h - Shared definitions for the Keyboard + Mouse Relay tool
+//
+// Command constants for the Hagstrom USB-KM232 (and the ASC232 variant),
+// shared between the input handlers and the serial layer
+//
+#pragma once
+
+#include <windows.h>
+
+//-----------------------------------------------------------------------------
+//
+// KM232 USB COMMAND CONSTANTS
+//
+const unsigned char USB_BufferClear   = 0x38;			// Like a device Reset
+
+const unsigned char USB_MouseLeft     = 0x42;
+const unsigned char USB_MouseRight    = 0x43;
+const unsigned char USB_MouseUp       = 0x44;
+const unsigned char USB_MouseDown     = 0x45;
+
+const unsigned char USB_MouseLeftButton   = 0x49;
+const unsigned char USB_MouseRightButton  = 0x4A;
+const unsigned char USB_MouseMiddleButton = 0x4D;
+
+const unsigned char USB_ScrollWheelUp   = 0x57;
+const unsigned char USB_ScrollWheelDown = 0x58;
+
+const unsigned char USB_MouseSlow     = 0x6D;
+const unsigned char USB_MouseFast     = 0x6F;
+
+const unsigned char USB_StatusLEDRead = 0x7F;			// Status of LEDs
+
+// And masks for the StatusLEDRead Command
+const unsigned char StatusNumLock    = 0x01;
+const unsigned char StatusCapsLock   = 0x02;
+const unsigned char StatusScrollLock = 0x04;
+
+const unsigned char USB_BREAK = 128;
+
+//-----------------------------------------------------------------------------
+// Globals owned by main.cpp
+extern HANDLE hStdin;
+extern HANDLE hStdOut;
+
@@ -0,0 +1,231 @@
+//
+// latency.cpp - Event to wire latency histograms
+//
+// Log scaled buckets, 4 per power of two, in microseconds, so a bucket is
+// never more than 25% wide.  Each port's writer thread records into the
+// same histograms, so the counters are relaxed atomic adds, and the
+// display can read them while the relay is running.
+//
+
+#include "latency.h"
+#include "km232.h"
+#include "status.h"
+
+#include <intrin.h>
+
+#include <atomic>
+
+//-----------------------------------------------------------------------------
+
+static const int LatencyBuckets = 128;
+
+struct LatencyHistogram
+{
+	std::atomic<unsigned int> counts[ LatencyBuckets ];
+	std::atomic<unsigned int> total;
+	std::atomic<unsigned int> maxUs;
+};
+
+static LatencyHistogram histograms[ LatencyClassCount ][ LatencySpanCount ];
+
+static const char* LatencyClassNames[ LatencyClassCount ] =
+{
+	"key make",
+	"key break",
+	"mouse move",
+	"button",
+	"other",
+};
+
+static const char* LatencySpanNames[ LatencySpanCount ] =
+{
+	"capture->enqueue",
+	"enqueue->write",
+	"write->echo",
+	"capture->echo",
+};
+
+//-----------------------------------------------------------------------------
+
+static LONGLONG QpcFrequency()
+{
+	static LONGLONG frequency = 0;
+
+	if (0 == frequency)
+	{
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		frequency = freq.QuadPart;
+	}
+
+	return frequency;
+}
+
+static unsigned int QpcToMicroseconds(LONGLONG ticks)
+{
+	if (ticks <= 0)
+		return 0;
+
+	LONGLONG us = (ticks * 1000000) / QpcFrequency();
+
+	return (us > 0xFFFFFFFF) ? 0xFFFFFFFF : (unsigned int)us;
+}
+
+//-----------------------------------------------------------------------------
+
+static int BucketOf(unsigned int us)
+{
+	if (us < 8)
+		return (int)us;
+
+	unsigned long msb;
+	_BitScanReverse(&msb, us);
+
+	int bucket = 8 + (((int)msb - 3) * 4) + (int)((us >> (msb - 2)) & 3);
+
+	return (bucket < LatencyBuckets) ? bucket : (LatencyBuckets - 1);
+}
+
+static unsigned int BucketLow(int bucket)
+{
+	if (bucket < 8)
+		return (unsigned int)bucket;
+
+	int msb = ((bucket - 8) / 4) + 3;
+	int sub = (bucket - 8) & 3;
+
+	return (1u << msb) | ((unsigned int)sub << (msb - 2));
+}
+
+//-----------------------------------------------------------------------------
+
+static void HistogramAdd(LatencyHistogram& hist, unsigned int us)
+{
+	hist.counts[ BucketOf(us) ].fetch_add(1, std::memory_order_relaxed);
+	hist.total.fetch_add(1, std::memory_order_relaxed);
+
+	unsigned int maxUs = hist.maxUs.load(std::memory_order_relaxed);
+
+	while ((us > maxUs) && !hist.maxUs.compare_exchange_weak(maxUs, us, std::memory_order_relaxed))
+		;
+}
+
+// Returns microseconds
+static unsigned int HistogramPercentile(const LatencyHistogram& hist, unsigned int percent)
+{
+	unsigned int total = hist.total.load(std::memory_order_relaxed);
+
+	if (0 == total)
+		return 0;
+
+	// total * percent goes past 32 bits after about 43 million samples
+	ULONGLONG rank = (((ULONGLONG)total * percent) + 99) / 100;
+	ULONGLONG seen = 0;
+
+	for (int bucket = 0; bucket < LatencyBuckets; ++bucket)
+	{
+		seen += hist.counts[ bucket ].load(std::memory_order_relaxed);
+
+		if (seen >= rank)
+			return BucketLow(bucket);
+	}
+
+	return hist.maxUs.load(std::memory_order_relaxed);
+}
+
+//-----------------------------------------------------------------------------
+
+LatencyClass LatencyClassOf(unsigned char command)
+{
+	switch (command)
+	{
+	case USB_MouseLeft:
+	case USB_MouseRight:
+	case USB_MouseUp:
+	case USB_MouseDown:
+	case USB_MouseSlow:
+	case USB_MouseFast:
+		return LatencyMouseMove;
+
+	case USB_MouseLeftButton:
+	case USB_MouseRightButton:
+	case USB_MouseMiddleButton:
+	case USB_MouseLeftButton + USB_BREAK:
+	case USB_MouseRightButton + USB_BREAK:
+	case USB_MouseMiddleButton + USB_BREAK:
+	case USB_ScrollWheelUp:
+	case USB_ScrollWheelDown:
+		return LatencyButton;
+
+	case USB_BufferClear:
+	case USB_StatusLEDRead:
+		return LatencyOther;
+	}
+
+	// Everything else is a key code, the commands above live in the gaps
+	return (command & USB_BREAK) ? LatencyKeyBreak : LatencyKeyMake;
+}
+
+//-----------------------------------------------------------------------------
+
+void LatencyRecord(unsigned char command, const LatencyStamps& stamps, LONGLONG echo)
+{
+	LatencyHistogram* pHist = histograms[ LatencyClassOf(command) ];
+
+	HistogramAdd(pHist[ SpanQueue ],  QpcToMicroseconds(stamps.enqueue - stamps.capture));
+	HistogramAdd(pHist[ SpanWriter ], QpcToMicroseconds(stamps.write - stamps.enqueue));
+	HistogramAdd(pHist[ SpanWire ],   QpcToMicroseconds(echo - stamps.write));
+	HistogramAdd(pHist[ SpanTotal ],  QpcToMicroseconds(echo - stamps.capture));
+}
+
+//-----------------------------------------------------------------------------
+
+void LatencyShow(int firstRow)
+{
+	if (!StatusEnabled())
+		return;
+
+	StatusLine(firstRow, "latency ms      count   p50(total)  p99    max    p50(wire)");
+
+	for (int cls = 0; cls < LatencyClassCount; ++cls)
+	{
+		const LatencyHistogram& total = histograms[ cls ][ SpanTotal ];
+		const LatencyHistogram& wire  = histograms[ cls ][ SpanWire ];
+
+		StatusLine(firstRow + 1 + cls, "%-12s %8u   %7.2f %7.2f %7.2f   %7.2f",
+				   LatencyClassNames[ cls ],
+				   total.total.load(std::memory_order_relaxed),
+				   HistogramPercentile(total, 50) / 1000.0,
+				   HistogramPercentile(total, 99) / 1000.0,
+				   total.maxUs.load(std::memory_order_relaxed) / 1000.0,
+				   HistogramPercentile(wire, 50) / 1000.0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void LatencyDump(FILE* pFile)
+{
+	fprintf(pFile, "\nLatency (ms)\n");
+
+	for (int cls = 0; cls < LatencyClassCount; ++cls)
+	{
+		if (0 == histograms[ cls ][ SpanTotal ].total.load())
+			continue;
+
+		fprintf(pFile, "%s\n", LatencyClassNames[ cls ]);
+
+		for (int span = 0; span < LatencySpanCount; ++span)
+		{
+			const LatencyHistogram& hist = histograms[ cls ][ span ];
+
+			fprintf(pFile, "  %-18s n=%-8u p50 %7.3f  p99 %7.3f  max %7.3f\n",
+					LatencySpanNames[ span ],
+					hist.total.load(),
+					HistogramPercentile(hist, 50) / 1000.0,
+					HistogramPercentile(hist, 99) / 1000.0,
+					hist.maxUs.load() / 1000.0);
+		}
+	}
+}
+
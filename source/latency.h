@@ -0,0 +1,62 @@
+//
+// latency.h - Event to wire latency histograms
+//
+// Every command is stamped with QueryPerformanceCounter when the input is
+// captured, when it is handed to the writer thread, when the write
+// completes, and when the device echo comes back.  The writer thread
+// bins the differences, per class of command, so we can tell a slow
+// USB-serial adapter (write -> echo) apart from a software stall
+// (capture -> write).
+//
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+
+enum LatencyClass
+{
+	LatencyKeyMake,
+	LatencyKeyBreak,
+	LatencyMouseMove,
+	LatencyButton,
+	LatencyOther,
+
+	LatencyClassCount
+};
+
+enum LatencySpan
+{
+	SpanQueue,		// capture -> enqueue
+	SpanWriter,		// enqueue -> write complete
+	SpanWire,		// write complete -> echo
+	SpanTotal,		// capture -> echo
+
+	LatencySpanCount
+};
+
+// Timestamps for one command
+struct LatencyStamps
+{
+	LONGLONG capture;
+	LONGLONG enqueue;
+	LONGLONG write;
+};
+
+inline LONGLONG LatencyNow()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+LatencyClass LatencyClassOf(unsigned char command);
+
+// Writer threads, when the echo for a command shows up
+void LatencyRecord(unsigned char command, const LatencyStamps& stamps, LONGLONG echo);
+
+// Live display, one line per class, starting at firstRow
+void LatencyShow(int firstRow);
+
+// Full table, for exit
+void LatencyDump(FILE* pFile);
+
@@ -0,0 +1,90 @@
+//
+// leds.cpp - Mirror the target's keyboard LEDs on this keyboard
+//
+// The keyboard class device has no DOS name, so it's given one, just
+// long enough to open it.  Windows still sets the LEDs itself, when a
+// lock key goes down here, but that's also when the target's change,
+// and the next read puts them right.
+//
+
+#include "leds.h"
+#include "km232.h"
+
+#include <winioctl.h>
+#include <ntddkbd.h>
+
+//-----------------------------------------------------------------------------
+
+static HANDLE hKeyboard = INVALID_HANDLE_VALUE;
+static int mirrored = -1;	// what the LEDs here were last set to
+
+static const wchar_t* KeyboardDosName = L"km232Kbd";
+
+//-----------------------------------------------------------------------------
+
+static void LedSet(USHORT ledFlags)
+{
+	KEYBOARD_INDICATOR_PARAMETERS indicators;
+	indicators.UnitId = 0;
+	indicators.LedFlags = ledFlags;
+
+	DWORD num_bytes = 0;
+	DeviceIoControl(hKeyboard, IOCTL_KEYBOARD_SET_INDICATORS, &indicators, sizeof(indicators),
+					nullptr, 0, &num_bytes, nullptr);
+}
+
+//-----------------------------------------------------------------------------
+
+bool LedMirrorStart()
+{
+	if (INVALID_HANDLE_VALUE != hKeyboard)
+		return true;
+
+	if (!DefineDosDeviceW(DDD_RAW_TARGET_PATH, KeyboardDosName, L"\\Device\\KeyboardClass0"))
+		return false;
+
+	hKeyboard = CreateFileW(L"\\\\.\\km232Kbd", 0, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+
+	// The handle is all we need, the name can go
+	DefineDosDeviceW(DDD_REMOVE_DEFINITION, KeyboardDosName, nullptr);
+
+	return INVALID_HANDLE_VALUE != hKeyboard;
+}
+
+//-----------------------------------------------------------------------------
+
+void LedMirror(int status)
+{
+	if ((INVALID_HANDLE_VALUE == hKeyboard) || (status < 0) || (status == mirrored))
+		return;
+
+	USHORT ledFlags = 0;
+
+	if (status & StatusNumLock)    ledFlags |= KEYBOARD_NUM_LOCK_ON;
+	if (status & StatusCapsLock)   ledFlags |= KEYBOARD_CAPS_LOCK_ON;
+	if (status & StatusScrollLock) ledFlags |= KEYBOARD_SCROLL_LOCK_ON;
+
+	LedSet(ledFlags);
+	mirrored = status;
+}
+
+//-----------------------------------------------------------------------------
+
+void LedMirrorStop()
+{
+	if (INVALID_HANDLE_VALUE == hKeyboard)
+		return;
+
+	USHORT ledFlags = 0;
+
+	if (GetKeyState(VK_NUMLOCK) & 1) ledFlags |= KEYBOARD_NUM_LOCK_ON;
+	if (GetKeyState(VK_CAPITAL) & 1) ledFlags |= KEYBOARD_CAPS_LOCK_ON;
+	if (GetKeyState(VK_SCROLL) & 1)  ledFlags |= KEYBOARD_SCROLL_LOCK_ON;
+
+	LedSet(ledFlags);
+
+	CloseHandle(hKeyboard);
+	hKeyboard = INVALID_HANDLE_VALUE;
+	mirrored = -1;
+}
+
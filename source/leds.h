@@ -0,0 +1,20 @@
+//
+// leds.h - Mirror the target's keyboard LEDs on this keyboard
+//
+// Only the lights change, the lock state on this machine is left alone.
+// It goes through IOCTL_KEYBOARD_SET_INDICATORS on the keyboard class
+// device, and opening that usually takes an administrator.
+//
+#pragma once
+
+#include <windows.h>
+
+// false if the keyboard device couldn't be opened
+bool LedMirrorStart();
+
+// StatusNumLock, StatusCapsLock, and StatusScrollLock, < 0 is unknown
+void LedMirror(int status);
+
+// Back to what the lock state here says
+void LedMirrorStop();
+
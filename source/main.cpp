@@ -11,80 +11,336 @@
 #include <windows.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "km232.h"
+#include "serial.h"
+#include "rawinput.h"
+#include "keyset.h"
+#include "keymap.h"
+#include "paste.h"
+#include "record.h"
+#include "net.h"
+#include "probe.h"
+#include "status.h"
+#include "latency.h"
+#include "leds.h"
+#include "counters.h"
 
-#include <vector>
+//-----------------------------------------------------------------------------
+// Global Variables for this Toy Program
+HANDLE hStdin;
+HANDLE hStdOut;
+DWORD fdwSaveOldMode;
+static HHOOK keyboardHook = nullptr;
+static bool bKeyHook = false;	// --hook, keys from the low level hook, instead of the console
+static bool bSwallow = false;	// --swallow, the hook keeps Win, Alt-Tab and friends from Windows
+static bool bHasFocus = true;	// the console has the keyboard, the hook only relays then
 
-#include <libserialport.h>
+//
+// Keys the hook can't handle itself, they do more than queue a command,
+// so they wait for the main loop, where there's time
+//
+struct DeferredKey
+{
+	WORD vkCode;
+	bool bKeyDown;
+	bool bExtended;
+};
 
-// Set to 1, otherwise KM232
-#define ASC232 1
-#define KM232  0
+static DeferredKey deferredKeys[ 32 ];
+static int deferredCount = 0;
 
-//-----------------------------------------------------------------------------
 //
-// KM232 USB COMMAND CONSTANTS
+// Main loop, everything it waits on, and where the console input goes,
+// all set up once, so the loop itself never allocates
 //
-const unsigned char USB_BufferClear   = 0x38;			// Like a device Reset
-
-const unsigned char USB_MouseLeft     = 0x42;
-const unsigned char USB_MouseRight    = 0x43;
-const unsigned char USB_MouseUp       = 0x44;
-const unsigned char USB_MouseDown     = 0x45;
+enum LoopWake
+{
+	LoopControl,	// asked to quit
+	LoopConsole,
+	LoopSerial,		// a port stopped answering, or started again
+	LoopTimer,		// something paced is due, status, paste, or replay
+	LoopMessage,	// raw input, or the keyboard hook
+	LoopTimeout,
+};
 
-const unsigned char USB_MouseLeftButton   = 0x49;
-const unsigned char USB_MouseRightButton  = 0x4A;
-const unsigned char USB_MouseMiddleButton = 0x4D;
+static HANDLE hControlEvent = nullptr;	// set from the console control handler
+static HANDLE hLoopDone = nullptr;		// set once the main loop has cleaned up
+static HANDLE hPaceTimer = nullptr;
+static bool bPaceArmed = false;
 
-const unsigned char USB_ScrollWheelUp   = 0x57;
-const unsigned char USB_ScrollWheelDown = 0x58;
+// Every way out ends up in Shutdown, only the first one does anything
+static volatile LONG shutdownStarted = 0;
+static const DWORD ShutdownMs = 250;	// to drain, break what's down, and close
 
-const unsigned char USB_MouseSlow     = 0x6D;
-const unsigned char USB_MouseFast     = 0x6F;
+static const DWORD InputPoolSize = 128;
+static INPUT_RECORD inputPool[ InputPoolSize ];
 
-const unsigned char USB_StatusLEDRead = 0x7F;			// Status of LEDs
+//
+// Current List of Keys that are down
+//
+static KeySet keys;	// set of keys that are down, in the order they went down
 
-// And masks for the StatusLEDRead Command
-const unsigned char StatusNumLock    = 0x01;
-const unsigned char StatusCapsLock   = 0x02;
-const unsigned char StatusScrollLock = 0x04;
+// What was sent to each port, for each key that's down, so the break
+// matches, each port has its own remaps
+static unsigned char keyMakeCodes[ SerialMaxPorts ][ 256 ];
+static const KeyChord* keyChords[ SerialMaxPorts ][ 256 ];	// the chord sent instead, if there was one
 
-const unsigned char USB_BREAK = 128;
+//
+// Mouse
+//
+static bool mouseTrack = false;	// Right button is down, relay the motion
 
+enum MouseButton
+{
+	MouseLeft,
+	MouseRight,
+	MouseMiddle,
 
+	MouseButtonCount
+};
 
+static bool mouseDown[ MouseButtonCount ];	// what the target has been told
+static bool mouseRightClick = false;	// Right went down, and nothing has moved since
+static int  wheelResidual = 0;			// less than a notch of wheel, from a fine grained wheel
+static bool bRawInput  = false;	// Motion comes from Raw Input, instead of the console
 
-//-----------------------------------------------------------------------------
-// Global Variables for this Toy Program
-HANDLE hStdin;
-HANDLE hStdOut;
-DWORD fdwSaveOldMode;
-static HHOOK keyboardHook = nullptr;
-struct sp_port* pSCC = nullptr;
+static bool bShowStatus = true;	// Status display, off with --noui
+static bool bHeadless   = false;	// No console at all, input comes from the hooks
 
 //
-// Current List of Keys that are down
+// Ports, from --port, otherwise probe for one
 //
-static std::vector<WORD> keys;	// list of keys that are down
+static const char* portNames[ SerialMaxPorts ];
+static int  portCount = 0;
+static bool bAllPorts = false;	// --port all, every port that answers the probe
+
+static const char* pasteFile = nullptr;	// --paste, typed in once the ports are up
+
+static const char* serveBind = nullptr;	// --serve [address:]port, hand the port to a remote client
+
+static const char* recordFile = nullptr;	// --record, log everything relayed
+static const char* replayFile = nullptr;	// --replay, play a log back once the ports are up
+static double replaySpeed = 1.0;			// --replay-speed, 0 is as fast as the device goes
+
+static const char* keysFile = nullptr;	// --keys, remaps and chords, per target
+
+static bool bMirrorLeds = false;	// --leds, show the target's LEDs on this keyboard
 
 
 //-----------------------------------------------------------------------------
 // Prototypes
 VOID ErrorExit(LPCSTR);
 VOID KeyEventProc(KEY_EVENT_RECORD);
+void KeyRelay(WORD vkCode, bool bKeyDown, bool bExtended);
+void KeyReleaseAll();
+void KeyBreak(WORD vkCode);
+void KeyMake(int port, WORD vkCode, bool bExtended);
+void Shutdown(DWORD budgetMs);
+void KeyReconcile();
 VOID MouseEventProc(MOUSE_EVENT_RECORD);
+void MouseMotionProc(int dx, int dy);
+void MouseButtonProc(USHORT usButtonFlags, USHORT usButtonData);
+void MouseButtonChange(MouseButton button, bool bDown);
+void MouseWheelProc(int delta);
 VOID ResizeEventProc(WINDOW_BUFFER_SIZE_RECORD);
 void FocusEventProc(FOCUS_EVENT_RECORD fer);
 void InitScreen(int width, int height);
-const char* KeyToString(WORD vkCode);
-void InitSerialPort(const char* portName);
-int SerialSend(unsigned char);  // Send/Receive Char, if result < 0, then timeout
-unsigned char KeyToMakeCode(WORD vkCode);
 void RegisterKeyboardHook();
-
+void RemoveKeyboardHook();
+void KeyHookPump();
+void KeyDeferredRelay();
+void LoopInit();
+LoopWake LoopWait(HANDLE hConsole, DWORD timeoutMs, DWORD wakeMask);
+void ShowAnswering();
+void ShowLeds();
+DWORD MouseTickPump();
+int HeadlessMain();
+int ServeMain();
+DWORD StatusUpdate();
+int InitPorts();
+void ShowTarget();
+void StartRecordReplay();
+void StartKeyRemap();
+
+#ifndef KM232_BENCHMARK
 int main(int argc, char* argv[])
+#else
+// The benchmark has its own main, and drives the handlers below directly
+int RelayMain(int argc, char* argv[])
+#endif
 {
     DWORD cNumRead, fdwMode, i;
-    INPUT_RECORD irInBuf[128];
+
+	// Command Line
+	for (int arg = 1; arg < argc; ++arg)
+	{
+		if ((0 == strcmp(argv[arg], "--window")) && (arg + 1 < argc))
+		{
+			// How many commands can be on the wire, waiting on an echo
+			SerialSetWindow(atoi(argv[++arg]));
+		}
+		else if (0 == strcmp(argv[arg], "--rawinput"))
+		{
+			// Take mouse motion from Raw Input
+			bRawInput = true;
+		}
+		else if ((0 == strcmp(argv[arg], "--mouse-rate")) && (arg + 1 < argc))
+		{
+			// Send the mouse this many times a second, like the USB side
+			// polls it, 60 or 125 are good, 0 to send it as it comes
+			SerialSetMotionRate(atoi(argv[++arg]));
+		}
+		else if ((0 == strcmp(argv[arg], "--port")) && (arg + 1 < argc))
+		{
+			// Skip the probe, and use this port, more than once for more ports
+			const char* name = argv[++arg];
+
+			if (0 == _stricmp(name, "all"))
+				bAllPorts = true;
+			else if (portCount < SerialMaxPorts)
+				portNames[ portCount++ ] = name;
+		}
+		else if (0 == strcmp(argv[arg], "--broadcast"))
+		{
+			// Every port gets everything, instead of just the target
+			SerialSetRoute(SerialRouteBroadcast);
+		}
+		else if ((0 == strcmp(argv[arg], "--device")) && (arg + 1 < argc))
+		{
+			// ASC232, KM232, or auto
+			if (!SerialSetProfile(argv[++arg]))
+			{
+				printf("Unknown device %s\n", argv[arg]);
+				return 1;
+			}
+		}
+		else if ((0 == strcmp(argv[arg], "--layout")) && (arg + 1 < argc))
+		{
+			// What the host keyboard is set to, us or de
+			if (!KeySetLayout(argv[++arg]))
+			{
+				printf("Unknown layout %s\n", argv[arg]);
+				return 1;
+			}
+		}
+		else if ((0 == strcmp(argv[arg], "--keys")) && (arg + 1 < argc))
+		{
+			// Remaps and chords, see keymap.h
+			keysFile = argv[++arg];
+		}
+		else if ((0 == strcmp(argv[arg], "--paste")) && (arg + 1 < argc))
+		{
+			// Type this file into the target
+			pasteFile = argv[++arg];
+		}
+		else if ((0 == strcmp(argv[arg], "--record")) && (arg + 1 < argc))
+		{
+			// Log everything relayed, for --replay
+			recordFile = argv[++arg];
+		}
+		else if ((0 == strcmp(argv[arg], "--replay")) && (arg + 1 < argc))
+		{
+			// Play a --record log back into the target
+			replayFile = argv[++arg];
+		}
+		else if ((0 == strcmp(argv[arg], "--replay-speed")) && (arg + 1 < argc))
+		{
+			// 1 as recorded, 2 twice as fast, 0 flat out
+			replaySpeed = atof(argv[++arg]);
+		}
+		else if (0 == strcmp(argv[arg], "--native"))
+		{
+			// Overlapped I/O on the COM port, instead of libserialport
+			SerialSetBackend(SerialBackendOverlapped);
+		}
+		else if ((0 == strcmp(argv[arg], "--mock")) && (arg + 1 < argc))
+		{
+			// No hardware, a pretend device, latency_us[,jitter_us[,drop_percent[,exclusive]]]
+			MockConfig config;
+			if (!MockParseConfig(argv[++arg], config))
+			{
+				printf("Bad mock device %s\n", argv[arg]);
+				return 1;
+			}
+			MockSetConfig(config);
+			SerialSetBackend(SerialBackendMock);
+
+			if (0 == portCount)
+				portNames[ portCount++ ] = "MOCK";
+		}
+		else if ((0 == strcmp(argv[arg], "--remote")) && (arg + 1 < argc))
+		{
+			// The port is on another machine, host[:port] of a --serve
+			SerialSetBackend(SerialBackendNet);
+
+			if (portCount < SerialMaxPorts)
+				portNames[ portCount++ ] = argv[++arg];
+		}
+		else if ((0 == strcmp(argv[arg], "--serve")) && (arg + 1 < argc))
+		{
+			// Be the other machine, serve the port on this TCP port, only
+			// on loopback unless it's given an address to listen on
+			serveBind = argv[++arg];
+		}
+		else if (0 == strcmp(argv[arg], "--hook"))
+		{
+			// Keys from the low level keyboard hook, so Win, Alt-Tab and
+			// the rest reach the target too
+			bKeyHook = true;
+		}
+		else if (0 == strcmp(argv[arg], "--swallow"))
+		{
+			// And Windows doesn't act on them
+			bKeyHook = true;
+			bSwallow = true;
+		}
+		else if (0 == strcmp(argv[arg], "--counters"))
+		{
+			// Print the counters of the relay that's running, and that's all
+			if (!CountersDump(stdout))
+			{
+				printf("No relay running\n");
+				return 1;
+			}
+			return 0;
+		}
+		else if (0 == strcmp(argv[arg], "--leds"))
+		{
+			// This keyboard's LEDs follow the target's
+			bMirrorLeds = true;
+		}
+		else if (0 == strcmp(argv[arg], "--noui"))
+		{
+			// No status display at all
+			bShowStatus = false;
+		}
+		else if (0 == strcmp(argv[arg], "--headless"))
+		{
+			// No screen, straight from the hooks to the serial port
+			bHeadless = true;
+			bShowStatus = false;
+			bRawInput = true;
+		}
+	}
+
+	if (serveBind)
+	{
+		return ServeMain();
+	}
+
+	LoopInit();
+	CountersStart();
+
+	if (bMirrorLeds && !LedMirrorStart())
+		bMirrorLeds = false;
+
+	if (bHeadless)
+	{
+		return HeadlessMain();
+	}
 
     // Get the standard input handle. 
 
@@ -109,45 +365,123 @@ int main(int argc, char* argv[])
         ErrorExit("SetConsoleMode");
 
 	// Resize/Clear the screen
-	InitScreen(80,24);
+	if (bShowStatus)
+		InitScreen(80,24);
+
+	// Setup the Serial Ports
+	InitPorts();
+
+	// Hand the ports over to the writer threads
+	SerialStart();
+
+	ShowTarget();
 
-	// Setup the Serial Port
-	InitSerialPort("COM4");
+	if (pasteFile && !PasteFile(pasteFile))
+		StatusLine(3, "PASTE: can't read %s", pasteFile);
+
+	StartKeyRemap();
+	StartRecordReplay();
+
+	if (bRawInput && !RawInputInit(MouseMotionProc, nullptr))
+	{
+		// Fall back to the console
+		bRawInput = false;
+	}
 
 	// Set we can do ctrl-alt-esc
-	//RegisterKeyboardHook();
+	if (bKeyHook)
+	{
+		// The hook has to answer quickly, or Windows will skip it
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+		RegisterKeyboardHook();
+		if (!keyboardHook)
+			StatusLine(1, "HOOK: SetWindowsHookEx failed, keys from the console");
+	}
 
     while (TRUE)
     {
+		// Wait on the console, and the raw input queue, but come back
+		// around when it's time to update the status display, or paste more
+		DWORD timeoutMs = StatusUpdate();
+		DWORD pasteMs = PastePump();
+		if (pasteMs < timeoutMs) timeoutMs = pasteMs;
+		DWORD replayMs = ReplayPump();
+		if (replayMs < timeoutMs) timeoutMs = replayMs;
+		DWORD mouseMs = MouseTickPump();
+		if (mouseMs < timeoutMs) timeoutMs = mouseMs;
+
+		// The hook is called from inside our message pump
+		DWORD wakeMask = bRawInput ? QS_RAWINPUT : 0;
+		if (keyboardHook) wakeMask |= QS_ALLINPUT;
+
+		LoopWake wake = LoopWait(hStdin, timeoutMs, wakeMask);
+
+		if (LoopControl == wake)
+			break;
+
+		if (LoopSerial == wake)
+		{
+			ShowAnswering();
+			ShowLeds();
+			continue;
+		}
+
+		if ((LoopTimer == wake) || (LoopTimeout == wake))
+			continue;
+
+		if (LoopMessage == wake)
+		{
+			SerialBeginFrame();
+			SerialCaptureTime(LatencyNow());
+			if (bRawInput)
+				RawInputRead();
+			else
+				KeyHookPump();
+			SerialEndFrame();
+
+			KeyDeferredRelay();
+			continue;
+		}
+
+		// Don't block in ReadConsoleInput, if there's nothing there
+		DWORD numEvents = 0;
+		if (!GetNumberOfConsoleInputEvents(hStdin, &numEvents) || !numEvents)
+			continue;
+
         // Wait for the events. 
 
         if (!ReadConsoleInput(
-            hStdin,      // input buffer handle 
-            irInBuf,     // buffer to read into 
-            128,         // size of read buffer 
-            &cNumRead)) // number of records read 
+            hStdin,        // input buffer handle 
+            inputPool,     // buffer to read into 
+            InputPoolSize, // size of read buffer 
+            &cNumRead))    // number of records read 
             ErrorExit("ReadConsoleInput");
 
         // Dispatch the events to the appropriate handler. 
+		// Everything this batch produces goes out as one frame
+
+		SerialBeginFrame();
+		SerialCaptureTime(LatencyNow());
 
         for (i = 0; i < cNumRead; i++)
         {
-            switch (irInBuf[i].EventType)
+            switch (inputPool[i].EventType)
             {
             case KEY_EVENT: // keyboard input 
-                KeyEventProc(irInBuf[i].Event.KeyEvent);
+                KeyEventProc(inputPool[i].Event.KeyEvent);
                 break;
 
             case MOUSE_EVENT: // mouse input 
-                MouseEventProc(irInBuf[i].Event.MouseEvent);
+                MouseEventProc(inputPool[i].Event.MouseEvent);
                 break;
 
             case WINDOW_BUFFER_SIZE_EVENT: // scrn buf. resizing 
-                ResizeEventProc(irInBuf[i].Event.WindowBufferSizeEvent);
+                ResizeEventProc(inputPool[i].Event.WindowBufferSizeEvent);
                 break;
 
 			case FOCUS_EVENT:  // disregard focus events 
-				FocusEventProc(irInBuf[i].Event.FocusEvent);
+				FocusEventProc(inputPool[i].Event.FocusEvent);
 				break;
 
             case MENU_EVENT:   // disregard menu events 
@@ -158,144 +492,702 @@ int main(int argc, char* argv[])
                 break;
             }
         }
+
+		SerialEndFrame();
     }
 
+	Shutdown(ShutdownMs);
+	RecordStop();
+
+    // Restore input mode on exit.
+
+    SetConsoleMode(hStdin, fdwSaveOldMode);
+
+	StatusEnd();
+	LatencyDump(stdout);
+
+	SetEvent(hLoopDone);
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Headless, there is no screen, and we don't read the console at all.
+// Keys come from the low level keyboard hook, and the mouse from Raw
+// Input, both of which are delivered while we pump messages.
+//
+int HeadlessMain()
+{
+	if (0 == InitPorts())
+		ErrorExit("InitSerialPort");
+
+	SerialStart();
+
+	// The hook has to answer quickly, or Windows will skip it
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+	if (!RawInputInit(MouseMotionProc, MouseButtonProc))
+		ErrorExit("RegisterRawInputDevices");
+
+	RegisterKeyboardHook();
+	if (!keyboardHook)
+		ErrorExit("SetWindowsHookEx");
+
+	if (pasteFile)
+		PasteFile(pasteFile);
+
+	StartKeyRemap();
+	StartRecordReplay();
+
+	ShowLeds();
+
+	while (TRUE)
+	{
+		DWORD timeoutMs = PastePump();
+		DWORD replayMs = ReplayPump();
+		if (replayMs < timeoutMs) timeoutMs = replayMs;
+		DWORD mouseMs = MouseTickPump();
+		if (mouseMs < timeoutMs) timeoutMs = mouseMs;
+
+		LoopWake wake = LoopWait(nullptr, timeoutMs, QS_ALLINPUT);
+
+		if (LoopControl == wake)
+			break;
+
+		if (LoopSerial == wake)
+			ShowLeds();
+
+		// Everything from this pass goes out as one frame
+		SerialBeginFrame();
+		SerialCaptureTime(LatencyNow());
+		RawInputRead();
+		SerialEndFrame();
+
+		KeyDeferredRelay();
+	}
+
+	Shutdown(ShutdownMs);
+	RecordStop();
+	LatencyDump(stdout);
+
+	SetEvent(hLoopDone);
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Server, there's no input here at all, the client sends the commands,
+// and we just move the bytes between the network and the port
+//
+int ServeMain()
+{
+	const char* portName = portCount ? portNames[ 0 ] : nullptr;
+
+	ProbeResult probe;
+
+	if (!portName)
+	{
+		if (!ProbeFind(SerialGetBackend(), nullptr, probe))
+		{
+			printf("NO DEVICE FOUND\n");
+			return 1;
+		}
+
+		portName = probe.portName;
+	}
+
+	return NetServe(serveBind, portName, SerialGetBackend());
+}
+
+//-----------------------------------------------------------------------------
+//
+// Ctrl-Break, or the window closing, comes in on its own thread, so it
+// just tells the main loop, and for a close, waits for it to clean up,
+// since the process is gone as soon as this returns
+//
+static BOOL WINAPI LoopControlHandler(DWORD ctrlType)
+{
+	SetEvent(hControlEvent);
+
+	if ((CTRL_CLOSE_EVENT == ctrlType) || (CTRL_LOGOFF_EVENT == ctrlType) || (CTRL_SHUTDOWN_EVENT == ctrlType))
+	{
+		// If the loop is stuck, the keys still get let go of
+		if (WAIT_OBJECT_0 != WaitForSingleObject(hLoopDone, 2000 - ShutdownMs))
+			Shutdown(ShutdownMs);
+	}
+
+	return TRUE;
+}
+
+//
+// A crash, the target shouldn't be left with keys stuck down until
+// someone unplugs it, then Windows can have it
+//
+static LONG WINAPI LoopCrashFilter(EXCEPTION_POINTERS* pException)
+{
+	Shutdown(ShutdownMs);
+
+	if (hStdin)
+		SetConsoleMode(hStdin, fdwSaveOldMode);
+
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+void LoopInit()
+{
+	hControlEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	hLoopDone = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+	// High resolution if there is one (Windows 10 1803 on), a wait timeout
+	// is only good to the scheduler tick
+	hPaceTimer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (!hPaceTimer)
+		hPaceTimer = CreateWaitableTimer(nullptr, FALSE, nullptr);
+
+	SetConsoleCtrlHandler(LoopControlHandler, TRUE);
+	SetUnhandledExceptionFilter(LoopCrashFilter);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Sleep until there's something to do, hConsole can be nullptr, and
+// wakeMask is for MsgWaitForMultipleObjects.  timeoutMs goes on the pace
+// timer, so nothing wakes us before then, for no reason
+//
+LoopWake LoopWait(HANDLE hConsole, DWORD timeoutMs, DWORD wakeMask)
+{
+	HANDLE handles[ 4 ];
+	LoopWake wakes[ 4 ];
+	DWORD count = 0;
+
+	// Lowest index wins, when more than one is signaled
+	handles[ count ] = hControlEvent;
+	wakes[ count++ ] = LoopControl;
+
+	if (hConsole)
+	{
+		handles[ count ] = hConsole;
+		wakes[ count++ ] = LoopConsole;
+	}
+
+	if (SerialEvent())
+	{
+		handles[ count ] = SerialEvent();
+		wakes[ count++ ] = LoopSerial;
+	}
+
+	DWORD waitMs = timeoutMs;
+
+	if (hPaceTimer && (0 != timeoutMs) && (INFINITE != timeoutMs))
+	{
+		LARGE_INTEGER due;
+		due.QuadPart = -(LONGLONG)timeoutMs * 10000;	// relative, in 100ns
+
+		if (SetWaitableTimer(hPaceTimer, &due, 0, nullptr, nullptr, FALSE))
+		{
+			bPaceArmed = true;
+			handles[ count ] = hPaceTimer;
+			wakes[ count++ ] = LoopTimer;
+			waitMs = INFINITE;
+		}
+	}
+	else if (bPaceArmed)
+	{
+		// Nothing is due, don't let an old one wake us up
+		CancelWaitableTimer(hPaceTimer);
+		bPaceArmed = false;
+	}
+
+	DWORD result = MsgWaitForMultipleObjects(count, handles, FALSE, waitMs, wakeMask);
+
+	if (WAIT_FAILED == result)
+		ErrorExit("MsgWaitForMultipleObjects");
+
+	if (WAIT_TIMEOUT == result)
+		return LoopTimeout;
+
+	if ((WAIT_OBJECT_0 + count) == result)
+		return LoopMessage;
+
+	if (LoopTimer == wakes[ result - WAIT_OBJECT_0 ])
+		bPaceArmed = false;
+
+	return wakes[ result - WAIT_OBJECT_0 ];
+}
+
+//-----------------------------------------------------------------------------
+//
+// Paced motion, ticks at the --mouse-rate, on the QPC clock, returns the
+// milliseconds until the next tick, INFINITE if no motion is waiting
+//
+DWORD MouseTickPump()
+{
+static LONGLONG nextTick = 0;
+
+	int rate = SerialGetMotionRate();
+
+	if (!rate || !SerialMotionPending())
+		return INFINITE;
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	LONGLONG period = freq.QuadPart / rate;
+	LONGLONG now = LatencyNow();
+
+	if (now >= nextTick)
+	{
+		SerialMotionTick();
+
+		// Stay on the grid, unless we're a whole tick behind, or the
+		// mouse has been still, then the first motion goes right away
+		nextTick += period;
+		if (nextTick <= now)
+			nextTick = now + period;
+	}
+
+	// Round up, waking early is just another pass for nothing
+	return (DWORD)((((nextTick - now) * 1000) + freq.QuadPart - 1) / freq.QuadPart);
+}
+
+//-----------------------------------------------------------------------------
+//
+// A port stopped answering, or started again
+//
+void ShowAnswering()
+{
+	StatusText text;
+	text.Append("PORT:");
+
+	int silent = 0;
+
+	for (int port = 0; port < SerialPortCount(); ++port)
+	{
+		if (!SerialAnswering(port))
+		{
+			text.Append(" %s", SerialPortName(port));
+			silent++;
+		}
+	}
+
+	text.Append(silent ? " not answering" : " all answering");
+	text.Show(0);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Stop taking input, then break what's down on the target, after what
+// was already queued, and close the ports, in about budgetMs.  From the
+// main loop, ErrorExit, the control handler, or the crash filter,
+// whichever gets here first.
+//
+// The input thread may still be running, so the record file, and the
+// counters, which it writes through, are left mapped.  The loop stops
+// the record itself, once it's out, and process exit takes the rest.
+//
+void Shutdown(DWORD budgetMs)
+{
+	if (InterlockedExchange(&shutdownStarted, 1))
+		return;
+
+	RemoveKeyboardHook();
+	RawInputShutdown();
+
+	SerialShutdown(budgetMs);
+
+	LedMirrorStop();
+}
+
+//-----------------------------------------------------------------------------
+
+VOID ErrorExit(LPCSTR lpszMessage)
+{
+    fprintf(stderr, "%s\n", lpszMessage);
+
+	Shutdown(ShutdownMs);
+	RecordStop();
+
     // Restore input mode on exit.
 
     SetConsoleMode(hStdin, fdwSaveOldMode);
 
-    return 0;
+	StatusEnd();
+	LatencyDump(stdout);
+
+    ExitProcess(0);
+}
+
+//-----------------------------------------------------------------------------
+//
+// The periodic part of the status display, returns how long the main
+// loop can wait before it needs to call this again
+//
+DWORD StatusUpdate()
+{
+static DWORD lastReport = 0;
+const DWORD ReportMs = 500;
+
+	if (!StatusEnabled())
+		return INFINITE;
+
+	if ((GetTickCount() - lastReport) >= ReportMs)
+	{
+		int target = SerialGetTarget();
+
+		StatusLine(6, "LINK: %u echoed, %u lost, %u resent, window %d/%d", SerialEchoed(), SerialLost(), SerialResent(),
+				   SerialGetRate(target), SerialGetWindow());
+
+		if (SerialBackendNet == SerialGetBackend())
+			StatusLine(7, "NET: %.3fms round trip", NetRoundTripUs() / 1000.0);
+		LatencyShow(12);
+		lastReport = GetTickCount();
+	}
+
+	DWORD untilReport = ReportMs - (GetTickCount() - lastReport);
+	DWORD untilFlush = StatusFlush();
+
+	return (untilFlush < untilReport) ? untilFlush : untilReport;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Open what the command line asked for, returns how many ports are live
+//
+int InitPorts()
+{
+	if (bAllPorts)
+		return InitSerialPorts();
+
+	if (0 == portCount)
+		return InitSerialPort(nullptr) ? 1 : 0;
+
+	int numLive = 0;
+
+	for (int idx = 0; idx < portCount; ++idx)
+	{
+		if (InitSerialPort(portNames[ idx ]))
+			numLive++;
+	}
+
+	return numLive;
+}
+
+//-----------------------------------------------------------------------------
+
+void ShowTarget()
+{
+	int target = SerialGetTarget();
+
+	StatusLine(2, "%d port(s), %s %d: %s %s", SerialPortCount(),
+			   (SerialRouteBroadcast == SerialGetRoute()) ? "broadcast, from" : "target",
+			   target, SerialPortName(target), SerialProfileName(target));
+
+	ShowLeds();
+}
+
+//-----------------------------------------------------------------------------
+//
+// The target's LEDs, from the cache the writer keeps, and on this
+// keyboard too, with --leds
+//
+void ShowLeds()
+{
+	int leds = SerialLEDs(SerialGetTarget());
+
+	if (bMirrorLeds)
+		LedMirror(leds);
+
+	if (leds < 0)
+	{
+		StatusLine(9, "LEDS: unknown");
+		return;
+	}
+
+	StatusLine(9, "LEDS: %s %s %s", (leds & StatusNumLock) ? "NUM" : "num",
+			   (leds & StatusCapsLock) ? "CAPS" : "caps", (leds & StatusScrollLock) ? "SCROLL" : "scroll");
+}
+
+//-----------------------------------------------------------------------------
+//
+// --record and --replay, once the ports are up
+//
+void StartRecordReplay()
+{
+	if (recordFile && !RecordStart(recordFile))
+		StatusLine(5, "RECORD: can't create %s", recordFile);
+
+	if (replayFile && !ReplayStart(replayFile, replaySpeed))
+		StatusLine(5, "REPLAY: can't read %s", replayFile);
+}
+
+//-----------------------------------------------------------------------------
+//
+// --keys, compiled for each port, once they're all open
+//
+void StartKeyRemap()
+{
+	if (!keysFile)
+		return;
+
+	char badLine[ 256 ];
+
+	for (int port = 0; port < SerialPortCount(); ++port)
+	{
+		if (!KeyLoadRemap(keysFile, port, SerialPortName(port), badLine, sizeof(badLine)))
+		{
+			StatusLine(10, "KEYS: %s, %s", keysFile, badLine);
+			return;
+		}
+	}
+
+	StatusLine(10, "KEYS: %s, %d remaps", keysFile, KeyRemapCount());
 }
 
-VOID ErrorExit(LPCSTR lpszMessage)
+//-----------------------------------------------------------------------------
+
+void FocusEventProc(FOCUS_EVENT_RECORD fer)
 {
-    fprintf(stderr, "%s\n", lpszMessage);
+	StatusLine(1, "FOCUS EVENT: %s ", fer.bSetFocus ? "true" : "false");
 
-    // Restore input mode on exit.
+	bHasFocus = fer.bSetFocus ? true : false;
 
-    SetConsoleMode(hStdin, fdwSaveOldMode);
+	if (!fer.bSetFocus)
+	{
+		// When we lose focus, we better release all the keys, one break
+		// for each key that's down is usually just the Alt, and is a lot
+		// less of a hiccup than a USB_BufferClear
+		KeyReleaseAll();
 
-    ExitProcess(0);
+		// Erase the Key Status
+		StatusLine(4, "");
+	}
+	else
+	{
+		// Anything still held from the Alt-Tab goes back down
+		KeyReconcile();
+	}
 }
 
 //-----------------------------------------------------------------------------
+//
+// Break everything that's down, newest first
+//
+void KeyReleaseAll()
+{
+	while (!keys.Empty())
+	{
+		WORD key = (WORD)keys.Newest();
+		keys.Remove(key);
 
-void FocusEventProc(FOCUS_EVENT_RECORD fer)
+		KeyBreak(key);
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Send the make to one port, translated with its remaps, a chord goes
+// instead of the key, if the held keys are down
+//
+void KeyMake(int port, WORD vkCode, bool bExtended)
 {
-	COORD dwCursorPosition;
-	dwCursorPosition.X = 0;
-	dwCursorPosition.Y = 1;
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
+	// The key itself is in the set already, that doesn't matter to a chord
+	const KeyChord* pChord = KeyFindChord(port, vkCode, keys);
 
-	printf("FOCUS EVENT: %s ", fer.bSetFocus ? "true" : "false");
+	keyChords[ port ][ vkCode & 0xFF ] = pChord;
 
-	if (!fer.bSetFocus)
+	if (pChord)
+	{
+		keyMakeCodes[ port ][ vkCode & 0xFF ] = 0;
+
+		for (int idx = 0; idx < pChord->codeCount; ++idx)
+			SerialQueueTo(port, pChord->codes[ idx ]);
+
+		return;
+	}
+
+	// Send Make
+	unsigned char km_code = KeyToMakeCode( port, vkCode, bExtended );
+	keyMakeCodes[ port ][ vkCode & 0xFF ] = km_code;
+	if (km_code)
+	{
+		SerialQueueTo(port, km_code);
+	}
+}
+
+//
+// Break whatever the make sent, on every port it went to, a key, or a
+// chord in reverse
+//
+void KeyBreak(WORD vkCode)
+{
+	for (int port = 0; port < SerialPortCount(); ++port)
 	{
-		#if 0
-		// When we lose focus, we better release all the keys
-		while (keys.size())
+		const KeyChord* pChord = keyChords[ port ][ vkCode & 0xFF ];
+
+		if (pChord)
 		{
-			WORD key = keys[ keys.size() - 1 ];
-			keys.pop_back();
+			keyChords[ port ][ vkCode & 0xFF ] = nullptr;
 
-			unsigned char km_code = KeyToMakeCode( key );
-			if (km_code)
-			{
-				// Send Break Code
-				SerialSend(km_code + USB_BREAK);
-			}
+			for (int idx = pChord->codeCount - 1; idx >= 0; --idx)
+				SerialQueueTo(port, pChord->codes[ idx ] + USB_BREAK);
+
+			continue;
 		}
-		#else
-		// Clear the Keys more efficiently
-		if (0 != keys.size())
+
+		unsigned char km_code = keyMakeCodes[ port ][ vkCode & 0xFF ];
+		if (km_code)
 		{
-			keys.clear();
-			SerialSend(USB_BufferClear); // USB Buffer Clear
+			// Send Break Code
+			keyMakeCodes[ port ][ vkCode & 0xFF ] = 0;
+			SerialQueueTo(port, km_code + USB_BREAK);
 		}
-		#endif
+	}
+}
 
-		// Erase the Key Status
-		dwCursorPosition.Y = 4;
-		SetConsoleCursorPosition(hStdOut, dwCursorPosition);
-		printf("                                                                ");
+//-----------------------------------------------------------------------------
+//
+// Compare what the keyboard says is down right now, with what we told
+// the target, and send only the makes and breaks that are different
+//
+void KeyReconcile()
+{
+	// The hook sees left and right modifiers, the console only the generic ones
+	bool bSideKeys = (nullptr != keyboardHook);
+
+	for (int vk = 1; vk < 256; ++vk)
+	{
+		bool bGeneric = (VK_SHIFT == vk) || (VK_CONTROL == vk) || (VK_MENU == vk);
+		bool bSided   = (vk >= VK_LSHIFT) && (vk <= VK_RMENU);
 
+		if ((bSideKeys && bGeneric) || (!bSideKeys && bSided))
+			continue;
 
+		if (!KeyToMakeCode(SerialGetTarget(), (WORD)vk) && !KeyFindChord(SerialGetTarget(), (WORD)vk, keys))
+			continue;
+
+		bool bDown = GetAsyncKeyState(vk) < 0;
+
+		if (bDown == keys.Contains((WORD)vk))
+			continue;
+
+		// Only the right hand Control or Alt, is the extended one
+		bool bExtended = false;
+
+		if (VK_CONTROL == vk)
+			bExtended = (GetAsyncKeyState(VK_RCONTROL) < 0) && (GetAsyncKeyState(VK_LCONTROL) >= 0);
+		else if (VK_MENU == vk)
+			bExtended = (GetAsyncKeyState(VK_RMENU) < 0) && (GetAsyncKeyState(VK_LMENU) >= 0);
+
+		KeyRelay((WORD)vk, bDown, bExtended);
 	}
 }
 
 //-----------------------------------------------------------------------------
-
-VOID KeyEventProc(KEY_EVENT_RECORD ker)
+//
+// Send the make / break for a key, from the console, or from the hook
+//
+void KeyRelay(WORD vkCode, bool bKeyDown, bool bExtended)
 {
-// I'm using a vector instead of a map, because I need to know which keys
-// are the oldest, to simulator rollover
+// The KeySet keeps the keys in the order they went down, because I need
+// to know which keys are the oldest, to simulate rollover
+
+	if (VK_PAUSE == vkCode)
+	{
+		// Pause has no make code, so it picks the next target
+		if (bKeyDown && (SerialRouteFocus == SerialGetRoute()) && (SerialPortCount() > 1))
+		{
+			// Don't leave keys stuck down on the old target
+			KeyReleaseAll();
 
-	if (ker.bKeyDown)
+			SerialNextTarget();
+			ShowTarget();
+			StatusLine(4, "");
+		}
+		return;
+	}
+
+	if (VK_APPS == vkCode)
 	{
-		bool bAdd = true;
+		// Apps has no make code either, it types in the clipboard
+		if (bKeyDown)
+			PasteClipboard();
+		return;
+	}
 
-		// Add to set, if not already in there
-		for (int idx = 0; idx < keys.size(); ++idx)
+	if ((VK_ESCAPE == vkCode) && (PasteActive() || ReplayActive()))
+	{
+		// Stop typing, or the replay, and don't send the Escape
+		if (bKeyDown)
 		{
-			if (keys[ idx ] == ker.wVirtualKeyCode)
+			PasteCancel();
+
+			if (ReplayActive())
 			{
-				bAdd = false;
-				break;
+				ReplayStop();
+				StatusLine(5, "REPLAY: stopped");
 			}
 		}
+		return;
+	}
 
-		if (bAdd)
+	if (bKeyDown)
+	{
+		// Add to set, if not already in there, then each port that's
+		// routed gets it translated its own way
+		if (keys.Add( vkCode ))
 		{
-			keys.push_back( ker.wVirtualKeyCode );
-
-			// Send Make
-			unsigned char km_code = KeyToMakeCode( ker.wVirtualKeyCode );
-			if (km_code)
+			for (int port = 0; port < SerialPortCount(); ++port)
 			{
-				SerialSend(km_code);
+				if (SerialRouted(port))
+					KeyMake(port, vkCode, bExtended);
 			}
 		}
 	}
 	else
 	{
 		// Remove from set
-		// Add to set, if not already in there
-		for (int idx = 0; idx < keys.size(); ++idx)
+		if (keys.Remove( vkCode ))
 		{
-			if (keys[ idx ] == ker.wVirtualKeyCode)
-			{
-				keys.erase( keys.begin() + idx );
+			KeyBreak( vkCode );
+		}
+	}
+}
 
-				unsigned char km_code = KeyToMakeCode( ker.wVirtualKeyCode );
-				if (km_code)
-				{
-					// Send Break Code
-					SerialSend(km_code + USB_BREAK);
-				}
+//-----------------------------------------------------------------------------
 
+VOID KeyEventProc(KEY_EVENT_RECORD ker)
+{
+	// With the hook in, it has already sent these, the console is just
+	// for the display
+	if (!keyboardHook)
+	{
+		// Right Shift isn't an enhanced key, only its scan code says which
+		// Shift it is, it goes as the extended one, for the remaps
+		bool bExtended = (ker.dwControlKeyState & ENHANCED_KEY) ? true : false;
 
-				break;
-			}
-		}
+		if ((VK_SHIFT == ker.wVirtualKeyCode) && (0x36 == ker.wVirtualScanCode))
+			bExtended = true;
 
+		KeyRelay(ker.wVirtualKeyCode, ker.bKeyDown ? true : false, bExtended);
 	}
 
 //-----------------------------------------------------------------------------
 //  Dump the list of keys that are down
 //
-	COORD dwCursorPosition;
-	dwCursorPosition.X = 0;
-	dwCursorPosition.Y = 4;
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
-	printf("                                                                ");
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
-
-	for (int idx = 0; idx < keys.size(); ++idx)
+	if (StatusEnabled())
 	{
-		printf(" %s(%02X)", KeyToString(keys[idx]), keys[idx]);
-		//printf(" %s", KeyToString(keys[idx]));
-	}
+		StatusText text;
 
+		for (int vk = keys.Oldest(); vk >= 0; vk = keys.Next(vk))
+		{
+			text.Append(" %s(%02X)", KeyToString((WORD)vk), vk);
+			//text.Append(" %s", KeyToString((WORD)vk));
+		}
+
+		text.Show(4);
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -303,57 +1195,43 @@ VOID KeyEventProc(KEY_EVENT_RECORD ker)
 VOID MouseEventProc(MOUSE_EVENT_RECORD mer)
 {
 static POINT currentMouse;
-static bool mouseTrack;
-static bool button0 = false;
 
-	COORD dwCursorPosition;
-	dwCursorPosition.X = 0;
-	dwCursorPosition.Y = 8;
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
-	printf("                                                                ");
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
+	StatusText text;
 
 #ifndef MOUSE_HWHEELED
 #define MOUSE_HWHEELED 0x0008
 #endif
-    printf("Mouse:");
+    text.Append("Mouse:");
+
+	// Every event carries the state of the buttons, only the changes
+	// go out, so a repeat of the same state costs nothing
+	bool bRightWasDown = mouseDown[ MouseRight ];
+
+	MouseButtonChange(MouseLeft,   0 != (mer.dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED));
+	MouseButtonChange(MouseMiddle, 0 != (mer.dwButtonState & FROM_LEFT_2ND_BUTTON_PRESSED));
+	MouseButtonChange(MouseRight,  0 != (mer.dwButtonState & RIGHTMOST_BUTTON_PRESSED));
+
+	if (mouseDown[ MouseRight ] && !bRightWasDown)
+	{
+		// Tracking starts from here
+		GetCursorPos(&currentMouse);
+	}
 
     switch (mer.dwEventFlags)
     {
     case DOUBLE_CLICK:
-        printf(" 2click");
+        text.Append(" 2click");
     case 0:
-
         if (mer.dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED)
-        {
-            printf(" left");
-			SerialSend(USB_MouseLeftButton); 	// Make Code
-			button0 = true;
-        }
-		else if (button0)
-		{
-			button0 = false;
-			SerialSend(USB_MouseLeftButton + USB_BREAK);  // Break Code
-		}
-
+            text.Append(" left");
         if (mer.dwButtonState & RIGHTMOST_BUTTON_PRESSED)
-        {
-            printf(" right");
-			GetCursorPos(&currentMouse);
-			mouseTrack = true;
-        }
-		else
-		{
-			mouseTrack = false;
-		}
-
+            text.Append(" right");
 		if (mer.dwButtonState & FROM_LEFT_2ND_BUTTON_PRESSED)
-		{
-			printf(" middle");
-		}
+			text.Append(" middle");
         break;
     case MOUSE_HWHEELED:
-        printf("h wheel");
+		// The KM232 has no sideways scroll
+        text.Append("h wheel");
         break;
 	case MOUSE_MOVED:
 		{
@@ -361,62 +1239,141 @@ static bool button0 = false;
 			if (GetCursorPos(&p))
 			{
 				//cursor position now in p.x and p.y
-				printf(" %d,%d %d,%d", p.x, p.y, mer.dwMousePosition.X, mer.dwMousePosition.Y );
-			}
-
-			if (mouseTrack)
-			{
-				int result;
+				text.Append(" %d,%d %d,%d", p.x, p.y, mer.dwMousePosition.X, mer.dwMousePosition.Y );
 
-				while ((p.x != currentMouse.x) || (p.y != currentMouse.y))
+				if (!bRawInput)
 				{
-					if (p.x > currentMouse.x)
-					{
-						currentMouse.x++;
-						result = SerialSend(USB_MouseRight);
-					}
-					else if (p.x < currentMouse.x)
-					{
-						currentMouse.x--;
-						result = SerialSend(USB_MouseLeft);
-					}
-
-					// Timeout on the port
-					if (result < 0) break;
-
-					if (p.y > currentMouse.y)
-					{
-						currentMouse.y++;
-						result = SerialSend(USB_MouseDown);
-					}
-					else if (p.y < currentMouse.y)
-					{
-						currentMouse.y--;
-						result = SerialSend(USB_MouseUp);
-					}
-
-					// Timeout on the port
-					if (result < 0) break;
+					MouseMotionProc(p.x - currentMouse.x, p.y - currentMouse.y);
 				}
+				currentMouse = p;
 			}
-
 		}
         break;
     case MOUSE_WHEELED:
-        printf(" wheel");
+        text.Append(" wheel");
+		// The high word is the signed delta, forward is up
+		MouseWheelProc((SHORT)HIWORD(mer.dwButtonState));
         break;
     default:
-        printf(" unknown");
+        text.Append(" unknown");
         break;
     }
+
+	text.Show(8);
 }
 
-VOID ResizeEventProc(WINDOW_BUFFER_SIZE_RECORD wbsr)
+//-----------------------------------------------------------------------------
+//
+// Relative motion, from either the console, or Raw Input
+//
+void MouseMotionProc(int dx, int dy)
 {
-	COORD dwCursorPosition;
+	if (mouseTrack)
+	{
+		// Hand over the whole delta, the writer thread folds it in
+		// with whatever it hasn't sent yet
+		SerialMotion(dx, dy);
+
+		if (dx || dy)
+			mouseRightClick = false;	// it's a drag
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Raw Input buttons, when there's no console to tell us about them
+//
+void MouseButtonProc(USHORT usButtonFlags, USHORT usButtonData)
+{
+	if (usButtonFlags & RI_MOUSE_LEFT_BUTTON_DOWN)
+		MouseButtonChange(MouseLeft, true);
+
+	if (usButtonFlags & RI_MOUSE_LEFT_BUTTON_UP)
+		MouseButtonChange(MouseLeft, false);
+
+	if (usButtonFlags & RI_MOUSE_MIDDLE_BUTTON_DOWN)
+		MouseButtonChange(MouseMiddle, true);
+
+	if (usButtonFlags & RI_MOUSE_MIDDLE_BUTTON_UP)
+		MouseButtonChange(MouseMiddle, false);
+
+	if (usButtonFlags & RI_MOUSE_RIGHT_BUTTON_DOWN)
+		MouseButtonChange(MouseRight, true);
+
+	if (usButtonFlags & RI_MOUSE_RIGHT_BUTTON_UP)
+		MouseButtonChange(MouseRight, false);
+
+	if (usButtonFlags & RI_MOUSE_WHEEL)
+		MouseWheelProc((SHORT)usButtonData);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Send the make / break for a button, only when it really changes
+//
+// The right button is what turns on tracking, so it can't just be
+// relayed, if it goes down and back up without the mouse moving, that's
+// sent as a right click
+//
+void MouseButtonChange(MouseButton button, bool bDown)
+{
+	if (mouseDown[ button ] == bDown)
+		return;
+
+	mouseDown[ button ] = bDown;
+
+	switch (button)
+	{
+	case MouseLeft:
+		SerialQueue(USB_MouseLeftButton + (bDown ? 0 : USB_BREAK));
+		break;
+
+	case MouseMiddle:
+		SerialQueue(USB_MouseMiddleButton + (bDown ? 0 : USB_BREAK));
+		break;
+
+	case MouseRight:
+		mouseTrack = bDown;
+
+		if (bDown)
+		{
+			mouseRightClick = true;
+		}
+		else if (mouseRightClick)
+		{
+			mouseRightClick = false;
+			SerialQueue(USB_MouseRightButton);
+			SerialQueue(USB_MouseRightButton + USB_BREAK);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Wheel delta, WHEEL_DELTA to a notch, the writer thread sums up the
+// notches, so a fast spin costs one command per notch left over, not
+// one per event
+//
+void MouseWheelProc(int delta)
+{
+	wheelResidual += delta;
+
+	int notches = wheelResidual / WHEEL_DELTA;
+	wheelResidual -= notches * WHEEL_DELTA;
+
+	SerialWheel(notches);
+}
+
+//-----------------------------------------------------------------------------
 
-	dwCursorPosition.Y = 23;
-	dwCursorPosition.X = 0;
+VOID ResizeEventProc(WINDOW_BUFFER_SIZE_RECORD wbsr)
+{
+	if (!StatusEnabled())
+		return;
 
 // Hide Cursor
 	CONSOLE_CURSOR_INFO cursorInfo;
@@ -424,13 +1381,9 @@ VOID ResizeEventProc(WINDOW_BUFFER_SIZE_RECORD wbsr)
 	cursorInfo.bVisible = FALSE;
 	SetConsoleCursorInfo(hStdOut, &cursorInfo);
 
-//  Erase Previous Position
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
-	printf("                                                                ");
 // Set New Position
-//	dwCursorPosition.Y = wbsr.dwSize.Y - 2;
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
-    printf("Console screen buffer is %d columns by %d rows.", wbsr.dwSize.X, wbsr.dwSize.Y);
+//	StatusLine(wbsr.dwSize.Y - 2, ...
+    StatusLine(23, "Console screen buffer is %d columns by %d rows.", wbsr.dwSize.X, wbsr.dwSize.Y);
 }
 
 
@@ -485,702 +1438,130 @@ void InitScreen(int width, int height)
 	cursorInfo.bVisible = FALSE;
 	SetConsoleCursorInfo(hStdOut, &cursorInfo);
 
+	// From here on, the screen is drawn through the status back buffer
+	StatusInit(width, height, wTextAttrib);
 }
 
 
 //-----------------------------------------------------------------------------
+void RemoveKeyboardHook()
+{
+  if (keyboardHook != nullptr)
+  {
+    UnhookWindowsHookEx(keyboardHook);
+    keyboardHook = nullptr;
+  }
+}
+
 //
-// Convert VK/ Windows Virtual Key into a BreakCode for the KM232
-// 
-// A result of 0, means no translation available 
+// Keys Windows would act on itself, the hook eats these with --swallow
 //
-unsigned char KeyToMakeCode(WORD vkCode)
-{
-static const char table[ 256 ] 
+static bool KeyIsSystemCombo(const KBDLLHOOKSTRUCT* pHook)
 {
-	0, //"0x00",				// 0x00
-	0, //"VK_LBUTTON",		// 0x01
-	0, //"VK_RBUTTON",		// 0x02
-	0, //"VK_CANCEL",		// 0x03
-	0, //"VK_MBUTTON",		// 0x04 /* NOT contiguous with L & RBUTTON */
-	0, //"VK_XBUTTON1",		// 0x05 /* NOT contiguous with L & RBUTTON */
-	0, //"VK_XBUTTON2",		// 0x06 /* NOT contiguous with L & RBUTTON */
-	0, //"0x07",				// 0x07
-	15, // VK_BACK, 0x08
-	16, // VK_TAB,  0x09
-	0, //"0x0A",				// 0x0A
-	0, //"0x0B",				// 0x0B
-	0, //"VK_CLEAR",			// 0x0C
-	43, // VK_RETURN, 0x0D
-	0, //"0x0E",				// 0x0E
-	0, //"0x0F",				// 0x0F
-	44, // VK_SHIFT, 0x10 - This is the code for Left Shift
-	58, // VK_CONTROL, 0x11 - Left Control
-	60, // VK_MENU, 0x12 - Left Alt
-	0, //"VK_PAUSE",			// 0x13
-	30, // VK_CAPITAL, 0x14
-	0, //"VK_KANA",			// 0x15 VK_HANGEUL,VK_HANGUL
-	0, //"0x16",				// 0x16 unassigned
-	0, //"VK_JUNJA",			// 0x17
-	0, //"VK_FINAL",			// 0x18
-	0, //"VK_HANJA",			// 0x19 VK_KANJI
-	0, //"0x1A",				// 0x1A unassigned
-	110, // VK_ESCAPE, 0x1B
-	0, //"VK_CONVERT",		// 0x1C
-	0, //"VK_NONCONVERT",	// 0x1D
-	0, //"VK_ACCEPT",		// 0x1E
-	0, //"VK_MODECHANGE",	// 0x1F
-	61, // VK_SPACE, 0x20
-	85, // VK_PRIOR, 0x21 - Page Up
-	86, // VK_NEXT", 0x22 - Page Down
-	81, // VK_END, 0x23
-	80, // VK_HOME, 0x24
-	79, // VK_LEFT, 0x25
-	83, // VK_UP, 0x26
-	89, // VK_RIGHT, 0x27
-	84, // VK_DOWN, 0x28
-	0, //"VK_SELECT",		// 0x29
-	0, //"VK_PRINT",			// 0x2A
-	0, //"VK_EXECUTE",		// 0x2B
-	0, //"VK_SNAPSHOT",		// 0x2C
-	75, // VK_INSERT, 0x2D
-	76, // VK_DELETE, 0x2E
-	0, //"VK_HELP",			// 0x2F
-	11, // VK_0,0x30
-	2,  // VK_1,0x31
-	3,  // VK_2,0x32
-	4,  // VK_3,0x33
-	5,  // VK_4,0x34
-	6,  // VK_5,0x35
-	7,  // VK_6,0x36
-	8,  // VK_7,0x37
-	9,  // VK_8,0x38
-	10, // VK_9,0x39
-	0,  // 0x3A
-	0,  // 0x3B
-	0,  // 0x3C
-	0,  // 0x3D
-	0,  // 0x3E
-	0,  // 0x3F
-	0,  // 0x40
-	31, // VK_A, 0x41
-	50, // VK_B, 0x42
-	48, // VK_C, 0x43
-	33, // VK_D, 0x44
-	19, // VK_E, 0x45
-	34, // VK_F, 0x46
-	35, // VK_G, 0x47
-	36, // VK_H, 0x48
-	24, // VK_I, 0x49
-	37, // VK_J, 0x4A
-	38, // VK_K, 0x4B
-	39, // VK_L, 0x4C
-	52, // VK_M, 0x4D
-	51, // VK_N, 0x4E
-	25, // VK_O, 0x4F
-	26, // VK_P, 0x50
-	17, // VK_Q, 0x51
-	20, // VK_R, 0x52
-	32, // VK_S, 0x53
-	21, // VK_T, 0x54
-	23, // VK_U, 0x55
-	49, // VK_V, 0x56
-	18, // VK_W, 0x57
-	47, // VK_X, 0x58
-	22, // VK_Y, 0x59
-	46, // VK_Z, 0x5A
-	70, // VK_LWIN, 0x5B
-	71, // VK_RWIN, 0x5C
-	0, //"VK_APPS",          // 0x5D
-	0, //"0x5E",             // 0x5E reserved
-	0, //"VK_SLEEP",         // 0x5F
-	99, // VK_NUMPAD0, 0x60
-	93, // VK_NUMPAD1, 0x61
-	98, // VK_NUMPAD2, 0x62
-	103,// VK_NUMPAD3, 0x63
-	92, // VK_NUMPAD4, 0x64
-	97, // VK_NUMPAD5, 0x65
-	102,// VK_NUMPAD6, 0x66
-	91, // VK_NUMPAD7, 0x67
-	96, // VK_NUMPAD8, 0x68
-	101, //VK_NUMPAD9, 0x69
-	100, //"VK_MULTIPLY", 0x6A
-	106, //VK_ADD, 0x6B
-	0, //"VK_SEPARATOR",		// 0x6C
-	105,//VK_SUBTRACT,0x6D
-	104,//VK_DECIMAL, 0x6E
-	95, // VK_DIVIDE, 0x6F
-	112, // VK_F1, 0x70
-	113, // VK_F2, 0x71
-	114, // VK_F3, 0x72
-	115, // VK_F4, 0x73
-	116, // VK_F5, 0x74
-	117, // VK_F6, 0x75
-	118, // VK_F7, 0x76
-	119, // VK_F8, 0x77
-	120, // VK_F9, 0x78
-	121, // VK_F10, 0x79
-	122, // VK_F11, 0x7A
-	124, //123, // VK_F12, 0x7B
-	0, //"VK_F13",			// 0x7C
-	0, //"VK_F14",           // 0x7D
-	0, //"VK_F15",           // 0x7E
-	0, //"VK_F16",           // 0x7F
-	0, //"VK_F17",           // 0x80
-	0, //"VK_F18",           // 0x81
-	0, //"VK_F19",           // 0x82
-	0, //"VK_F20",           // 0x83
-	0, //"VK_F21",           // 0x84
-	0, //"VK_F22",           // 0x85
-	0, //"VK_F23",           // 0x86
-	0, //"VK_F24",           // 0x87
-	0, //"VK_NAVIGATION_VIEW",	// 0x88 reserved
-	0, //"VK_NAVIGATION_MENU",	// 0x89 reserved
-	0, //"VK_NAVIGATION_UP",		// 0x8A reserved
-	0, //"VK_NAVIGATION_DOWN",	// 0x8B reserved
-	0, //"VK_NAVIGATION_LEFT",	// 0x8C reserved
-	0, //"VK_NAVIGATION_RIGHT",	// 0x8D reserved
-	0, //"VK_NAVIGATION_ACCEPT",	// 0x8E reserved
-	0, //"VK_NAVIGATION_CANCEL",	// 0x8F reserved
-	90, // VK_NUMLOCK, 0x90
-	125,// VK_SCROLL,  0x91   Scroll Lock
-	0, //"VK_OEM_NEC_EQUAL",		// 0x92 '=' key on numpad, VK_OEM_FJ_JISHO 'Dictionary' key
-	0, //"VK_OEM_FJ_MASSHOU",	// 0x93 'Unregister word' key
-	0, //"VK_OEM_FJ_TOUROKU",	// 0x94 'Register word' key
-	0, //"VK_OEM_FJ_LOYA",		// 0x95 'Left OYAYUBI' key
-	0, //"VK_OEM_FJ_ROYA",		// 0x96 'Right OYAYUBI' key
-	0, //"0x97",					// 0x97
-	0, //"0x98",                 // 0x98
-	0, //"0x99",                 // 0x99
-	0, //"0x9A",                 // 0x9A
-	0, //"0x9B",                 // 0x9B
-	0, //"0x9C",                 // 0x9C
-	0, //"0x9D",                 // 0x9D
-	0, //"0x9E",                 // 0x9E
-	0, //"0x9F",                 // 0x9F
-	44, //VK_LSHIFT, 0xA0
-	57, //VK_RSHIFT, 0xA1
-	58, //VK_LCONTROL, 0xA2
-	64, //VK_RCONTROL, 0xA3
-	60, //VK_LMENU, 0xA4, L-Alt
-	62, //VK_RMENU, 0xA5, R-Alt
-	0, //"VK_BROWSER_BACK",		// 0xA6
-	0, //"VK_BROWSER_FORWARD",	// 0xA7
-	0, //"VK_BROWSER_REFRESH",	// 0xA8
-	0, //"VK_BROWSER_STOP",		// 0xA9
-	0, //"VK_BROWSER_SEARCH",	// 0xAA
-	0, //"VK_BROWSER_FAVORITES", // 0xAB
-	0, //"VK_BROWSER_HOME",		// 0xAC
-	0, //"VK_VOLUME_MUTE",		// 0xAD
-	0, //"VK_VOLUME_DOWN",		// 0xAE
-	0, //"VK_VOLUME_UP",			// 0xAF
-	0, //"VK_MEDIA_NEXT_TRACK",	// 0xB0
-	0, //"VK_MEDIA_PREV_TRACK",	// 0xB1
-	0, //"VK_MEDIA_STOP",		// 0xB2
-	0, //"VK_MEDIA_PLAY_PAUSE",	// 0xB3
-	0, //"VK_LAUNCH_MAIL",		// 0xB4
-	0, //"VK_LAUNCH_MEDIA_SELECT", // 0xB5
-	0, //"VK_LAUNCH_APP1",   	// 0xB6
-	0, //"VK_LAUNCH_APP2",		// 0xB7
-	0, //"0xB8",					// 0xB8
-	0, //"0xB9",					// 0xB9
-	40, // VK_OEM_1, 0xBA, ';:' for US
-	13, // VK_OEM_PLUS, 0xBB, '=+' any country
-	53, // VK_OEM_COMMA, 0xBC ',<' any country
-	12, // VK_OEM_MINUS, 0xBD, '-_' any country
-	54, // VK_OEM_PERIOD, 0xBE '.>' any country
-	55, // VK_OEM_2, 0xBF, '/?' for US
-	1, //VK_OEM_3,0xC0 '`~' for US
-	0, //"0xC1",					// 0xC1
-	0, //"0xC2",					// 0xC2
-	0, //"VK_GAMEPAD_A",							// 0xC3 reserved
-	0, //"VK_GAMEPAD_B",							// 0xC4 reserved
-	0, //"VK_GAMEPAD_X",							// 0xC5 reserved
-	0, //"VK_GAMEPAD_Y",							// 0xC6 reserved
-	0, //"VK_GAMEPAD_RIGHT_SHOULDER",			// 0xC7 reserved
-	0, //"VK_GAMEPAD_LEFT_SHOULDER",				// 0xC8 reserved
-	0, //"VK_GAMEPAD_LEFT_TRIGGER",				// 0xC9 reserved
-	0, //"VK_GAMEPAD_RIGHT_TRIGGER",				// 0xCA reserved
-	0, //"VK_GAMEPAD_DPAD_UP",					// 0xCB reserved
-	0, //"VK_GAMEPAD_DPAD_DOWN",					// 0xCC reserved
-	0, //"VK_GAMEPAD_DPAD_LEFT",					// 0xCD reserved
-	0, //"VK_GAMEPAD_DPAD_RIGHT",				// 0xCE reserved
-	0, //"VK_GAMEPAD_MENU",						// 0xCF reserved
-	0, //"VK_GAMEPAD_VIEW",						// 0xD0 reserved
-	0, //"VK_GAMEPAD_LEFT_THUMBSTICK_BUTTON",	// 0xD1 reserved
-	0, //"VK_GAMEPAD_RIGHT_THUMBSTICK_BUTTON",   // 0xD2 reserved
-	0, //"VK_GAMEPAD_LEFT_THUMBSTICK_UP",		// 0xD3 reserved
-	0, //"VK_GAMEPAD_LEFT_THUMBSTICK_DOWN",		// 0xD4 reserved
-	0, //"VK_GAMEPAD_LEFT_THUMBSTICK_RIGHT",		// 0xD5 reserved
-	0, //"VK_GAMEPAD_LEFT_THUMBSTICK_LEFT", 		// 0xD6 reserved
-	0, //"VK_GAMEPAD_RIGHT_THUMBSTICK_UP",		// 0xD7 reserved
-	0, //"VK_GAMEPAD_RIGHT_THUMBSTICK_DOWN",		// 0xD8 reserved
-	0, //"VK_GAMEPAD_RIGHT_THUMBSTICK_RIGHT",	// 0xD9 reserved
-	0, //"VK_GAMEPAD_RIGHT_THUMBSTICK_LEFT",		// 0xDA reserved
-	27, // VK_OEM_4, 0xDB, '[{' for US
-	29, // VK_OEM_5, 0xDC, '\|' for US
-	28, // VK_OEM_6, 0xDD, ']}' for US
-	41, // VK_OEM_7, 0xDE, ''"' for US
-	0, //"VK_OEM_8",			    // 0xDF
-	0, //"0xE0",				    // 0xE0
-	0, //"VK_OEM_AX",		    // 0xE1 'AX' key on Japanese AX kbd
-	0, //"VK_OEM_102",		    // 0xE2 "<>" or "\|" on RT 102-key kbd.
-	0, //"VK_ICO_HELP",		    // 0xE3 Help key on ICO
-	0, //"VK_ICO_00",		    // 0xE4 00 key on ICO
-	0, //"VK_PROCESSKEY",	    // 0xE5
-	0, //"VK_ICO_CLEAR",		    // 0xE6
-	0, //"VK_PACKET",		    // 0xE7
-	0, //"0xE8",				    // 0xE8
-	0, //"VK_OEM_RESET",		    // 0xE9
-	0, //"VK_OEM_JUMP",		    // 0xEA
-	0, //"VK_OEM_PA1",		    // 0xEB
-	0, //"VK_OEM_PA2",		    // 0xEC
-	0, //"VK_OEM_PA3",		    // 0xED
-	0, //"VK_OEM_WSCTRL",	    // 0xEE
-	0, //"VK_OEM_CUSEL",		    // 0xEF
-	0, //"VK_OEM_ATTN",		    // 0xF0
-	0, //"VK_OEM_FINISH",	    // 0xF1
-	0, //"VK_OEM_COPY",		    // 0xF2
-	0, //"VK_OEM_AUTO",		    // 0xF3
-	0, //"VK_OEM_ENLW",		    // 0xF4
-	0, //"VK_OEM_BACKTAB",	    // 0xF5
-	0, //"VK_ATTN",			    // 0xF6
-	0, //"VK_CRSEL",			    // 0xF7
-	0, //"VK_EXSEL",			    // 0xF8
-	0, //"VK_EREOF",			    // 0xF9
-	0, //"VK_PLAY",			    // 0xFA
-	0, //"VK_ZOOM",			    // 0xFB
-	0, //"VK_NONAME",		    // 0xFC
-	0, //"VK_PA1",			    // 0xFD
-	0, //"VK_OEM_CLEAR",		    // 0xFE
-	0  //"0xFF"				    // 0xFF
-};
-	return table[ vkCode & 0xFF ];
-}
+	switch (pHook->vkCode)
+	{
+	case VK_LWIN:
+	case VK_RWIN:
+		return true;
+
+	case VK_TAB:
+	case VK_F4:
+	case VK_SPACE:
+		// Alt-Tab, Alt-F4, and the system menu
+		return 0 != (pHook->flags & LLKHF_ALTDOWN);
+
+	case VK_ESCAPE:
+		// Alt-Esc, Ctrl-Esc, and Ctrl-Shift-Esc
+		return (0 != (pHook->flags & LLKHF_ALTDOWN)) ||
+			   keys.Contains(VK_LCONTROL) || keys.Contains(VK_RCONTROL);
+	}
 
-//-----------------------------------------------------------------------------
+	return false;
+}
 
-const char* KeyToString(WORD vkCode)
+// Does more than queue a command, see KeyRelay
+static bool KeyIsLocal(WORD vkCode)
 {
-static const char* table[ 256 ]
-{
-		"0x00",				// 0x00
-		"VK_LBUTTON",		// 0x01
-		"VK_RBUTTON",		// 0x02
-		"VK_CANCEL",		// 0x03
-		"VK_MBUTTON",		// 0x04 /* NOT contiguous with L & RBUTTON */
-		"VK_XBUTTON1",		// 0x05 /* NOT contiguous with L & RBUTTON */
-		"VK_XBUTTON2",		// 0x06 /* NOT contiguous with L & RBUTTON */
-		"0x07",				// 0x07
-		"VK_BACK",			// 0x08
-		"VK_TAB",			// 0x09
-		"0x0A",				// 0x0A
-		"0x0B",				// 0x0B
-		"VK_CLEAR",			// 0x0C
-		"VK_RETURN",		// 0x0D
-		"0x0E",				// 0x0E
-		"0x0F",				// 0x0F
-		"VK_SHIFT",			// 0x10
-		"VK_CONTROL",		// 0x11
-		"VK_MENU",			// 0x12
-		"VK_PAUSE",			// 0x13
-		"VK_CAPITAL",		// 0x14
-		"VK_KANA",			// 0x15 VK_HANGEUL,VK_HANGUL
-		"0x16",				// 0x16 unassigned
-		"VK_JUNJA",			// 0x17
-		"VK_FINAL",			// 0x18
-		"VK_HANJA",			// 0x19 VK_KANJI
-		"0x1A",				// 0x1A unassigned
-		"VK_ESCAPE",		// 0x1B
-		"VK_CONVERT",		// 0x1C
-		"VK_NONCONVERT",	// 0x1D
-		"VK_ACCEPT",		// 0x1E
-		"VK_MODECHANGE",	// 0x1F
-		"VK_SPACE",			// 0x20
-		"VK_PRIOR",			// 0x21
-		"VK_NEXT",			// 0x22
-		"VK_END",			// 0x23
-		"VK_HOME",			// 0x24
-		"VK_LEFT",			// 0x25
-		"VK_UP",			// 0x26
-		"VK_RIGHT",			// 0x27
-		"VK_DOWN",			// 0x28
-		"VK_SELECT",		// 0x29
-		"VK_PRINT",			// 0x2A
-		"VK_EXECUTE",		// 0x2B
-		"VK_SNAPSHOT",		// 0x2C
-		"VK_INSERT",		// 0x2D
-		"VK_DELETE",		// 0x2E
-		"VK_HELP",			// 0x2F
-		"VK_0",				// 0x30
-		"VK_1",				// 0x31
-		"VK_2",				// 0x32
-		"VK_3",             // 0x33
-		"VK_4",             // 0x34
-		"VK_5",             // 0x35
-		"VK_6",             // 0x36
-		"VK_7",             // 0x37
-		"VK_8",             // 0x38
-		"VK_9",             // 0x39
-		"0x3A",             // 0x3A
-		"0x3B",             // 0x3B
-		"0x3C",             // 0x3C
-		"0x3D",             // 0x3D
-		"0x3E",             // 0x3E
-		"0x3F",             // 0x3F
-		"0x40",             // 0x40 unassigned
-		"VK_A",             // 0x41
-		"VK_B",             // 0x42
-		"VK_C",             // 0x43
-		"VK_D",             // 0x44
-		"VK_E",             // 0x45
-		"VK_F",             // 0x46
-		"VK_G",             // 0x47
-		"VK_H",             // 0x48
-		"VK_I",             // 0x49
-		"VK_J",             // 0x4A
-		"VK_K",             // 0x4B
-		"VK_L",             // 0x4C
-		"VK_M",             // 0x4D
-		"VK_N",             // 0x4E
-		"VK_O",             // 0x4F
-		"VK_P",             // 0x50
-		"VK_Q",             // 0x51
-		"VK_R",             // 0x52
-		"VK_S",             // 0x53
-		"VK_T",             // 0x54
-		"VK_U",             // 0x55
-		"VK_V",             // 0x56
-		"VK_W",             // 0x57
-		"VK_X",             // 0x58
-		"VK_Y",             // 0x59
-		"VK_Z",             // 0x5A
-		"VK_LWIN",          // 0x5B
-		"VK_RWIN",          // 0x5C
-		"VK_APPS",          // 0x5D
-		"0x5E",             // 0x5E reserved
-		"VK_SLEEP",         // 0x5F
-		"VK_NUMPAD0",       // 0x60
-		"VK_NUMPAD1",       // 0x61
-		"VK_NUMPAD2",       // 0x62
-		"VK_NUMPAD3",       // 0x63
-		"VK_NUMPAD4",       // 0x64
-		"VK_NUMPAD5",       // 0x65
-		"VK_NUMPAD6",       // 0x66
-		"VK_NUMPAD7",       // 0x67
-		"VK_NUMPAD8",       // 0x68
-		"VK_NUMPAD9",       // 0x69
-		"VK_MULTIPLY",      // 0x6A
-		"VK_ADD",           // 0x6B
-		"VK_SEPARATOR",		// 0x6C
-		"VK_SUBTRACT",		// 0x6D
-		"VK_DECIMAL", 		// 0x6E
-		"VK_DIVIDE",		// 0x6F
-		"VK_F1",			// 0x70
-		"VK_F2",			// 0x71
-		"VK_F3",            // 0x72
-		"VK_F4",            // 0x73
-		"VK_F5",            // 0x74
-		"VK_F6",            // 0x75
-		"VK_F7",            // 0x76
-		"VK_F8",            // 0x77
-		"VK_F9",            // 0x78
-		"VK_F10",			// 0x79
-		"VK_F11",			// 0x7A
-		"VK_F12",			// 0x7B
-		"VK_F13",			// 0x7C
-		"VK_F14",           // 0x7D
-		"VK_F15",           // 0x7E
-		"VK_F16",           // 0x7F
-		"VK_F17",           // 0x80
-		"VK_F18",           // 0x81
-		"VK_F19",           // 0x82
-		"VK_F20",           // 0x83
-		"VK_F21",           // 0x84
-		"VK_F22",           // 0x85
-		"VK_F23",           // 0x86
-		"VK_F24",           // 0x87
-		"VK_NAVIGATION_VIEW",	// 0x88 reserved
-		"VK_NAVIGATION_MENU",	// 0x89 reserved
-		"VK_NAVIGATION_UP",		// 0x8A reserved
-		"VK_NAVIGATION_DOWN",	// 0x8B reserved
-		"VK_NAVIGATION_LEFT",	// 0x8C reserved
-		"VK_NAVIGATION_RIGHT",	// 0x8D reserved
-		"VK_NAVIGATION_ACCEPT",	// 0x8E reserved
-		"VK_NAVIGATION_CANCEL",	// 0x8F reserved
-		"VK_NUMLOCK",			// 0x90
-		"VK_SCROLL",			// 0x91
-		"VK_OEM_NEC_EQUAL",		// 0x92 '=' key on numpad, VK_OEM_FJ_JISHO 'Dictionary' key
-		"VK_OEM_FJ_MASSHOU",	// 0x93 'Unregister word' key
-		"VK_OEM_FJ_TOUROKU",	// 0x94 'Register word' key
-		"VK_OEM_FJ_LOYA",		// 0x95 'Left OYAYUBI' key
-		"VK_OEM_FJ_ROYA",		// 0x96 'Right OYAYUBI' key
-		"0x97",					// 0x97
-		"0x98",                 // 0x98
-		"0x99",                 // 0x99
-		"0x9A",                 // 0x9A
-		"0x9B",                 // 0x9B
-		"0x9C",                 // 0x9C
-		"0x9D",                 // 0x9D
-		"0x9E",                 // 0x9E
-		"0x9F",                 // 0x9F
-		"VK_LSHIFT",			// 0xA0
-		"VK_RSHIFT",			// 0xA1
-		"VK_LCONTROL",			// 0xA2
-		"VK_RCONTROL",			// 0xA3
-		"VK_LMENU",				// 0xA4
-		"VK_RMENU",				// 0xA5
-		"VK_BROWSER_BACK",		// 0xA6
-		"VK_BROWSER_FORWARD",	// 0xA7
-		"VK_BROWSER_REFRESH",	// 0xA8
-		"VK_BROWSER_STOP",		// 0xA9
-		"VK_BROWSER_SEARCH",	// 0xAA
-		"VK_BROWSER_FAVORITES", // 0xAB
-		"VK_BROWSER_HOME",		// 0xAC
-		"VK_VOLUME_MUTE",		// 0xAD
-		"VK_VOLUME_DOWN",		// 0xAE
-		"VK_VOLUME_UP",			// 0xAF
-		"VK_MEDIA_NEXT_TRACK",	// 0xB0
-		"VK_MEDIA_PREV_TRACK",	// 0xB1
-		"VK_MEDIA_STOP",		// 0xB2
-		"VK_MEDIA_PLAY_PAUSE",	// 0xB3
-		"VK_LAUNCH_MAIL",		// 0xB4
-		"VK_LAUNCH_MEDIA_SELECT", // 0xB5
-		"VK_LAUNCH_APP1",   	// 0xB6
-		"VK_LAUNCH_APP2",		// 0xB7
-		"0xB8",					// 0xB8
-		"0xB9",					// 0xB9
-		"VK_OEM_1",				// 0xBA ';:' for US
-		"VK_OEM_PLUS",			// 0xBB '+' any country
-		"VK_OEM_COMMA",			// 0xBC ',' any country
-		"VK_OEM_MINUS",			// 0xBD '-' any country
-		"VK_OEM_PERIOD",		// 0xBE '.' any country
-		"VK_OEM_2",				// 0xBF '/?' for US
-		"VK_OEM_3",				// 0xC0 '`~' for US
-		"0xC1",					// 0xC1
-		"0xC2",					// 0xC2
-		"VK_GAMEPAD_A",							// 0xC3 reserved
-		"VK_GAMEPAD_B",							// 0xC4 reserved
-		"VK_GAMEPAD_X",							// 0xC5 reserved
-		"VK_GAMEPAD_Y",							// 0xC6 reserved
-		"VK_GAMEPAD_RIGHT_SHOULDER",			// 0xC7 reserved
-		"VK_GAMEPAD_LEFT_SHOULDER",				// 0xC8 reserved
-		"VK_GAMEPAD_LEFT_TRIGGER",				// 0xC9 reserved
-		"VK_GAMEPAD_RIGHT_TRIGGER",				// 0xCA reserved
-		"VK_GAMEPAD_DPAD_UP",					// 0xCB reserved
-		"VK_GAMEPAD_DPAD_DOWN",					// 0xCC reserved
-		"VK_GAMEPAD_DPAD_LEFT",					// 0xCD reserved
-		"VK_GAMEPAD_DPAD_RIGHT",				// 0xCE reserved
-		"VK_GAMEPAD_MENU",						// 0xCF reserved
-		"VK_GAMEPAD_VIEW",						// 0xD0 reserved
-		"VK_GAMEPAD_LEFT_THUMBSTICK_BUTTON",	// 0xD1 reserved
-		"VK_GAMEPAD_RIGHT_THUMBSTICK_BUTTON",   // 0xD2 reserved
-		"VK_GAMEPAD_LEFT_THUMBSTICK_UP",		// 0xD3 reserved
-		"VK_GAMEPAD_LEFT_THUMBSTICK_DOWN",		// 0xD4 reserved
-		"VK_GAMEPAD_LEFT_THUMBSTICK_RIGHT",		// 0xD5 reserved
-		"VK_GAMEPAD_LEFT_THUMBSTICK_LEFT", 		// 0xD6 reserved
-		"VK_GAMEPAD_RIGHT_THUMBSTICK_UP",		// 0xD7 reserved
-		"VK_GAMEPAD_RIGHT_THUMBSTICK_DOWN",		// 0xD8 reserved
-		"VK_GAMEPAD_RIGHT_THUMBSTICK_RIGHT",	// 0xD9 reserved
-		"VK_GAMEPAD_RIGHT_THUMBSTICK_LEFT",		// 0xDA reserved
-		"VK_OEM_4",				// 0xDB '[{' for US
-		"VK_OEM_5",			    // 0xDC '\|' for US
-		"VK_OEM_6",			    // 0xDD ']}' for US
-		"VK_OEM_7",			    // 0xDE ''"' for US
-		"VK_OEM_8",			    // 0xDF
-		"0xE0",				    // 0xE0
-		"VK_OEM_AX",		    // 0xE1 'AX' key on Japanese AX kbd
-		"VK_OEM_102",		    // 0xE2 "<>" or "\|" on RT 102-key kbd.
-		"VK_ICO_HELP",		    // 0xE3 Help key on ICO
-		"VK_ICO_00",		    // 0xE4 00 key on ICO
-		"VK_PROCESSKEY",	    // 0xE5
-		"VK_ICO_CLEAR",		    // 0xE6
-		"VK_PACKET",		    // 0xE7
-		"0xE8",				    // 0xE8
-		"VK_OEM_RESET",		    // 0xE9
-		"VK_OEM_JUMP",		    // 0xEA
-		"VK_OEM_PA1",		    // 0xEB
-		"VK_OEM_PA2",		    // 0xEC
-		"VK_OEM_PA3",		    // 0xED
-		"VK_OEM_WSCTRL",	    // 0xEE
-		"VK_OEM_CUSEL",		    // 0xEF
-		"VK_OEM_ATTN",		    // 0xF0
-		"VK_OEM_FINISH",	    // 0xF1
-		"VK_OEM_COPY",		    // 0xF2
-		"VK_OEM_AUTO",		    // 0xF3
-		"VK_OEM_ENLW",		    // 0xF4
-		"VK_OEM_BACKTAB",	    // 0xF5
-		"VK_ATTN",			    // 0xF6
-		"VK_CRSEL",			    // 0xF7
-		"VK_EXSEL",			    // 0xF8
-		"VK_EREOF",			    // 0xF9
-		"VK_PLAY",			    // 0xFA
-		"VK_ZOOM",			    // 0xFB
-		"VK_NONAME",		    // 0xFC
-		"VK_PA1",			    // 0xFD
-		"VK_OEM_CLEAR",		    // 0xFE
-		"0xFF"				    // 0xFF
-};
-	return table[ vkCode & 0xFF ];
+	return (VK_PAUSE == vkCode) || (VK_APPS == vkCode) || ((VK_ESCAPE == vkCode) && PasteActive());
 }
 
-
 //-----------------------------------------------------------------------------
-
-void InitSerialPort(const char* portName)
+//
+// Called from inside our message pump, for every key on the system.  This
+// has to be quick, Windows gives up on a hook that takes too long, and
+// then takes it out, so all that happens here is the make or break going
+// into the serial queue, which never blocks
+//
+LRESULT CALLBACK LowLevelKeyboardHook(int code, WPARAM wParam, LPARAM lParam)
 {
-//-------------------------------------------------------
-// Cursor Position ($$TODO), make this easier
-	COORD dwCursorPosition;
-	dwCursorPosition.X = 0;
-	dwCursorPosition.Y = 0;
-	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
-//-------------------------------------------------------
-
-	sp_get_port_by_name(portName, &pSCC);
-
-	if (pSCC)
-	{
-		if (SP_OK == sp_open(pSCC, SP_MODE_READ_WRITE))
-		{
-			#if !ASC232
-			sp_set_baudrate(pSCC, 9600);
-			sp_set_bits(pSCC, 8);
-			sp_set_parity(pSCC, SP_PARITY_NONE);
-			sp_set_stopbits(pSCC, 1);
-			sp_set_flowcontrol(pSCC, SP_FLOWCONTROL_NONE);
-			#else
-			sp_set_baudrate(pSCC, 38400);
-			sp_set_bits(pSCC, 8);
-			sp_set_parity(pSCC, SP_PARITY_NONE);
-			sp_set_stopbits(pSCC, 1);
-			sp_set_flowcontrol(pSCC, SP_FLOWCONTROL_RTSCTS);
-			#endif
-
-#if ASC232
-//			Sleep(1000);
-#endif
-
-
-			// Probably a good idea to reset the keyboard if it's out first connect
-			int result = SerialSend( USB_BufferClear );
-			//printf("result = %02x", result);
+	if (HC_ACTION != code)
+		return CallNextHookEx(nullptr, code, wParam, lParam);
 
-#if KM232
-			if (result >= 0)
-				result = SerialSend( USB_MouseFast );
-#endif
+	const KBDLLHOOKSTRUCT* pHook = reinterpret_cast<const KBDLLHOOKSTRUCT*>(lParam);
 
-			if (result >= 0)
-				result = SerialSend( USB_StatusLEDRead );
+	// Leave anything we (or someone else) injected alone, and in a
+	// window, only take the keys while the window has focus
+	if ((pHook->flags & LLKHF_INJECTED) || (!bHeadless && !bHasFocus))
+		return CallNextHookEx(nullptr, code, wParam, lParam);
 
-//			printf(" result = %02x", result);
+	WORD vkCode = (WORD)pHook->vkCode;
+	bool bKeyDown = (WM_KEYDOWN == wParam) || (WM_SYSKEYDOWN == wParam);
+	bool bExtended = (pHook->flags & LLKHF_EXTENDED) ? true : false;
 
-			if (result >= 0)
-			{
-				if ((result >= 0x30) && (result <= 0x37))
-				{
-					#if ASC232
-					printf("ASC232 live on %s", portName);
-					#else
-					printf("KM232 live on %s", portName);
-					#endif
-				}
-			}
-			else
-			{
-				printf("No Response on %s", portName);
-			}
-		}
-		else
+	if (KeyIsLocal(vkCode))
+	{
+		if (deferredCount < (int)(sizeof(deferredKeys) / sizeof(deferredKeys[ 0 ])))
 		{
-			printf("FAILED TO OPEN - %s", portName);
+			DeferredKey& key = deferredKeys[ deferredCount++ ];
+			key.vkCode = vkCode;
+			key.bKeyDown = bKeyDown;
+			key.bExtended = bExtended;
 		}
 	}
 	else
 	{
-		printf("FAILED TO FIND PORT - %s", portName);
+		SerialBeginFrame();
+		SerialCaptureTime(LatencyNow());
+		KeyRelay(vkCode, bKeyDown, bExtended);
+		SerialEndFrame();
 	}
+
+	if (bSwallow && KeyIsSystemCombo(pHook))
+		return 1;
+
+	return CallNextHookEx(nullptr, code, wParam, lParam);
 }
 
 //-----------------------------------------------------------------------------
 //
-// if result < 0, then timeout, or other error
+// Give the hook its chance to run, when nothing else is pumping messages
 //
-int SerialSend(unsigned char command)
+void KeyHookPump()
 {
-	int result = -1;
-
-	if (pSCC)
+	MSG msg;
+	while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
 	{
-		int num_bytes = sp_blocking_write(pSCC, &command, 1, 50);
-
-		if (1 == num_bytes)
-		{
-			// Value Sent, get the result, and return it back
-			unsigned char byte = 0;
-			num_bytes = sp_blocking_read(pSCC, &byte, 1, 50);
-
-			if (1 == num_bytes)
-			{
-				// We got a result
-				result = (int)byte;
-			}
-		}
+		DispatchMessage(&msg);
 	}
-
-	return result;
-}
-//-----------------------------------------------------------------------------
-void RemoveKeyboardHook()
-{
-  if (keyboardHook != nullptr)
-  {
-    UnhookWindowsHookEx(keyboardHook);
-    keyboardHook = nullptr;
-  }
 }
 
-LRESULT CALLBACK LowLevelKeyboardHook(int code, WPARAM wParam, LPARAM lParam)
+// The keys the hook put off, now that there's time
+void KeyDeferredRelay()
 {
-#if 0
-  static bool deskManagerKeysDown = false;
-  if ((wParam == WM_KEYDOWN) || (wParam == WM_KEYUP))
-  {
-    KBDLLHOOKSTRUCT* hookStruct = reinterpret_cast<KBDLLHOOKSTRUCT*>(lParam);
-    if ((hookStruct->vkCode == VK_ESCAPE) && (GetAsyncKeyState(VK_CONTROL) < 0) && (GetAsyncKeyState(VK_MENU) < 0))
-    {
-      //Direct2DWindow* mainWindow = Direct2DWindow::GetMainWindow();
-      //if ((mainWindow != nullptr) && (GetActiveWindow() == mainWindow->GetHwnd()))
-      {
-		#if 1
-        if (wParam == WM_KEYDOWN)
-        {
-          // make sure we only add Ctrl+OA+Esc to the queue once
-          if (!deskManagerKeysDown)
-          {
-            deskManagerKeysDown = true;
-            //keyboard->keycodeQueue.push(KEYCODE_ESCAPE);
-          }
-        }
-        else
-        {
-          //keyboard->keycodeQueue.push(KEYCODE_ESCAPE | '\x80');
-          deskManagerKeysDown = false;
-        }
-		#endif
-        return reinterpret_cast<LPARAM>(&LowLevelKeyboardHook);
-      }
-    }
-  }
-#endif
-  return CallNextHookEx(nullptr, code, wParam, lParam);
+	for (int idx = 0; idx < deferredCount; ++idx)
+	{
+		const DeferredKey& key = deferredKeys[ idx ];
+		KeyRelay(key.vkCode, key.bKeyDown, key.bExtended);
+	}
+
+	deferredCount = 0;
 }
+
+//-----------------------------------------------------------------------------
 void RegisterKeyboardHook()
 {
   if (keyboardHook == nullptr)
   {
-    //keyboard = this;
     keyboardHook = SetWindowsHookEx(WH_KEYBOARD_LL, LowLevelKeyboardHook, GetModuleHandle(nullptr), 0);
   }
 }
@@ -0,0 +1,69 @@
+//
+// motion.cpp - Relative mouse motion encoder
+//
+// The writer thread calls this with whatever motion has piled up since the
+// last time it got around to the mouse, so the device is only ever sent
+// the latest residual, never a backlog of stale positions.
+//
+
+#include "motion.h"
+
+#include <stdlib.h>
+
+//-----------------------------------------------------------------------------
+
+void MotionInit(MotionEncoder& enc, int fastStep, bool fast)
+{
+	enc.fastStep = fastStep;
+	enc.fast = fast && (fastStep > 0);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Interleave the X and Y steps, so a diagonal move looks like a diagonal
+// on the target, even when the burst gets cut short
+//
+int MotionEncode(MotionEncoder& enc, int& dx, int& dy, unsigned char* out, int maxBytes)
+{
+	int count = 0;
+
+	while ((dx || dy) && (count < maxBytes))
+	{
+		int ax = abs(dx);
+		int ay = abs(dy);
+		int big = (ax > ay) ? ax : ay;
+
+		// Going fast costs a mode switch, so only do it when there are at
+		// least two fast steps to make, and stay fast while one still fits
+		bool wantFast = false;
+
+		if (enc.fastStep)
+		{
+			wantFast = enc.fast ? (big >= enc.fastStep) : (big >= (enc.fastStep * 2));
+		}
+
+		if (wantFast != enc.fast)
+		{
+			out[ count++ ] = wantFast ? USB_MouseFast : USB_MouseSlow;
+			enc.fast = wantFast;
+			continue;
+		}
+
+		int step = enc.fast ? enc.fastStep : 1;
+
+		if (ax >= step)
+		{
+			out[ count++ ] = (dx > 0) ? USB_MouseRight : USB_MouseLeft;
+			dx += (dx > 0) ? -step : step;
+		}
+
+		if ((ay >= step) && (count < maxBytes))
+		{
+			out[ count++ ] = (dy > 0) ? USB_MouseDown : USB_MouseUp;
+			dy += (dy > 0) ? -step : step;
+		}
+	}
+
+	return count;
+}
+
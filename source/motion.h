@@ -0,0 +1,24 @@
+//
+// motion.h - Relative mouse motion encoder
+//
+// The KM232 only knows how to move the mouse one step at a time, so
+// a delta has to be spelled out as a run of USB_MouseLeft/Right/Up/Down.
+// In fast mode, each step covers several counts, so large moves are
+// sent as fast steps, and only the remainder is sent slow.
+//
+#pragma once
+
+#include "km232.h"
+
+struct MotionEncoder
+{
+	int  fastStep;	 // counts covered by one command in fast mode, 0 if the device has no fast mode
+	bool fast;		 // what mode we believe the device is in right now
+};
+
+void MotionInit(MotionEncoder& enc, int fastStep, bool fast);
+
+// Encode as much of dx,dy as fits into maxBytes, returns the number of bytes
+// dx,dy are left holding the residual that did not get encoded
+int MotionEncode(MotionEncoder& enc, int& dx, int& dy, unsigned char* out, int maxBytes);
+
@@ -0,0 +1,320 @@
+//
+// net.cpp - Serial link over the network, framing and the server
+//
+// The server does no pipelining of its own, every byte from the client
+// goes straight out the port, and every byte back from the device goes
+// straight back to the client, as soon as the port has it.
+//
+
+#include "netproto.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+
+bool NetStartup()
+{
+	static bool bStarted = false;
+
+	if (!bStarted)
+	{
+		WSADATA wsaData;
+		bStarted = (0 == WSAStartup(MAKEWORD(2, 2), &wsaData));
+	}
+
+	return bStarted;
+}
+
+LONGLONG NetNowUs()
+{
+	static LONGLONG frequency = 0;
+
+	if (0 == frequency)
+	{
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		frequency = freq.QuadPart;
+	}
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	return (now.QuadPart / frequency) * 1000000 + ((now.QuadPart % frequency) * 1000000) / frequency;
+}
+
+//-----------------------------------------------------------------------------
+
+bool NetSendFrame(SOCKET s, NetFrameType type, const void* pPayload, int length,
+				  unsigned int sequence, LONGLONG timeUs)
+{
+	unsigned char frame[ sizeof(NetFrameHeader) + NetMaxPayload ];
+
+	if (length > NetMaxPayload)
+		return false;
+
+	NetFrameHeader header;
+	header.length   = (unsigned short)length;
+	header.type     = (unsigned char)type;
+	header.reserved = 0;
+	header.sequence = sequence;
+	header.timeUs   = timeUs;
+
+	memcpy(frame, &header, sizeof(header));
+	memcpy(frame + sizeof(header), pPayload, length);
+
+	// One send, so with Nagle off, it's one segment
+	int total = (int)sizeof(header) + length;
+	int sent = 0;
+
+	while (sent < total)
+	{
+		int num_bytes = send(s, (const char*)frame + sent, total - sent, 0);
+
+		if (SOCKET_ERROR == num_bytes)
+		{
+			if (WSAEWOULDBLOCK != WSAGetLastError())
+				return false;
+
+			Sleep(0);	// the send buffer is full, which on a LAN is never
+			continue;
+		}
+
+		sent += num_bytes;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool NetReceive(SOCKET s, NetReceiver& receiver)
+{
+	for (;;)
+	{
+		int room = (int)sizeof(receiver.buffer) - receiver.count;
+
+		if (0 == room)
+			return true;	// take a frame out first
+
+		int num_bytes = recv(s, (char*)receiver.buffer + receiver.count, room, 0);
+
+		if (0 == num_bytes)
+			return false;	// closed
+
+		if (SOCKET_ERROR == num_bytes)
+			return WSAEWOULDBLOCK == WSAGetLastError();
+
+		receiver.count += num_bytes;
+	}
+}
+
+int NetNextFrame(NetReceiver& receiver, NetFrameHeader& header, unsigned char* pPayload)
+{
+	if (receiver.count < (int)sizeof(header))
+		return 0;
+
+	memcpy(&header, receiver.buffer, sizeof(header));
+
+	// It would never fit in the buffer, so it would never be whole
+	if (header.length > NetMaxPayload)
+		return -1;
+
+	int total = (int)sizeof(header) + header.length;
+
+	if (receiver.count < total)
+		return 0;
+
+	memcpy(pPayload, receiver.buffer + sizeof(header), header.length);
+
+	receiver.count -= total;
+	memmove(receiver.buffer, receiver.buffer + total, receiver.count);
+
+	return 1;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Until the client goes away
+//
+static void NetServeClient(SOCKET client, const char* portName, SerialBackend backend)
+{
+	BOOL bNoDelay = TRUE;
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&bNoDelay, sizeof(bNoDelay));
+
+	// Signaled when there's something to read, so it can be waited on
+	// along with the port
+	HANDLE hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	WSAEventSelect(client, hEvent, FD_READ | FD_CLOSE);
+
+	SerialDevice* pDevice = CreateSerialDevice(backend);
+	bool bOpen = false;
+
+	static NetReceiver receiver;
+	receiver.count = 0;
+
+	unsigned char payload[ NetMaxPayload ];
+	unsigned int  expectSequence = 1;
+	unsigned int  outOfSequence = 0;	// reported when the client goes
+	unsigned int  sequence = 0;
+	int           frameResult = 0;
+	LONGLONG	  lastWriteUs = 0;
+
+	for (;;)
+	{
+		WSANETWORKEVENTS events;
+		WSAEnumNetworkEvents(client, hEvent, &events);	// resets the event
+
+		if (!NetReceive(client, receiver))
+			break;
+
+		NetFrameHeader header;
+
+		while ((frameResult = NetNextFrame(receiver, header, payload)) > 0)
+		{
+			if (header.sequence != expectSequence)
+			{
+				outOfSequence++;
+			}
+			expectSequence = header.sequence + 1;
+
+			if ((NetOpen == header.type) && (header.length == sizeof(NetOpenRequest)))
+			{
+				NetOpenRequest request;
+				memcpy(&request, payload, sizeof(request));
+
+				int result = pDevice->Open(portName, request.baudrate, 0 != request.bRtsCts);
+				bOpen = (SERIAL_OK == result);
+
+				printf("Open %s at %d: %s\n", portName, request.baudrate, bOpen ? "ok" : "failed");
+
+				NetSendFrame(client, NetOpenResult, &result, sizeof(result), ++sequence, header.timeUs);
+			}
+			else if ((NetData == header.type) && bOpen)
+			{
+				pDevice->Write(payload, header.length, 50);
+				lastWriteUs = header.timeUs;
+			}
+		}
+
+		if (frameResult < 0)
+		{
+			printf("Bad frame, %u bytes, dropping the client\n", header.length);
+			break;
+		}
+
+		if (bOpen)
+		{
+			int num_bytes = pDevice->ReadAvailable(payload, sizeof(payload));
+
+			if (num_bytes < 0)
+			{
+				printf("Lost %s\n", portName);
+				pDevice->Close();
+				bOpen = false;
+			}
+			else if (num_bytes > 0)
+			{
+				if (!NetSendFrame(client, NetData, payload, num_bytes, ++sequence, lastWriteUs))
+					break;
+
+				continue;	// there may be more already
+			}
+
+			pDevice->WaitInput(hEvent, 1000);
+		}
+		else
+		{
+			WaitForSingleObject(hEvent, 1000);
+		}
+	}
+
+	if (outOfSequence)
+		printf("%u frames out of sequence\n", outOfSequence);
+
+	delete pDevice;
+	CloseHandle(hEvent);
+}
+
+//-----------------------------------------------------------------------------
+
+int NetServe(const char* address, const char* portName, SerialBackend backend)
+{
+	if (!NetStartup())
+	{
+		printf("WSAStartup failed\n");
+		return -1;
+	}
+
+	// Just a port number is the port on loopback
+	char host[ 64 ];
+	char port[ 8 ];
+
+	snprintf(host, sizeof(host), "%s", NetDefaultBind);
+	snprintf(port, sizeof(port), "%s", address);
+
+	const char* pColon = strrchr(address, ':');
+
+	if (pColon)
+	{
+		snprintf(host, sizeof(host), "%.*s", (int)(pColon - address), address);
+		snprintf(port, sizeof(port), "%s", pColon + 1);
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE;
+
+	addrinfo* pInfo = nullptr;
+	SOCKET listener = INVALID_SOCKET;
+
+	if (0 == getaddrinfo(host, port, &hints, &pInfo))
+	{
+		for (addrinfo* pAddr = pInfo; pAddr && (INVALID_SOCKET == listener); pAddr = pAddr->ai_next)
+		{
+			listener = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+
+			if (INVALID_SOCKET == listener)
+				continue;
+
+			BOOL bReuse = TRUE;
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&bReuse, sizeof(bReuse));
+
+			if ((SOCKET_ERROR == bind(listener, pAddr->ai_addr, (int)pAddr->ai_addrlen)) ||
+				(SOCKET_ERROR == listen(listener, 1)))
+			{
+				closesocket(listener);
+				listener = INVALID_SOCKET;
+			}
+		}
+
+		freeaddrinfo(pInfo);
+	}
+
+	if (INVALID_SOCKET == listener)
+	{
+		printf("Can't listen on %s port %s\n", host, port);
+		return -1;
+	}
+
+	printf("Serving %s on %s port %s\n", portName, host, port);
+
+	for (;;)
+	{
+		SOCKET client = accept(listener, nullptr, nullptr);
+
+		if (INVALID_SOCKET == client)
+			continue;
+
+		printf("Client connected\n");
+
+		NetServeClient(client, portName, backend);
+		closesocket(client);
+
+		printf("Client gone\n");
+	}
+}
+
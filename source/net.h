@@ -0,0 +1,27 @@
+//
+// net.h - Serial link over the network
+//
+// One machine owns the serial port, and serves it (--serve), the one
+// doing the capture opens it with the network backend (--remote), and
+// runs the whole pipeline, window, echoes and all, as if the port was
+// local.  Only the bytes cross the network, in small timestamped frames,
+// over TCP with Nagle off.
+//
+#pragma once
+
+#include "device.h"
+
+const unsigned short NetDefaultPort = 5232;
+
+// There's no authentication, so unless it's given an address, it only
+// listens on loopback
+const char NetDefaultBind[] = "127.0.0.1";
+
+// Serve portName on address, [host:]port, one client at a time, never
+// returns unless the socket can't be set up
+int NetServe(const char* address, const char* portName, SerialBackend backend);
+
+// Most recent time from a frame going out, to its echo coming back, in
+// microseconds, 0 if there is no remote port
+unsigned int NetRoundTripUs();
+
@@ -0,0 +1,69 @@
+//
+// netproto.h - Framing for the serial link over the network
+//
+// Every frame is a 16 byte header, and up to NetMaxPayload bytes.  Both
+// ends are Windows, so it's all little endian, and sent as is.
+//
+// Each side numbers its own frames, so the server can tell a client
+// that dropped, and came back, and a data frame coming back from the
+// server carries the timestamp of the newest client frame it has
+// written, so the client can time the round trip.
+//
+#pragma once
+
+// winsock2 has to come first, or windows.h drags in the old winsock
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "net.h"
+
+enum NetFrameType
+{
+	NetOpen,		// client -> server, NetOpenRequest
+	NetOpenResult,	// server -> client, int, SERIAL_OK or one of the errors
+	NetData,		// either way, the bytes, commands one way, echoes the other
+};
+
+struct NetFrameHeader
+{
+	unsigned short length;		// of the payload
+	unsigned char  type;
+	unsigned char  reserved;
+	unsigned int   sequence;
+	LONGLONG	   timeUs;		// the sender's clock, or the client's, coming back
+};
+
+static_assert(sizeof(NetFrameHeader) == 16, "NetFrameHeader has to match on both ends");
+
+struct NetOpenRequest
+{
+	int baudrate;
+	int bRtsCts;
+};
+
+const int NetMaxPayload = 256;
+
+//
+// Bytes as they come off the socket, until there's a whole frame
+//
+struct NetReceiver
+{
+	unsigned char buffer[ sizeof(NetFrameHeader) + NetMaxPayload ];
+	int count;
+};
+
+bool NetStartup();
+LONGLONG NetNowUs();
+
+// Blocking, even on a socket that isn't, false if the connection is gone
+bool NetSendFrame(SOCKET s, NetFrameType type, const void* pPayload, int length,
+				  unsigned int sequence, LONGLONG timeUs);
+
+// Whatever is waiting on the socket, never blocks, false if the connection is gone
+bool NetReceive(SOCKET s, NetReceiver& receiver);
+
+// The next whole frame, payload has to hold NetMaxPayload, returns 1 for
+// a frame, 0 if there isn't a whole one yet, < 0 if the length is more
+// than a frame can be, and the stream can't be trusted after that
+int NetNextFrame(NetReceiver& receiver, NetFrameHeader& header, unsigned char* pPayload);
+
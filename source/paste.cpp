@@ -0,0 +1,327 @@
+//
+// paste.cpp - Type text into the target
+//
+// Characters go through VkKeyScan, for the host's layout, then
+// KeyToLayoutCode, so a paste comes out the same as typing it would.
+//
+
+#include "paste.h"
+#include "keymap.h"
+#include "serial.h"
+#include "status.h"
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//-----------------------------------------------------------------------------
+
+static const int   PasteHighWater  = 16;	// most keystroke commands waiting on the device
+static const DWORD PasteIntervalMax = 64;	// ms between keystrokes, at the slowest
+static const DWORD PasteHoldMs     = 50;	// after a loss, let the device catch up
+static const int   PasteRecoverRun = 32;	// clean keystrokes before speeding back up
+
+static unsigned char* pasteCodes = nullptr;
+static int   pasteCount = 0;
+static int   pastePos   = 0;
+static const int PasteStatusRow = 3;
+
+static DWORD pasteInterval = 0;		// ms between keystrokes, 0 is as fast as the echoes come back
+static DWORD pasteNextTick = 0;
+static unsigned int pasteLost = 0;
+static int   pasteCleanRun = 0;
+
+static unsigned char pasteHeld = 0;	// key whose make went out without its break yet
+static bool  pasteShift = false;	// the paste's own shift is down on the target
+
+//-----------------------------------------------------------------------------
+
+void PasteCancel()
+{
+	if (pasteCodes)
+	{
+		// The pump can stop between a make and its break, so let go of
+		// whatever this paste actually has down
+		if (pasteHeld)
+		{
+			SerialQueue(pasteHeld + USB_BREAK);
+		}
+
+		if (pasteShift)
+		{
+			SerialQueue(KeyToLayoutCode(VK_LSHIFT) + USB_BREAK);
+		}
+
+		free(pasteCodes);
+		pasteCodes = nullptr;
+		StatusLine(PasteStatusRow, "");
+	}
+
+	pasteCount = 0;
+	pastePos = 0;
+	pasteHeld = 0;
+	pasteShift = false;
+}
+
+bool PasteActive()
+{
+	return pastePos < pasteCount;
+}
+
+//-----------------------------------------------------------------------------
+
+bool PasteText(const wchar_t* pText)
+{
+	PasteCancel();
+
+	int length = 0;
+	while (pText[ length ]) length++;
+
+	// Worst case, a shift make and break, and the key make and break, for every character
+	pasteCodes = (unsigned char*)malloc((length * 4) + 1);
+
+	if (!pasteCodes)
+		return false;
+
+	unsigned char shiftCode = KeyToLayoutCode(VK_LSHIFT);
+	bool bShift = false;
+	int  skipped = 0;
+
+	for (int idx = 0; idx < length; ++idx)
+	{
+		wchar_t ch = pText[ idx ];
+
+		if (L'\r' == ch)
+			continue;	// \r\n is just the one Return
+
+		WORD vk;
+		bool bNeedShift;
+
+		if (L'\n' == ch)
+		{
+			vk = VK_RETURN;
+			bNeedShift = false;
+		}
+		else
+		{
+			SHORT scan = VkKeyScanW(ch);
+
+			// Not on this keyboard, or it needs Ctrl / Alt
+			if ((-1 == scan) || (scan & 0x0600))
+			{
+				skipped++;
+				continue;
+			}
+
+			vk = (WORD)(scan & 0xFF);
+			bNeedShift = (scan & 0x0100) ? true : false;
+		}
+
+		unsigned char km_code = KeyToLayoutCode(vk);
+
+		if (!km_code)
+		{
+			skipped++;
+			continue;
+		}
+
+		if (bNeedShift != bShift)
+		{
+			pasteCodes[ pasteCount++ ] = bNeedShift ? shiftCode : (unsigned char)(shiftCode + USB_BREAK);
+			bShift = bNeedShift;
+		}
+
+		pasteCodes[ pasteCount++ ] = km_code;
+		pasteCodes[ pasteCount++ ] = km_code + USB_BREAK;
+	}
+
+	if (bShift)
+	{
+		pasteCodes[ pasteCount++ ] = shiftCode + USB_BREAK;
+	}
+
+	pastePos = 0;
+	pasteInterval = 0;
+	pasteNextTick = GetTickCount();
+	pasteLost = SerialLost();
+	pasteCleanRun = 0;
+
+	StatusLine(PasteStatusRow, "PASTE: %d characters, %d skipped", length - skipped, skipped);
+
+	if (0 == pasteCount)
+	{
+		PasteCancel();
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool PasteUtf8(const char* pText, int length)
+{
+	int wideLength = MultiByteToWideChar(CP_UTF8, 0, pText, length, nullptr, 0);
+
+	if (wideLength <= 0)
+		return false;
+
+	wchar_t* pWide = (wchar_t*)malloc((wideLength + 1) * sizeof(wchar_t));
+
+	if (!pWide)
+		return false;
+
+	MultiByteToWideChar(CP_UTF8, 0, pText, length, pWide, wideLength);
+	pWide[ wideLength ] = 0;
+
+	bool bResult = PasteText(pWide);
+
+	free(pWide);
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+bool PasteClipboard()
+{
+	bool bResult = false;
+
+	if (OpenClipboard(nullptr))
+	{
+		HANDLE hData = GetClipboardData(CF_UNICODETEXT);
+
+		if (hData)
+		{
+			const wchar_t* pText = (const wchar_t*)GlobalLock(hData);
+
+			if (pText)
+			{
+				bResult = PasteText(pText);
+				GlobalUnlock(hData);
+			}
+		}
+
+		CloseClipboard();
+	}
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+
+bool PasteFile(const char* pFileName)
+{
+	FILE* pFile = nullptr;
+
+	if (fopen_s(&pFile, pFileName, "rb") || !pFile)
+		return false;
+
+	fseek(pFile, 0, SEEK_END);
+	long length = ftell(pFile);
+	fseek(pFile, 0, SEEK_SET);
+
+	bool bResult = false;
+
+	char* pText = (length > 0) ? (char*)malloc(length) : nullptr;
+
+	if (pText)
+	{
+		length = (long)fread(pText, 1, length, pFile);
+
+		// Skip the UTF-8 BOM
+		int start = ((length >= 3) && ((unsigned char)pText[ 0 ] == 0xEF) &&
+					 ((unsigned char)pText[ 1 ] == 0xBB) && ((unsigned char)pText[ 2 ] == 0xBF)) ? 3 : 0;
+
+		bResult = PasteUtf8(pText + start, (int)length - start);
+
+		free(pText);
+	}
+
+	fclose(pFile);
+
+	return bResult;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Lost echoes mean the device isn't keeping up, so back off, twice the
+// spacing each time, then creep back toward full speed once it's clean
+//
+static void PasteAdapt()
+{
+	unsigned int lost = SerialLost();
+
+	if (lost != pasteLost)
+	{
+		pasteLost = lost;
+		pasteCleanRun = 0;
+
+		pasteInterval = pasteInterval ? (pasteInterval * 2) : 1;
+		if (pasteInterval > PasteIntervalMax) pasteInterval = PasteIntervalMax;
+
+		pasteNextTick = GetTickCount() + PasteHoldMs;
+	}
+	else if (pasteInterval && (++pasteCleanRun >= PasteRecoverRun))
+	{
+		pasteCleanRun = 0;
+		pasteInterval--;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+DWORD PastePump()
+{
+	if (!PasteActive())
+		return INFINITE;
+
+	PasteAdapt();
+
+	DWORD now = GetTickCount();
+
+	if ((int)(pasteNextTick - now) > 0)
+		return pasteNextTick - now;
+
+	SerialBeginFrame();
+	SerialCaptureTime(LatencyNow());
+
+	unsigned char shiftCode = KeyToLayoutCode(VK_LSHIFT);
+
+	while (PasteActive() && (SerialBacklog() < PasteHighWater))
+	{
+		unsigned char command = pasteCodes[ pastePos++ ];
+
+		SerialQueue(command);
+
+		// Keep track of what's down, for PasteCancel
+		if ((command & ~USB_BREAK) == shiftCode)
+			pasteShift = !(command & USB_BREAK);
+		else
+			pasteHeld = (command & USB_BREAK) ? 0 : command;
+
+		// Spacing goes between keystrokes, so after each key break
+		if (pasteInterval && (command & USB_BREAK) && (command != (shiftCode + USB_BREAK)))
+		{
+			pasteNextTick = now + pasteInterval;
+			break;
+		}
+	}
+
+	SerialEndFrame();
+
+	if (!PasteActive())
+	{
+		StatusLine(PasteStatusRow, "PASTE: done");
+		free(pasteCodes);
+		pasteCodes = nullptr;
+		pasteCount = pastePos = 0;
+		return INFINITE;
+	}
+
+	StatusLine(PasteStatusRow, "PASTE: %d%%  %ums/key", (pastePos * 100) / pasteCount, pasteInterval);
+
+	// Come back when it's time for the next key, or the device has caught up a bit
+	return pasteInterval ? pasteInterval : 1;
+}
+
@@ -0,0 +1,25 @@
+//
+// paste.h - Type text into the target
+//
+// The text is turned into make / break codes up front, with a shift
+// wrapped around only the runs of characters that need it, then fed to
+// the writer as fast as the device keeps up.  If echoes start going
+// missing, the keystrokes are spaced out, then brought back up to speed.
+//
+#pragma once
+
+#include <windows.h>
+
+// Replaces anything that is still pasting, false if there was nothing to type
+bool PasteText(const wchar_t* pText);
+bool PasteUtf8(const char* pText, int length);
+bool PasteClipboard();
+bool PasteFile(const char* pFileName);
+
+void PasteCancel();
+bool PasteActive();
+
+// Input thread, queue the next few keystrokes
+// returns the number of milliseconds until it wants to be called again
+DWORD PastePump();
+
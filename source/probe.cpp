@@ -0,0 +1,249 @@
+//
+// probe.cpp - Find the device
+//
+// The wrong baud rate usually reads back as nothing, or as garbage, so
+// the probe wants the exact echo of USB_BufferClear, and a sane LED
+// status, more than once, before it believes a port.
+//
+
+#include "probe.h"
+#include "km232.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+
+static const unsigned int ProbeTimeoutMs = 30;	// per byte, much shorter than in normal running
+static const int          ProbePasses    = 2;
+static const DWORD        ProbeWaitMs    = 2000;	// slack on top, for opens that take their time
+
+//
+// A thread that's still stuck in a driver after the wait keeps its job,
+// and its port, so the job is on the heap and whoever lets go last frees it
+//
+struct ProbeJob
+{
+	char portName[ SerialPortNameMax ];
+	SerialBackend backend;
+	const DeviceProfile* pOnly;
+	const DeviceProfile* pFound;
+	volatile LONG refs;
+};
+
+//-----------------------------------------------------------------------------
+//
+// One round trip, returns the reply, if result < 0, then timeout
+//
+static int ProbeTransact(SerialDevice* pDevice, unsigned char command)
+{
+	unsigned char reply = 0;
+
+	if (1 != pDevice->Write(&command, 1, ProbeTimeoutMs))
+		return -1;
+
+	if (1 != pDevice->Read(&reply, 1, ProbeTimeoutMs))
+		return -1;
+
+	return (int)reply;
+}
+
+static bool ProbeLine(SerialDevice* pDevice)
+{
+	unsigned char stale[ 64 ];
+
+	// Whatever was sitting in the driver from before
+	while (pDevice->ReadAvailable(stale, sizeof(stale)) > 0)
+		;
+
+	for (int pass = 0; pass < ProbePasses; ++pass)
+	{
+		if (USB_BufferClear != ProbeTransact(pDevice, USB_BufferClear))
+			return false;
+
+		int status = ProbeTransact(pDevice, USB_StatusLEDRead);
+
+		if ((status < 0x30) || (status > 0x37))
+			return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static void ProbeRelease(ProbeJob* pJob)
+{
+	if (0 == InterlockedDecrement(&pJob->refs))
+		delete pJob;
+}
+
+static void ProbeRun(ProbeJob& job)
+{
+	SerialDevice* pDevice = CreateSerialDevice(job.backend);
+
+	for (int idx = 0; idx < ProfileCount(); ++idx)
+	{
+		const DeviceProfile& profile = ProfileGet(idx);
+
+		if (job.pOnly && (job.pOnly != &profile))
+			continue;
+
+		// Missing, or in use by something else, no point trying other rates
+		if (SERIAL_OK != pDevice->Open(job.portName, profile.baudrate, profile.bRtsCts))
+			break;
+
+		bool bFound = ProbeLine(pDevice);
+
+		pDevice->Close();
+
+		if (bFound)
+		{
+			job.pFound = &profile;
+			break;
+		}
+	}
+
+	delete pDevice;
+}
+
+static DWORD WINAPI ProbeThread(LPVOID pParam)
+{
+	ProbeJob* pJob = (ProbeJob*)pParam;
+
+	ProbeRun(*pJob);
+	ProbeRelease(pJob);
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static void ProbeIniPath(char* pPath, DWORD size)
+{
+	DWORD len = GetModuleFileNameA(nullptr, pPath, size);
+
+	if ((0 == len) || (len >= size))
+	{
+		snprintf(pPath, size, ".\\km232.ini");
+		return;
+	}
+
+	char* pSlash = strrchr(pPath, '\\');
+	char* pName = pSlash ? pSlash + 1 : pPath;
+
+	snprintf(pName, size - (pName - pPath), "km232.ini");
+}
+
+void ProbeSave(const char* portName, const DeviceProfile& profile)
+{
+	char iniPath[ MAX_PATH ];
+	ProbeIniPath(iniPath, sizeof(iniPath));
+
+	WritePrivateProfileStringA("probe", "port", portName, iniPath);
+	WritePrivateProfileStringA("probe", "device", profile.name, iniPath);
+}
+
+//-----------------------------------------------------------------------------
+
+bool ProbeFind(SerialBackend backend, const DeviceProfile* pOnly, ProbeResult& result)
+{
+	// Where it was last time
+	char iniPath[ MAX_PATH ];
+	ProbeIniPath(iniPath, sizeof(iniPath));
+
+	char cachedPort[ SerialPortNameMax ];
+	char cachedDevice[ 32 ];
+	GetPrivateProfileStringA("probe", "port", "", cachedPort, sizeof(cachedPort), iniPath);
+	GetPrivateProfileStringA("probe", "device", "", cachedDevice, sizeof(cachedDevice), iniPath);
+
+	const DeviceProfile* pCached = ProfileFind(cachedDevice);
+
+	if (cachedPort[ 0 ] && pCached && (!pOnly || (pOnly == pCached)))
+	{
+		ProbeJob job;
+		snprintf(job.portName, sizeof(job.portName), "%s", cachedPort);
+		job.backend = backend;
+		job.pOnly  = pCached;
+		job.pFound = nullptr;
+		job.refs   = 1;
+
+		ProbeRun(job);
+
+		if (job.pFound)
+		{
+			snprintf(result.portName, sizeof(result.portName), "%s", job.portName);
+			result.pProfile = job.pFound;
+			return true;
+		}
+	}
+
+	return ProbeFindAll(backend, pOnly, &result, 1) > 0;
+}
+
+//-----------------------------------------------------------------------------
+
+int ProbeFindAll(SerialBackend backend, const DeviceProfile* pOnly, ProbeResult* pResults, int maxResults)
+{
+	// Everything, all at once
+	char portNames[ MAXIMUM_WAIT_OBJECTS ][ SerialPortNameMax ];
+	int numPorts = SerialListPorts(portNames, MAXIMUM_WAIT_OBJECTS);
+
+	HANDLE hThreads[ MAXIMUM_WAIT_OBJECTS ];
+	ProbeJob* pJobs[ MAXIMUM_WAIT_OBJECTS ];
+	int numThreads = 0;
+
+	for (int idx = 0; idx < numPorts; ++idx)
+	{
+		ProbeJob* pJob = new ProbeJob;
+		snprintf(pJob->portName, sizeof(pJob->portName), "%s", portNames[ idx ]);
+		pJob->backend = backend;
+		pJob->pOnly  = pOnly;
+		pJob->pFound = nullptr;
+		pJob->refs   = 2;	// this end, and the thread
+
+		hThreads[ numThreads ] = CreateThread(nullptr, 0, ProbeThread, pJob, 0, nullptr);
+
+		if (!hThreads[ numThreads ])
+		{
+			delete pJob;
+			continue;
+		}
+
+		pJobs[ numThreads++ ] = pJob;
+	}
+
+	if (0 == numThreads)
+		return 0;
+
+	// Long enough for every profile to time out on every byte, with
+	// the ports going in parallel
+	int numProfiles = pOnly ? 1 : ProfileCount();
+	DWORD waitMs = (ProbeTimeoutMs * 4 * ProbePasses * numProfiles) + ProbeWaitMs;
+
+	WaitForMultipleObjects((DWORD)numThreads, hThreads, TRUE, waitMs);
+
+	int numFound = 0;
+
+	for (int idx = 0; idx < numThreads; ++idx)
+	{
+		// Still going, it's too late to believe it
+		bool bDone = (WAIT_OBJECT_0 == WaitForSingleObject(hThreads[ idx ], 0));
+
+		if (bDone && (numFound < maxResults) && pJobs[ idx ]->pFound)
+		{
+			ProbeResult& result = pResults[ numFound++ ];
+			snprintf(result.portName, sizeof(result.portName), "%s", pJobs[ idx ]->portName);
+			result.pProfile = pJobs[ idx ]->pFound;
+		}
+
+		if (!bDone)
+			printf("Probe: %s didn't answer in time, skipped\n", pJobs[ idx ]->portName);
+
+		ProbeRelease(pJobs[ idx ]);
+		CloseHandle(hThreads[ idx ]);
+	}
+
+	return numFound;
+}
+
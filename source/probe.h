@@ -0,0 +1,29 @@
+//
+// probe.h - Find the device
+//
+// Every serial port is tried at once, one thread each, with every
+// device profile, fastest first, using USB_BufferClear and
+// USB_StatusLEDRead.  Whatever answers is remembered in km232.ini, next
+// to the exe, and tried first on the next launch.
+//
+#pragma once
+
+#include "device.h"
+#include "profile.h"
+
+struct ProbeResult
+{
+	char portName[ SerialPortNameMax ];
+	const DeviceProfile* pProfile;
+};
+
+// pOnly to only look for one kind of device, nullptr for any
+// false if nothing answered
+bool ProbeFind(SerialBackend backend, const DeviceProfile* pOnly, ProbeResult& result);
+
+// Every port that answered, in port list order, returns how many
+int ProbeFindAll(SerialBackend backend, const DeviceProfile* pOnly, ProbeResult* pResults, int maxResults);
+
+// Remember where the device was, for next time
+void ProbeSave(const char* portName, const DeviceProfile& profile);
+
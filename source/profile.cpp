@@ -0,0 +1,45 @@
+//
+// profile.cpp - Device profiles
+//
+// Listed in the order auto-detect tries them, fastest first, so the
+// highest rate that answers is the one that gets used
+//
+
+#include "profile.h"
+
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+
+static const DeviceProfile deviceProfiles[] =
+{
+	//  name      baud   RTS/CTS  window  timeout  fastStep  burst
+	{ "ASC232",   38400, true,    16,     50,      0,        16 },
+	{ "KM232",    9600,  false,   8,      50,      4,        16 },
+};
+
+static const int deviceProfileCount = sizeof(deviceProfiles) / sizeof(deviceProfiles[ 0 ]);
+
+//-----------------------------------------------------------------------------
+
+int ProfileCount()
+{
+	return deviceProfileCount;
+}
+
+const DeviceProfile& ProfileGet(int index)
+{
+	return deviceProfiles[ index ];
+}
+
+const DeviceProfile* ProfileFind(const char* name)
+{
+	for (int idx = 0; idx < deviceProfileCount; ++idx)
+	{
+		if (0 == _stricmp(deviceProfiles[ idx ].name, name))
+			return &deviceProfiles[ idx ];
+	}
+
+	return nullptr;
+}
+
@@ -0,0 +1,35 @@
+//
+// profile.h - Device profiles
+//
+// The ASC232 and the KM232 speak the same commands, but not at the same
+// speed.  Everything that differs between them lives in a profile, so one
+// binary drives either, picked on the command line, or found by trying
+// each profile's line settings until something answers USB_StatusLEDRead.
+//
+#pragma once
+
+struct DeviceProfile
+{
+	const char*  name;
+
+	// Line settings, always 8N1
+	int          baudrate;
+	bool         bRtsCts;
+
+	// Pipeline depth, how many commands can wait on an echo
+	int          window;
+
+	// How long an echo has to show up, before the command is considered lost
+	unsigned int timeoutMs;
+
+	// Motion encoding, fastStep 0 if there is no USB_MouseFast
+	int          motionFastStep;
+	int          motionBurstMax;	// most motion bytes per frame, so keys don't wait on the mouse
+};
+
+int ProfileCount();
+const DeviceProfile& ProfileGet(int index);
+
+// nullptr if there is no profile by that name
+const DeviceProfile* ProfileFind(const char* name);
+
@@ -0,0 +1,205 @@
+//
+// rawinput.cpp - Raw Input (WM_INPUT) mouse capture
+//
+// Raw input is delivered to a window, so we make a message-only window
+// for it.  With RIDEV_INPUTSINK we get input even when the console does
+// not have focus, and since these are device counts, they don't stop at
+// the edge of the screen.
+//
+
+#include "rawinput.h"
+
+//-----------------------------------------------------------------------------
+
+static HWND hRawWindow = nullptr;
+static DWORD rawThreadId = 0;	// the window belongs to it
+static const wchar_t* RawWindowClass = L"km232RawInput";
+
+static RawMotionProc pfnRawMotion = nullptr;
+static RawButtonProc pfnRawButtons = nullptr;
+
+// Motion since the last button event
+static int rawX = 0;
+static int rawY = 0;
+
+// Room for a good sized batch, from a 1000Hz mouse
+alignas(8) static BYTE rawBuffer[ 16 * 1024 ];
+
+// A 32 bit build on 64 bit Windows gets GetRawInputBuffer blocks in the
+// 64 bit layout, the header's 8 bytes longer, and blocks are 8 aligned.
+// GetRawInputData gives the 32 bit layout either way.
+static bool rawWow64 = false;
+static const UINT RawWow64HeaderPad = 8;
+
+//-----------------------------------------------------------------------------
+
+static void RawInputFlushMotion()
+{
+	if (rawX || rawY)
+	{
+		pfnRawMotion(rawX, rawY);
+		rawX = rawY = 0;
+	}
+}
+
+static void RawInputAccumulate(DWORD type, const RAWMOUSE& mouse)
+{
+	if (RIM_TYPEMOUSE == type)
+	{
+		// Absolute devices (tablets, remote desktop) don't give us deltas
+		if (0 == (mouse.usFlags & MOUSE_MOVE_ABSOLUTE))
+		{
+			rawX += mouse.lLastX;
+			rawY += mouse.lLastY;
+		}
+
+		if (pfnRawButtons && mouse.usButtonFlags)
+		{
+			// Motion that happened before the button, goes before the button
+			RawInputFlushMotion();
+			pfnRawButtons(mouse.usButtonFlags, mouse.usButtonData);
+		}
+	}
+}
+
+// dwType and dwSize come first in either layout, it's only the data that moves
+static const RAWMOUSE& RawBufferMouse(const RAWINPUT* pRaw)
+{
+	if (rawWow64)
+		return *(const RAWMOUSE*)((const BYTE*)&pRaw->data + RawWow64HeaderPad);
+
+	return pRaw->data.mouse;
+}
+
+static const RAWINPUT* RawBufferNext(const RAWINPUT* pRaw)
+{
+	if (rawWow64)
+		return (const RAWINPUT*)((const BYTE*)pRaw + ((pRaw->header.dwSize + 7) & ~7u));
+
+	return NEXTRAWINPUTBLOCK(pRaw);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Anything that wasn't picked up by GetRawInputBuffer shows up here
+//
+static LRESULT CALLBACK RawInputWndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+	if (WM_INPUT == uMsg)
+	{
+		UINT cbSize = sizeof(rawBuffer);
+
+		if (GetRawInputData((HRAWINPUT)lParam, RID_INPUT, rawBuffer, &cbSize, sizeof(RAWINPUTHEADER)) != (UINT)-1)
+		{
+			const RAWINPUT* pRaw = (const RAWINPUT*)rawBuffer;
+			RawInputAccumulate(pRaw->header.dwType, pRaw->data.mouse);
+		}
+	}
+
+	return DefWindowProc(hWnd, uMsg, wParam, lParam);
+}
+
+//-----------------------------------------------------------------------------
+
+bool RawInputInit(RawMotionProc pfnMotion, RawButtonProc pfnButtons)
+{
+	pfnRawMotion = pfnMotion;
+	pfnRawButtons = pfnButtons;
+
+	BOOL bWow64 = FALSE;
+	rawWow64 = (sizeof(void*) == 4) && IsWow64Process(GetCurrentProcess(), &bWow64) && bWow64;
+
+	HINSTANCE hInstance = GetModuleHandle(nullptr);
+
+	WNDCLASSEX wc = {};
+	wc.cbSize = sizeof(wc);
+	wc.lpfnWndProc = RawInputWndProc;
+	wc.hInstance = hInstance;
+	wc.lpszClassName = RawWindowClass;
+
+	if (!RegisterClassEx(&wc))
+		return false;
+
+	rawThreadId = GetCurrentThreadId();
+	hRawWindow = CreateWindowEx(0, RawWindowClass, L"km232", 0, 0, 0, 0, 0,
+								HWND_MESSAGE, nullptr, hInstance, nullptr);
+	if (!hRawWindow)
+		return false;
+
+	RAWINPUTDEVICE rid;
+	rid.usUsagePage = 0x01;		// Generic Desktop
+	rid.usUsage = 0x02;			// Mouse
+	rid.dwFlags = RIDEV_INPUTSINK;
+	rid.hwndTarget = hRawWindow;
+
+	if (!RegisterRawInputDevices(&rid, 1, sizeof(rid)))
+	{
+		RawInputShutdown();
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void RawInputShutdown()
+{
+	if (hRawWindow)
+	{
+		RAWINPUTDEVICE rid;
+		rid.usUsagePage = 0x01;
+		rid.usUsage = 0x02;
+		rid.dwFlags = RIDEV_REMOVE;
+		rid.hwndTarget = nullptr;
+		RegisterRawInputDevices(&rid, 1, sizeof(rid));
+
+		// Only the owner can destroy it, from Shutdown on another thread
+		// it's closed the next time the owner pumps, or with the process
+		if (GetCurrentThreadId() != rawThreadId)
+		{
+			PostMessage(hRawWindow, WM_CLOSE, 0, 0);
+			hRawWindow = nullptr;
+			return;
+		}
+
+		DestroyWindow(hRawWindow);
+		hRawWindow = nullptr;
+	}
+
+	UnregisterClass(RawWindowClass, GetModuleHandle(nullptr));
+}
+
+//-----------------------------------------------------------------------------
+//
+// Called when the thread's queue says there is raw input waiting, this
+// also pumps the thread's messages, which is what runs any hooks
+//
+void RawInputRead()
+{
+	for (;;)
+	{
+		UINT cbSize = sizeof(rawBuffer);
+		UINT count = GetRawInputBuffer((PRAWINPUT)rawBuffer, &cbSize, sizeof(RAWINPUTHEADER));
+
+		if ((0 == count) || ((UINT)-1 == count))
+			break;
+
+		const RAWINPUT* pRaw = (const RAWINPUT*)rawBuffer;
+		for (UINT idx = 0; idx < count; ++idx)
+		{
+			RawInputAccumulate(pRaw->header.dwType, RawBufferMouse(pRaw));
+			pRaw = RawBufferNext(pRaw);
+		}
+	}
+
+	// Clear out whatever else is in the queue
+	MSG msg;
+	while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+	{
+		DispatchMessage(&msg);
+	}
+
+	RawInputFlushMotion();
+}
+
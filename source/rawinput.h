@@ -0,0 +1,23 @@
+//
+// rawinput.h - Raw Input (WM_INPUT) mouse capture
+//
+// Unaccelerated relative mouse deltas, straight from the device, in
+// batches, instead of clipped and accelerated screen coordinates from
+// the console.
+//
+#pragma once
+
+#include <windows.h>
+
+// Motion is summed up between button events, so the order is kept
+typedef void (*RawMotionProc)(int dx, int dy);
+typedef void (*RawButtonProc)(USHORT usButtonFlags, USHORT usButtonData);
+
+// Register for raw mouse input, false if that failed
+// pfnButtons can be nullptr, if something else is handling the buttons
+bool RawInputInit(RawMotionProc pfnMotion, RawButtonProc pfnButtons);
+void RawInputShutdown();
+
+// Drain everything in the raw input queue, and pump the thread's messages
+void RawInputRead();
+
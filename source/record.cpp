@@ -0,0 +1,452 @@
+//
+// record.cpp - Record and replay the relayed input
+//
+// The log is a 16 byte header, then one record per event:
+//
+//   varint  (microseconds since the last record << 1) | motion
+//   byte    command, if it's not motion
+//   varint  zigzag dx, zigzag dy, if it is
+//
+// so a keystroke is usually 3 or 4 bytes.
+//
+
+#include "record.h"
+#include "serial.h"
+#include "status.h"
+#include "latency.h"
+
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+
+struct RecordHeader
+{
+	char         magic[ 4 ];	// KMRL
+	unsigned int version;
+	unsigned int reserved[ 2 ];
+};
+
+static const unsigned int RecordVersion = 1;
+static const size_t RecordChunk     = 1024 * 1024;	// the mapping grows by this much at a time
+static const size_t RecordMaxRecord = 16;			// longest a single record can be
+static const int    ReplayHighWater = 16;			// flat out, most commands waiting on the device
+static const int    ReplayStatusRow = 5;
+
+//
+// Recorder
+//
+static HANDLE hRecordFile    = INVALID_HANDLE_VALUE;
+static HANDLE hRecordMapping = nullptr;
+static unsigned char* pRecordView = nullptr;
+static size_t recordMapSize = 0;
+static size_t recordLength  = 0;
+static LONGLONG recordLastQpc = 0;
+
+//
+// Replayer
+//
+static HANDLE hReplayFile    = INVALID_HANDLE_VALUE;
+static HANDLE hReplayMapping = nullptr;
+static const unsigned char* pReplayView = nullptr;
+static size_t replayLength = 0;
+static size_t replayPos    = 0;
+static double replaySpeed  = 1.0;
+static LONGLONG replayStartQpc = 0;
+static LONGLONG replayLogUs    = 0;	// log time of the next record
+static bool bReplaying = false;
+static unsigned int replayHeld[ 4 ];	// keys and buttons the log has made, and not yet broken
+
+//-----------------------------------------------------------------------------
+
+static LONGLONG QpcToUs(LONGLONG ticks)
+{
+	static LONGLONG frequency = 0;
+
+	if (0 == frequency)
+	{
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		frequency = freq.QuadPart;
+	}
+
+	return (ticks * 1000000) / frequency;
+}
+
+//-----------------------------------------------------------------------------
+
+static bool RecordMap(size_t mapSize)
+{
+	if (pRecordView)
+	{
+		UnmapViewOfFile(pRecordView);
+		pRecordView = nullptr;
+	}
+	if (hRecordMapping)
+	{
+		CloseHandle(hRecordMapping);
+		hRecordMapping = nullptr;
+	}
+
+	hRecordMapping = CreateFileMappingA(hRecordFile, nullptr, PAGE_READWRITE,
+										(DWORD)((unsigned long long)mapSize >> 32), (DWORD)mapSize, nullptr);
+	if (!hRecordMapping)
+		return false;
+
+	pRecordView = (unsigned char*)MapViewOfFile(hRecordMapping, FILE_MAP_WRITE, 0, 0, mapSize);
+
+	if (!pRecordView)
+		return false;
+
+	recordMapSize = mapSize;
+	return true;
+}
+
+bool RecordStart(const char* pFileName)
+{
+	RecordStop();
+
+	hRecordFile = CreateFileA(pFileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+							  CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (INVALID_HANDLE_VALUE == hRecordFile)
+		return false;
+
+	if (!RecordMap(RecordChunk))
+	{
+		RecordStop();
+		return false;
+	}
+
+	RecordHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "KMRL", 4);
+	header.version = RecordVersion;
+
+	memcpy(pRecordView, &header, sizeof(header));
+	recordLength = sizeof(header);
+	recordLastQpc = 0;
+
+	return true;
+}
+
+void RecordStop()
+{
+	if (pRecordView)
+	{
+		UnmapViewOfFile(pRecordView);
+		pRecordView = nullptr;
+	}
+	if (hRecordMapping)
+	{
+		CloseHandle(hRecordMapping);
+		hRecordMapping = nullptr;
+	}
+
+	if (INVALID_HANDLE_VALUE != hRecordFile)
+	{
+		// The mapping left the file a whole chunk long, cut it back
+		LARGE_INTEGER end;
+		end.QuadPart = (LONGLONG)recordLength;
+		SetFilePointerEx(hRecordFile, end, nullptr, FILE_BEGIN);
+		SetEndOfFile(hRecordFile);
+
+		CloseHandle(hRecordFile);
+		hRecordFile = INVALID_HANDLE_VALUE;
+	}
+
+	recordMapSize = 0;
+	recordLength = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static void RecordVarint(unsigned long long value)
+{
+	while (value >= 0x80)
+	{
+		pRecordView[ recordLength++ ] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	pRecordView[ recordLength++ ] = (unsigned char)value;
+}
+
+static unsigned int ZigZag(int value)
+{
+	return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+// Room for one more record, and its time, false if the log is gone
+static bool RecordBegin(LONGLONG qpcTime, bool bMotion)
+{
+	if (!pRecordView || bReplaying)
+		return false;
+
+	if ((recordLength + RecordMaxRecord) > recordMapSize)
+	{
+		if (!RecordMap(recordMapSize + RecordChunk))
+		{
+			RecordStop();
+			return false;
+		}
+	}
+
+	if (0 == qpcTime)
+		qpcTime = LatencyNow();
+
+	// The first record is at time 0, and time never goes backwards
+	LONGLONG deltaUs = recordLastQpc ? QpcToUs(qpcTime - recordLastQpc) : 0;
+	if (deltaUs < 0) deltaUs = 0;
+
+	if (qpcTime > recordLastQpc)
+		recordLastQpc = qpcTime;
+
+	RecordVarint(((unsigned long long)deltaUs << 1) | (bMotion ? 1 : 0));
+
+	return true;
+}
+
+void RecordCommand(unsigned char command, LONGLONG qpcTime)
+{
+	if (RecordBegin(qpcTime, false))
+	{
+		pRecordView[ recordLength++ ] = command;
+	}
+}
+
+void RecordMotion(int dx, int dy, LONGLONG qpcTime)
+{
+	if (RecordBegin(qpcTime, true))
+	{
+		RecordVarint(ZigZag(dx));
+		RecordVarint(ZigZag(dy));
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+bool ReplayStart(const char* pFileName, double speed)
+{
+	ReplayStop();
+
+	hReplayFile = CreateFileA(pFileName, GENERIC_READ, FILE_SHARE_READ, nullptr,
+							  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (INVALID_HANDLE_VALUE == hReplayFile)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hReplayFile, &size) || (size.QuadPart < (LONGLONG)sizeof(RecordHeader)))
+	{
+		ReplayStop();
+		return false;
+	}
+
+	hReplayMapping = CreateFileMappingA(hReplayFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	pReplayView = hReplayMapping ? (const unsigned char*)MapViewOfFile(hReplayMapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+	if (!pReplayView || memcmp(pReplayView, "KMRL", 4) ||
+		(RecordVersion != ((const RecordHeader*)pReplayView)->version))
+	{
+		ReplayStop();
+		return false;
+	}
+
+	replayLength = (size_t)size.QuadPart;
+	replayPos    = sizeof(RecordHeader);
+	replaySpeed  = (speed > 0.0) ? speed : 0.0;
+	replayStartQpc = LatencyNow();
+	replayLogUs  = 0;
+	memset(replayHeld, 0, sizeof(replayHeld));
+
+	return true;
+}
+
+// Same as the serial layer's, so stopping part way can let go of them
+static void ReplayTrackHeld(unsigned char command)
+{
+	if (USB_BufferClear == command)
+	{
+		memset(replayHeld, 0, sizeof(replayHeld));
+		return;
+	}
+
+	if ((USB_ScrollWheelUp == command) || (USB_ScrollWheelDown == command))
+		return;
+
+	LatencyClass kind = LatencyClassOf(command);
+
+	if ((LatencyKeyMake != kind) && (LatencyKeyBreak != kind) && (LatencyButton != kind))
+		return;
+
+	unsigned int code = command & ~USB_BREAK & 0x7F;
+
+	if (command & USB_BREAK)
+		replayHeld[ code >> 5 ] &= ~(1u << (code & 31));
+	else
+		replayHeld[ code >> 5 ] |= (1u << (code & 31));
+}
+
+static void ReplayReleaseHeld()
+{
+	if (!(replayHeld[ 0 ] | replayHeld[ 1 ] | replayHeld[ 2 ] | replayHeld[ 3 ]))
+		return;
+
+	bReplaying = true;	// not something to record
+	SerialBeginFrame();
+
+	for (unsigned int code = 0; code < 128; ++code)
+	{
+		if (replayHeld[ code >> 5 ] & (1u << (code & 31)))
+			SerialQueue((unsigned char)(code + USB_BREAK));
+	}
+
+	SerialEndFrame();
+	bReplaying = false;
+
+	memset(replayHeld, 0, sizeof(replayHeld));
+}
+
+void ReplayStop()
+{
+	// The log can stop, or be stopped, with keys down
+	ReplayReleaseHeld();
+
+	if (pReplayView)
+	{
+		UnmapViewOfFile(pReplayView);
+		pReplayView = nullptr;
+	}
+	if (hReplayMapping)
+	{
+		CloseHandle(hReplayMapping);
+		hReplayMapping = nullptr;
+	}
+	if (INVALID_HANDLE_VALUE != hReplayFile)
+	{
+		CloseHandle(hReplayFile);
+		hReplayFile = INVALID_HANDLE_VALUE;
+	}
+
+	replayLength = 0;
+	replayPos = 0;
+}
+
+bool ReplayActive()
+{
+	return pReplayView && (replayPos < replayLength);
+}
+
+//-----------------------------------------------------------------------------
+
+// false if the log ends in the middle
+static bool ReplayVarint(size_t& pos, unsigned long long& value)
+{
+	value = 0;
+
+	for (int shift = 0; (pos < replayLength) && (shift < 64); shift += 7)
+	{
+		unsigned char byte = pReplayView[ pos++ ];
+		value |= (unsigned long long)(byte & 0x7F) << shift;
+
+		if (0 == (byte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static int UnZigZag(unsigned long long value)
+{
+	return (int)((unsigned int)(value >> 1) ^ (0u - (unsigned int)(value & 1)));
+}
+
+//-----------------------------------------------------------------------------
+
+DWORD ReplayPump()
+{
+	if (!ReplayActive())
+		return INFINITE;
+
+	LONGLONG now = LatencyNow();
+	LONGLONG elapsedUs = QpcToUs(now - replayStartQpc);
+	DWORD timeoutMs = 1;
+
+	bReplaying = true;
+	SerialBeginFrame();
+	SerialCaptureTime(now);
+
+	while (ReplayActive())
+	{
+		size_t pos = replayPos;
+		unsigned long long stamp;
+
+		if (!ReplayVarint(pos, stamp))
+		{
+			replayPos = replayLength;	// truncated
+			break;
+		}
+
+		LONGLONG dueUs = replayLogUs + (LONGLONG)(stamp >> 1);
+
+		if (0.0 == replaySpeed)
+		{
+			// Flat out, as long as the device keeps up
+			if (SerialBacklog() >= ReplayHighWater)
+				break;
+		}
+		else
+		{
+			LONGLONG waitUs = (LONGLONG)(dueUs / replaySpeed) - elapsedUs;
+
+			if (waitUs > 0)
+			{
+				timeoutMs = (DWORD)((waitUs + 999) / 1000);
+				break;
+			}
+		}
+
+		if (stamp & 1)
+		{
+			unsigned long long dx, dy;
+
+			if (!ReplayVarint(pos, dx) || !ReplayVarint(pos, dy))
+			{
+				replayPos = replayLength;
+				break;
+			}
+
+			SerialMotion(UnZigZag(dx), UnZigZag(dy));
+		}
+		else
+		{
+			if (pos >= replayLength)
+			{
+				replayPos = replayLength;
+				break;
+			}
+
+			unsigned char command = pReplayView[ pos++ ];
+
+			ReplayTrackHeld(command);
+			SerialQueue(command);
+		}
+
+		replayPos = pos;
+		replayLogUs = dueUs;
+	}
+
+	SerialEndFrame();
+	bReplaying = false;
+
+	if (!ReplayActive())
+	{
+		StatusLine(ReplayStatusRow, "REPLAY: done");
+		ReplayStop();
+		return INFINITE;
+	}
+
+	StatusLine(ReplayStatusRow, "REPLAY: %d%%  %.3fs", (int)((replayPos * 100) / replayLength), replayLogUs / 1000000.0);
+
+	return timeoutMs;
+}
+
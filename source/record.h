@@ -0,0 +1,30 @@
+//
+// record.h - Record and replay the relayed input
+//
+// Every command handed to SerialQueue, and every SerialMotion, is logged
+// with its capture time, into a memory mapped file, so recording costs a
+// few stores, and no system calls.  A log can be played back through
+// the same queue, at the recorded speed, faster, or flat out.
+//
+#pragma once
+
+#include <windows.h>
+
+// false if the file can't be created
+bool RecordStart(const char* pFileName);
+void RecordStop();
+
+// Input thread, from the serial layer, qpcTime 0 for now
+void RecordCommand(unsigned char command, LONGLONG qpcTime);
+void RecordMotion(int dx, int dy, LONGLONG qpcTime);
+
+// speed 1.0 is as recorded, 2.0 twice as fast, 0 as fast as the device takes it
+// false if the file isn't a log
+bool ReplayStart(const char* pFileName, double speed);
+void ReplayStop();
+bool ReplayActive();
+
+// Input thread, send whatever is due
+// returns the number of milliseconds until it wants to be called again
+DWORD ReplayPump();
+
@@ -0,0 +1,80 @@
+//
+// ring.h - Lock-free single producer / single consumer ring
+//
+// The input handlers push on one thread, the serial writer pops on another,
+// so all we need is a pair of indices, each one written by only one side
+//
+#pragma once
+
+#include <atomic>
+
+template <typename T, unsigned int Size>
+class SPSCRing
+{
+	static_assert((Size & (Size - 1)) == 0, "SPSCRing Size must be a power of 2");
+
+public:
+	// Producer side, false if the ring is full
+	bool Push(const T& item)
+	{
+		unsigned int t = tail.load(std::memory_order_relaxed);
+
+		if ((t - head.load(std::memory_order_acquire)) >= Size)
+			return false;
+
+		items[ t & (Size - 1) ] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Producer side, publish a batch with a single store
+	// returns how many items fit
+	unsigned int PushBatch(const T* pItems, unsigned int count)
+	{
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		unsigned int room = Size - (t - head.load(std::memory_order_acquire));
+
+		if (count > room)
+			count = room;
+
+		for (unsigned int idx = 0; idx < count; ++idx)
+		{
+			items[ (t + idx) & (Size - 1) ] = pItems[ idx ];
+		}
+
+		tail.store(t + count, std::memory_order_release);
+		return count;
+	}
+
+	// Consumer side, false if the ring is empty
+	bool Pop(T& item)
+	{
+		unsigned int h = head.load(std::memory_order_relaxed);
+
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+
+		item = items[ h & (Size - 1) ];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Either side, only a snapshot
+	unsigned int Count() const
+	{
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	bool Empty() const
+	{
+		return 0 == Count();
+	}
+
+private:
+	// Keep the indices on their own cache lines, so the two threads
+	// don't fight over them
+	alignas(64) std::atomic<unsigned int> head { 0 };
+	alignas(64) std::atomic<unsigned int> tail { 0 };
+	T items[ Size ];
+};
+
@@ -0,0 +1,1976 @@
+//
+// serial.cpp - Serial link to the USB-KM232 / ASC232
+//
+// Every command sent to the KM232 is echoed back.  Instead of waiting for
+// each echo before sending the next byte, we keep up to SerialWindow
+// commands on the wire, so throughput is bound by the baud rate, and not
+// by the round trip through the USB-serial adapter.
+//
+// Each echo is checked against what was sent.  When one never comes
+// back, a break code, or a mouse mode switch, is sent again, and a lost
+// mouse step goes back into the motion residual.  A make is never sent
+// twice, it would be a second key press.
+//
+// How much of the window is used, is up to a rate controller, AIMD, like
+// TCP.  Every window's worth of echoes that come back in good time grows
+// it by one, a lost echo, a slow echo, or the device dropping CTS, cuts
+// it in half, at most once per round trip.
+//
+// There can be more than one device, each one is a SerialLink, with its
+// own port, queue, and writer thread, so a slow target never holds up
+// the others.  The input side routes each command to the focus target,
+// or to all of them.
+//
+// Keys and buttons always go ahead of mouse motion.  Motion never fills
+// the whole window, there is always room held back for a break, and
+// motion that hasn't been written yet is pulled back out of the frame,
+// and merged with whatever came in since, when something else is
+// waiting to go.
+//
+// Motion can also be paced, SerialMotionTick lets each link send one
+// burst, and whatever doesn't fit waits for the next tick, so the mouse
+// takes the same share of the wire every second.
+//
+// When there's nothing else to send, the writer reads the device LEDs,
+// every so often, and right after a lock key, and keeps them where the
+// input side can look at them without a round trip.
+//
+
+#include "serial.h"
+#include "ring.h"
+#include "motion.h"
+#include "status.h"
+#include "latency.h"
+#include "device.h"
+#include "profile.h"
+#include "probe.h"
+#include "keymap.h"
+#include "counters.h"
+#include "record.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+//-----------------------------------------------------------------------------
+
+static SerialBackend serialBackend = SerialBackendLibSerialPort;
+static const DeviceProfile* pRequestedProfile = nullptr;	// nullptr to auto-detect
+static int windowOverride = 0;	// from the command line, otherwise the profile decides
+static int motionRate = 0;		// motion bursts per second, 0 for as fast as it comes
+
+//
+// Commands that have been written, but have not been echoed yet
+//
+struct InFlight
+{
+	unsigned char command;
+	unsigned char motionStep;	// counts moved, if it's a mouse step
+	unsigned char retries;		// times it has been sent again
+	DWORD		  sentTick;
+	LatencyStamps stamps;
+};
+
+static const unsigned int kMaxWindow = 64;	// must be a power of 2
+static const unsigned int kMaxRetries = 3;
+
+static const DWORD kLedPollMs = 500;	// how often the LEDs are read, when idle
+static const DWORD kLedLockMs = 30;		// after a lock key, for the device to catch up
+
+//
+// Commands from the input thread, waiting on the writer thread
+//
+struct SerialCommand
+{
+	unsigned char command;
+	unsigned char retries;
+	LatencyStamps stamps;	// capture, and enqueue, until it's written
+};
+
+// Everything about a byte in the write frame, except the byte
+struct FrameSlot
+{
+	LatencyStamps stamps;
+	unsigned char motionStep;
+	unsigned char retries;
+};
+
+static const unsigned int kQueueFrameMax = 1024;
+
+// Stopping, how long a writer gets to drain, and how much longer we wait
+// for it, past its deadline, for the call it's in
+static const DWORD kStopDrainMs = 200;
+static const DWORD kStopSlackMs = 50;
+
+//
+// Everything about one device
+//
+struct SerialLink
+{
+	char portName[ SerialPortNameMax ];
+
+	SerialDevice* pSCC;
+	const DeviceProfile* pProfile;	// what InitSerialPort settled on
+	CounterLink* pCounters;			// from InitSerialPort on
+
+	unsigned int timeoutMs;
+	int window;		// the most there can be on the wire
+	int lastEcho;
+
+	// Rate controller, writer thread only
+	int rateWindow;				// how many there can be on the wire right now
+	unsigned int rateAcked;		// echoes, since it last grew
+	unsigned int rateHoldUntil;	// no more cuts until this command is echoed
+	LONGLONG rttMin;			// fastest echo seen, QPC
+	LONGLONG byteTime;			// one byte on the wire, QPC
+	LONGLONG rttFloor;			// any echo faster than this is fine, whatever rttMin says
+	std::atomic<int> rateShown;	// rateWindow, for the input side
+
+	InFlight inFlight[ kMaxWindow ];
+	unsigned int inFlightHead;	// oldest outstanding command
+	unsigned int inFlightTail;	// next free slot
+
+	SPSCRing<SerialCommand, 4096> commandRing;
+
+	HANDLE hWriterThread;
+	HANDLE hWriterWake;
+	DWORD  writerThreadId;
+	std::atomic<bool> writerQuit;
+	std::atomic<DWORD> writerDeadline;	// GetTickCount, when it has to be gone, once writerQuit is set
+	std::atomic<unsigned int> commandsDropped;
+	std::atomic<unsigned int> commandsLost;	// never echoed
+	std::atomic<unsigned int> commandsEchoed;
+	std::atomic<unsigned int> commandsResent;
+	std::atomic<unsigned int> outstanding;	// written, or about to be, but not echoed, for the input side
+
+	//
+	// Mouse motion is not queued, it's accumulated, and the writer thread
+	// sends whatever the residual is when it gets to it
+	//
+	int motionBurstMax;	// most motion bytes per pass, from the profile
+	std::atomic<int> motionX;
+	std::atomic<int> motionY;
+	std::atomic<LONGLONG> motionCapture;	// when the oldest unsent motion was captured
+	std::atomic<bool> motionTick;			// paced, a burst can go out
+	MotionEncoder motionEncoder;
+
+	// The wheel is the same, accumulated notches, up is positive
+	std::atomic<int> wheel;
+	std::atomic<LONGLONG> wheelCapture;
+
+	// Writer side frame, everything that goes out in the next write
+	unsigned char writeFrame[ kMaxWindow ];
+	FrameSlot     writeSlots[ kMaxWindow ];
+	unsigned int  writeCount;
+
+	// Lost, and going out again, ahead of the command ring
+	SerialCommand retransmit[ kMaxWindow ];
+	unsigned int  retransmitCount;
+	unsigned int  lostRun;	// lost since the last echo, a whole window means the device is gone
+	std::atomic<bool> bSilent;	// lostRun went past the window, for the input side
+
+	// The device LEDs, StatusNumLock etc, -1 until they've been read
+	std::atomic<int> ledStatus;
+	DWORD ledPollTick;	// writer thread, when to read them next
+
+	// Input side, the keys and buttons it has queued makes for, and not
+	// breaks, what SerialShutdown lets go of
+	unsigned int heldBits[ 8 ];
+
+	// Input side frame, handed to the writer all at once
+	SerialCommand queueFrame[ kQueueFrameMax ];
+	unsigned int  queueCount;
+	bool bWakePending;
+};
+
+static SerialLink serialLinks[ SerialMaxPorts ];
+static int serialLinkCount = 0;
+
+//
+// The input thread is the only producer, into the rings and the frames.
+// SerialShutdown, from any other thread, closes the gate, and waits for
+// the input thread to be out, before it touches them
+//
+static DWORD inputThreadId = 0;		// SerialStart is called from it
+static std::atomic<bool> inputBusy(false);
+static std::atomic<bool> inputClosed(false);
+
+struct SerialInputGate
+{
+	bool bOpen;
+
+	SerialInputGate()
+	{
+		inputBusy.store(true);
+		bOpen = !inputClosed.load();
+
+		if (!bOpen)
+			inputBusy.store(false);
+	}
+
+	~SerialInputGate()
+	{
+		if (bOpen)
+			inputBusy.store(false);
+	}
+};
+
+// Set by the writer threads, when a device stops answering, or starts
+// again, or its LEDs change
+static HANDLE hSerialEvent = nullptr;
+
+// Num, Caps, and Scroll Lock, a make means the LEDs are about to change
+static unsigned char lockMakeCodes[ 3 ];
+
+//
+// Routing, input thread only
+//
+static SerialRoute serialRoute = SerialRouteFocus;
+static int serialTarget = 0;
+
+static void SerialPublish(SerialLink& link);
+
+static unsigned int InFlightCount(const SerialLink& link)
+{
+	return link.inFlightTail - link.inFlightHead;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Rate controller
+//
+static void RateReset(SerialLink& link)
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	int baudrate = link.pProfile ? link.pProfile->baudrate : 9600;
+
+	link.rateWindow = link.window;
+	link.rateAcked = 0;
+	link.rateHoldUntil = link.inFlightTail;
+	link.rttMin = 0;
+	link.byteTime = (freq.QuadPart * 10) / baudrate;	// 8N1
+	link.rttFloor = freq.QuadPart / 500;				// 2ms, below that it's just jitter
+	link.rateShown = link.rateWindow;
+}
+
+// Something got in the way, back off by half
+static void RateCongestion(SerialLink& link)
+{
+	// Everything on the wire went out at the old rate, don't cut again for it
+	if ((int)(link.inFlightHead - link.rateHoldUntil) < 0)
+		return;
+
+	link.rateWindow = (link.rateWindow > 1) ? (link.rateWindow / 2) : 1;
+	link.rateAcked = 0;
+	link.rateHoldUntil = link.inFlightTail;
+	link.rateShown = link.rateWindow;
+
+	CounterAdd(link.pCounters->congestion, 1);
+}
+
+// A command came back, rtt is write to echo, in QPC, 0 if it wasn't timed
+static void RateEcho(SerialLink& link, LONGLONG rtt)
+{
+	if (rtt > 0)
+	{
+		if (!link.rttMin || (rtt < link.rttMin))
+			link.rttMin = rtt;
+
+		// A full window ahead of it on the wire is expected, twice that
+		// means it's queued up somewhere we can't see
+		LONGLONG expected = link.rttMin + (link.rateWindow * link.byteTime);
+
+		if ((rtt > (expected * 2)) && (rtt > link.rttFloor))
+		{
+			RateCongestion(link);
+			return;
+		}
+	}
+
+	if ((link.rateWindow < link.window) && (++link.rateAcked >= (unsigned int)link.rateWindow))
+	{
+		link.rateWindow++;
+		link.rateAcked = 0;
+		link.rateShown = link.rateWindow;
+	}
+}
+
+// Mouse bursts shrink along with the window
+static int RateMotionBurst(const SerialLink& link)
+{
+	int burst = (link.motionBurstMax * link.rateWindow) / link.window;
+
+	return (burst > 0) ? burst : 1;
+}
+
+//-----------------------------------------------------------------------------
+//
+// A mouse step that didn't make it to the device, goes back in the motion
+//
+static void SerialFoldMotion(SerialLink& link, unsigned char command, int step, LONGLONG capture)
+{
+	LONGLONG expected = 0;
+	link.motionCapture.compare_exchange_strong(expected, capture);
+
+	switch (command)
+	{
+	case USB_MouseLeft:  link.motionX -= step; break;
+	case USB_MouseRight: link.motionX += step; break;
+	case USB_MouseUp:	 link.motionY -= step; break;
+	case USB_MouseDown:  link.motionY += step; break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// The oldest outstanding command is never going to be echoed, send it
+// again, if that can't do any harm
+//
+static void SerialLostOldest(SerialLink& link)
+{
+	const InFlight& lost = link.inFlight[ link.inFlightHead & (kMaxWindow-1) ];
+
+	link.inFlightHead++;
+	link.commandsLost++;
+	CounterAdd(link.pCounters->timeouts, 1);
+
+	RateCongestion(link);
+
+	// Nothing is coming back at all, sending it again won't help
+	if (++link.lostRun > (unsigned int)link.window)
+	{
+		if (!link.bSilent.exchange(true) && hSerialEvent)
+			SetEvent(hSerialEvent);
+		return;
+	}
+
+	unsigned char command = lost.command;
+
+	if (lost.motionStep)
+	{
+		// Fold the step back into the motion, so it goes out with the rest
+		SerialFoldMotion(link, command, lost.motionStep, lost.stamps.capture);
+
+		link.commandsResent++;
+		CounterAdd(link.pCounters->retransmits, 1);
+		return;
+	}
+
+	if ((USB_ScrollWheelUp == command) || (USB_ScrollWheelDown == command))
+	{
+		// Same for a wheel notch
+		LONGLONG expected = 0;
+		link.wheelCapture.compare_exchange_strong(expected, lost.stamps.capture);
+
+		link.wheel += (USB_ScrollWheelUp == command) ? 1 : -1;
+
+		link.commandsResent++;
+		CounterAdd(link.pCounters->retransmits, 1);
+		return;
+	}
+
+	bool bRetry = false;
+
+	switch (LatencyClassOf(command))
+	{
+	case LatencyKeyBreak:
+		bRetry = true;
+		break;
+	case LatencyButton:
+		bRetry = (0 != (command & USB_BREAK));
+		break;
+	case LatencyMouseMove:
+		bRetry = (USB_MouseFast == command) || (USB_MouseSlow == command);
+		break;
+	default:
+		break;
+	}
+
+	if (bRetry && (lost.retries < kMaxRetries) && (link.retransmitCount < kMaxWindow))
+	{
+		SerialCommand& again = link.retransmit[ link.retransmitCount++ ];
+		again.command = command;
+		again.retries = lost.retries + 1;
+		again.stamps  = lost.stamps;
+
+		link.commandsResent++;
+		CounterAdd(link.pCounters->retransmits, 1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Does this byte answer that command
+//
+static bool SerialIsEcho(unsigned char command, unsigned char echo)
+{
+	// The StatusLEDRead response is not an echo, it's the LEDs, it's
+	// never in flight with anything else, so it can't be mistaken
+	if (USB_StatusLEDRead == command)
+		return (echo >= 0x30) && (echo <= 0x37);
+
+	return command == echo;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Match an echo byte to the oldest outstanding command it could be the
+// answer to, everything older than that was lost on the way
+//
+static void SerialMatchEcho(SerialLink& link, unsigned char echo)
+{
+	unsigned int count = InFlightCount(link);
+	unsigned int match = 0;
+
+	while ((match < count) && !SerialIsEcho(link.inFlight[ (link.inFlightHead + match) & (kMaxWindow-1) ].command, echo))
+	{
+		match++;
+	}
+
+	if (match == count)
+	{
+		// Nothing we sent, line noise
+		return;
+	}
+
+	while (match--)
+	{
+		SerialLostOldest(link);
+	}
+
+	const InFlight& oldest = link.inFlight[ link.inFlightHead & (kMaxWindow-1) ];
+	LONGLONG now = LatencyNow();
+
+	// Commands sent before the writer started, aren't timed
+	if (oldest.stamps.capture)
+	{
+		LatencyRecord(oldest.command, oldest.stamps, now);
+	}
+
+	RateEcho(link, oldest.stamps.write ? (now - oldest.stamps.write) : 0);
+
+	link.inFlightHead++;
+	link.commandsEchoed.fetch_add(1, std::memory_order_relaxed);
+	CounterAdd(link.pCounters->echoed, 1);
+	link.lostRun = 0;
+
+	if (link.bSilent.load(std::memory_order_relaxed) && link.bSilent.exchange(false) && hSerialEvent)
+		SetEvent(hSerialEvent);
+
+	if (USB_StatusLEDRead == oldest.command)
+	{
+		int leds = echo & (StatusNumLock | StatusCapsLock | StatusScrollLock);
+
+		if ((link.ledStatus.exchange(leds) != leds) && hSerialEvent)
+			SetEvent(hSerialEvent);
+	}
+
+	// For SerialTransact, the StatusLEDRead response
+	link.lastEcho = (int)echo;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Block for a single echo, if result < 0, then timeout, and the oldest
+// outstanding command is considered lost
+//
+static int SerialWaitEcho(SerialLink& link, unsigned int timeoutMs)
+{
+	unsigned char byte = 0;
+
+	if (1 == link.pSCC->Read(&byte, 1, timeoutMs))
+	{
+		SerialMatchEcho(link, byte);
+		return (int)byte;
+	}
+
+	if (InFlightCount(link))
+	{
+		SerialLostOldest(link);
+	}
+
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+
+void SerialSetWindow(int window)
+{
+	if (window < 1) window = 1;
+	if (window > (int)kMaxWindow) window = (int)kMaxWindow;
+
+	windowOverride = window;
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		serialLinks[ idx ].window = window;
+		RateReset(serialLinks[ idx ]);
+	}
+}
+
+int SerialGetWindow()
+{
+	if (serialLinkCount)
+		return serialLinks[ 0 ].window;
+
+	return windowOverride ? windowOverride : 8;
+}
+
+// What the rate controller has the window at, right now
+int SerialGetRate(int port)
+{
+	if ((port >= 0) && (port < serialLinkCount))
+		return serialLinks[ port ].rateShown.load(std::memory_order_relaxed);
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Collect any echoes that are already waiting, without blocking, and
+// retire anything that has been outstanding for too long
+//
+static void SerialPoll(SerialLink& link)
+{
+	if (!link.pSCC) return;
+
+	unsigned char bytes[ kMaxWindow ];
+	int num_bytes;
+
+	do
+	{
+		num_bytes = link.pSCC->ReadAvailable(bytes, sizeof(bytes));
+
+		for (int idx = 0; idx < num_bytes; ++idx)
+		{
+			SerialMatchEcho(link, bytes[ idx ]);
+		}
+
+	} while (num_bytes == (int)sizeof(bytes));
+
+	DWORD now = GetTickCount();
+
+	while (InFlightCount(link))
+	{
+		InFlight& oldest = link.inFlight[ link.inFlightHead & (kMaxWindow-1) ];
+
+		if ((now - oldest.sentTick) < link.timeoutMs)
+			break;
+
+		SerialLostOldest(link);
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// if result < 0, then timeout, or other error
+//
+static int SerialSend(SerialLink& link, unsigned char command)
+{
+	int result = -1;
+
+	if (link.pSCC)
+	{
+		result = 0;
+
+		SerialPoll(link);
+
+		// Window is full, wait for room
+		while (InFlightCount(link) >= (unsigned int)link.window)
+		{
+			if (SerialWaitEcho(link, link.timeoutMs) < 0)
+			{
+				result = -1;
+			}
+		}
+
+		if (1 == link.pSCC->Write(&command, 1, link.timeoutMs))
+		{
+			CounterAdd(link.pCounters->bytesWritten, 1);
+			CounterAdd(link.pCounters->writes, 1);
+
+			InFlight& slot = link.inFlight[ link.inFlightTail & (kMaxWindow-1) ];
+			slot.command  = command;
+			slot.motionStep = 0;
+			slot.retries  = 0;
+			slot.sentTick = GetTickCount();
+			slot.stamps = LatencyStamps();
+			link.inFlightTail++;
+		}
+		else
+		{
+			result = -1;
+		}
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Wait until everything on the wire has been echoed
+// if result < 0, then at least one command was lost
+//
+static int SerialFlush(SerialLink& link)
+{
+	int result = 0;
+
+	if (link.pSCC)
+	{
+		while (InFlightCount(link))
+		{
+			if (SerialWaitEcho(link, link.timeoutMs) < 0)
+			{
+				result = -1;
+			}
+		}
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Old style round trip, send the command, and return the device response
+// if result < 0, then timeout, or other error
+//
+static int SerialTransact(SerialLink& link, unsigned char command)
+{
+	SerialFlush(link);
+
+	int result = SerialSend(link, command);
+
+	if (result >= 0)
+	{
+		result = SerialFlush(link);
+
+		if (result >= 0)
+		{
+			result = link.lastEcho;
+		}
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+//
+// The direct calls, by port index, only before SerialStart, or from that
+// port's writer thread, so they stay in here
+//
+static int SerialSend(int port, unsigned char command)
+{
+	return ((port >= 0) && (port < serialLinkCount)) ? SerialSend(serialLinks[ port ], command) : -1;
+}
+
+static int SerialTransact(int port, unsigned char command)
+{
+	return ((port >= 0) && (port < serialLinkCount)) ? SerialTransact(serialLinks[ port ], command) : -1;
+}
+
+static int SerialFlush(int port)
+{
+	return ((port >= 0) && (port < serialLinkCount)) ? SerialFlush(serialLinks[ port ]) : -1;
+}
+
+static void SerialPoll(int port)
+{
+	if ((port >= 0) && (port < serialLinkCount))
+		SerialPoll(serialLinks[ port ]);
+}
+
+//-----------------------------------------------------------------------------
+
+// Room left in the window, for more commands
+static unsigned int SerialCredits(const SerialLink& link)
+{
+	// The LED answer is any of 0x30 - 0x37, and so are the echoes of
+	// make codes 48 - 55, so nothing goes out behind it, see SerialLedPoll
+	if (InFlightCount(link) && (USB_StatusLEDRead == link.inFlight[ link.inFlightHead & (kMaxWindow-1) ].command))
+		return 0;
+
+	unsigned int used = InFlightCount(link) + link.writeCount;
+
+	return (used < (unsigned int)link.rateWindow) ? ((unsigned int)link.rateWindow - used) : 0;
+}
+
+// Motion and the wheel leave some of the window free, so a key or a
+// button never has to wait on a window full of mouse steps
+static unsigned int SerialMotionCredits(const SerialLink& link)
+{
+	unsigned int reserve = 0;
+
+	if (link.rateWindow > 1)
+		reserve = (link.rateWindow >= 8) ? (unsigned int)(link.rateWindow / 4) : 1;
+
+	unsigned int credits = SerialCredits(link);
+
+	return (credits > reserve) ? (credits - reserve) : 0;
+}
+
+// Something other than motion is waiting to go out
+static bool SerialPriorityWaiting(const SerialLink& link)
+{
+	return link.retransmitCount || !link.commandRing.Empty();
+}
+
+static void SerialFrameCommand(SerialLink& link, const SerialCommand& command)
+{
+	FrameSlot& slot = link.writeSlots[ link.writeCount ];
+	slot.stamps = command.stamps;
+	slot.motionStep = 0;
+	slot.retries = command.retries;
+
+	link.writeFrame[ link.writeCount++ ] = command.command;
+
+	// A buffer clear puts the device back in slow mode
+	if (USB_BufferClear == command.command)
+	{
+		link.motionEncoder.fast = false;
+	}
+
+	for (int idx = 0; idx < 3; ++idx)
+	{
+		if (lockMakeCodes[ idx ] && (lockMakeCodes[ idx ] == command.command))
+		{
+			DWORD soon = GetTickCount() + kLedLockMs;
+
+			if ((int)(link.ledPollTick - soon) > 0)
+				link.ledPollTick = soon;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Take the mouse steps, that haven't been written yet, back out of the
+// frame, and put them back in the motion, mode switches stay where they
+// are, so the encoder is still right about fast and slow
+//
+static void SerialUnframeMotion(SerialLink& link)
+{
+	unsigned int kept = 0;
+
+	for (unsigned int idx = 0; idx < link.writeCount; ++idx)
+	{
+		const FrameSlot& slot = link.writeSlots[ idx ];
+		unsigned char command = link.writeFrame[ idx ];
+
+		if (0 == slot.motionStep)
+		{
+			link.writeFrame[ kept ] = command;
+			link.writeSlots[ kept++ ] = slot;
+			continue;
+		}
+
+		SerialFoldMotion(link, command, slot.motionStep, slot.stamps.capture);
+	}
+
+	// Those were this tick's burst, it goes out again, with the rest
+	if (motionRate && (kept != link.writeCount))
+		link.motionTick = true;
+
+	link.writeCount = kept;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Turn the accumulated wheel into notches, up and down have already
+// cancelled out, returns true if there are notches left over
+//
+static bool SerialFrameWheel(SerialLink& link)
+{
+	int wheel = link.wheel.exchange(0);
+
+	if (0 == wheel)
+		return false;
+
+	LONGLONG capture = link.wheelCapture.exchange(0);
+
+	unsigned int credits = SerialMotionCredits(link);
+	unsigned int notches = (unsigned int)((wheel > 0) ? wheel : -wheel);
+
+	if (notches > credits)
+		notches = credits;
+
+	FrameSlot slot;
+	slot.stamps.capture = slot.stamps.enqueue = capture;
+	slot.stamps.write = 0;
+	slot.motionStep = 0;
+	slot.retries = 0;
+
+	for (unsigned int idx = 0; idx < notches; ++idx)
+	{
+		link.writeSlots[ link.writeCount ] = slot;
+		link.writeFrame[ link.writeCount++ ] = (wheel > 0) ? USB_ScrollWheelUp : USB_ScrollWheelDown;
+	}
+
+	wheel += (wheel > 0) ? -(int)notches : (int)notches;
+
+	if (wheel)
+	{
+		link.wheel += wheel;
+		link.wheelCapture = capture;
+		return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Fill the frame from the command ring, and then with the wheel, and a
+// burst of the accumulated motion, returns true if there is still wheel
+// or motion left over
+//
+static bool SerialBuildFrame(SerialLink& link, bool bMotion)
+{
+	SerialCommand command;
+
+	// Motion the driver didn't take is stale, if anything is waiting
+	// behind it, or there's newer motion to merge it with
+	if (link.writeCount &&
+		(SerialPriorityWaiting(link) || link.motionX.load() || link.motionY.load()))
+	{
+		SerialUnframeMotion(link);
+	}
+
+	// Anything lost goes first, so a break isn't held up behind new keys
+	unsigned int resent = 0;
+
+	while (SerialCredits(link) && (resent < link.retransmitCount))
+	{
+		SerialFrameCommand(link, link.retransmit[ resent++ ]);
+	}
+
+	if (resent)
+	{
+		link.retransmitCount -= resent;
+		memmove(link.retransmit, link.retransmit + resent, link.retransmitCount * sizeof(SerialCommand));
+	}
+
+	while (SerialCredits(link) && link.commandRing.Pop(command))
+	{
+		SerialFrameCommand(link, command);
+	}
+
+	if (!bMotion)
+		return false;
+
+	bool bMoreWheel = SerialFrameWheel(link);
+
+	// Paced, motion waits for its tick, which wakes us
+	if (motionRate && !link.motionTick.load())
+		return bMoreWheel;
+
+	unsigned int credits = SerialMotionCredits(link);
+
+	if (0 == credits)
+	{
+		return bMoreWheel || (0 != link.motionX.load()) || (0 != link.motionY.load());
+	}
+
+	LONGLONG capture = link.motionCapture.exchange(0);
+	int dx = link.motionX.exchange(0);
+	int dy = link.motionY.exchange(0);
+
+	if (dx || dy)
+	{
+		int burst = RateMotionBurst(link);
+		int maxBytes = (credits < (unsigned int)burst) ? (int)credits : burst;
+		bool bFast = link.motionEncoder.fast;
+		int num_bytes = MotionEncode(link.motionEncoder, dx, dy, link.writeFrame + link.writeCount, maxBytes);
+
+		// That's this tick's burst
+		if (num_bytes > 0)
+			link.motionTick = false;
+
+		FrameSlot slot;
+		slot.stamps.capture = slot.stamps.enqueue = capture;
+		slot.stamps.write = 0;
+		slot.retries = 0;
+
+		for (int idx = 0; idx < num_bytes; ++idx)
+		{
+			// How far each step went, in case it has to be put back
+			unsigned char byte = link.writeFrame[ link.writeCount ];
+
+			if ((USB_MouseFast == byte) || (USB_MouseSlow == byte))
+			{
+				bFast = (USB_MouseFast == byte);
+				slot.motionStep = 0;
+			}
+			else
+			{
+				slot.motionStep = (unsigned char)(bFast ? link.motionEncoder.fastStep : 1);
+			}
+
+			link.writeSlots[ link.writeCount++ ] = slot;
+		}
+
+		if (dx || dy)
+		{
+			// Put back what didn't fit, any new motion just adds to it
+			link.motionX += dx;
+			link.motionY += dy;
+			link.motionCapture = capture;	// the residual is the oldest motion there is
+			return true;
+		}
+	}
+
+	return bMoreWheel;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Send the whole frame in one write, whatever the driver doesn't take
+// stays in the frame for next time
+//
+static void SerialWriteFrame(SerialLink& link)
+{
+	if (0 == link.writeCount)
+		return;
+
+	// The device asked us to stop, that's as clear a sign as there is
+	if (link.pProfile && link.pProfile->bRtsCts && !link.pSCC->ClearToSend())
+	{
+		RateCongestion(link);
+		return;
+	}
+
+	// The driver still has a window's worth to get out, don't pile on
+	if (link.pSCC->OutputWaiting() >= link.rateWindow)
+		return;
+
+	int num_bytes = link.pSCC->WriteNonBlocking(link.writeFrame, link.writeCount);
+
+	if (num_bytes > 0)
+	{
+		DWORD now = GetTickCount();
+		LONGLONG written = LatencyNow();
+
+		for (int idx = 0; idx < num_bytes; ++idx)
+		{
+			const FrameSlot& frame = link.writeSlots[ idx ];
+
+			InFlight& slot = link.inFlight[ link.inFlightTail & (kMaxWindow-1) ];
+			slot.command  = link.writeFrame[ idx ];
+			slot.motionStep = frame.motionStep;
+			slot.retries  = frame.retries;
+			slot.sentTick = now;
+			slot.stamps = frame.stamps;
+			slot.stamps.write = written;
+			link.inFlightTail++;
+		}
+
+		CounterLink& counters = *link.pCounters;
+		CounterAdd(counters.bytesWritten, num_bytes);
+		CounterAdd(counters.writes, 1);
+		CounterMax(counters.inFlightHighWater, InFlightCount(link));
+		counters.window = (ULONGLONG)link.rateWindow;
+
+		link.writeCount -= num_bytes;
+		memmove(link.writeFrame, link.writeFrame + num_bytes, link.writeCount);
+		memmove(link.writeSlots, link.writeSlots + num_bytes, link.writeCount * sizeof(FrameSlot));
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Read the LEDs, if it's time, and nothing else is waiting, returns the
+// milliseconds until it's time again.  It goes out even when the device
+// isn't answering, that's how we find out it's back.
+//
+// It only goes out on an empty wire, never waits in the frame, and
+// SerialCredits holds everything else back until it's answered, or lost, so the answer can't be taken
+// for a key's echo, or the other way around
+//
+static DWORD SerialLedPoll(SerialLink& link)
+{
+	DWORD now = GetTickCount();
+	int wait = (int)(link.ledPollTick - now);
+
+	if (wait > 0)
+		return (DWORD)wait;
+
+	// Low priority, anything else going on, and it waits
+	if (link.writeCount || SerialPriorityWaiting(link) || InFlightCount(link))
+		return kLedLockMs;
+
+	SerialCommand poll;
+	poll.command = USB_StatusLEDRead;
+	poll.retries = 0;
+	poll.stamps.capture = poll.stamps.enqueue = poll.stamps.write = 0;	// not timed
+
+	SerialFrameCommand(link, poll);
+	SerialWriteFrame(link);
+
+	// CTS is down, or the driver's full, take it back out of the frame
+	// rather than have the next frame built behind it, and try again later
+	if (link.writeCount)
+	{
+		link.writeCount = 0;
+		return kLedLockMs;
+	}
+
+	link.ledPollTick = now + kLedPollMs;
+	CounterAdd(link.pCounters->ledReads, 1);
+
+	return kLedPollMs;
+}
+
+//-----------------------------------------------------------------------------
+//
+// One pass of the writer, returns the number of milliseconds it is ok
+// to sleep for, before we need to come back around
+//
+static DWORD SerialPumpPass(SerialLink& link, bool bMotion)
+{
+	SerialPoll(link);
+
+	bool bMoreMotion = SerialBuildFrame(link, bMotion);
+
+	SerialWriteFrame(link);
+
+	// Not while we're draining to quit
+	DWORD untilPoll = bMotion ? SerialLedPoll(link) : INFINITE;
+
+	bool bPriority = (0 != link.writeCount) || SerialPriorityWaiting(link);
+	bool bBacklog = bPriority || bMoreMotion;
+
+	if (bPriority && (0 == SerialCredits(link)) && InFlightCount(link))
+	{
+		// Window is full, wait on an echo to open it back up
+		SerialWaitEcho(link, link.timeoutMs);
+		return 0;
+	}
+
+	if (bMoreMotion && !bPriority && (0 == SerialMotionCredits(link)) && InFlightCount(link))
+	{
+		// Only motion left, and it's used its share, wait on an echo, or
+		// a key, whichever shows up first
+		return link.timeoutMs;
+	}
+
+	if (link.writeCount)
+		return 1;	// The driver is full, give it a moment
+	if (bBacklog)
+		return 0;
+	if (InFlightCount(link))
+		return (untilPoll < link.timeoutMs) ? untilPoll : link.timeoutMs;	// Echoes outstanding, wait on them along with the wake
+
+	return untilPoll;
+}
+
+static DWORD SerialPump(SerialLink& link, bool bMotion)
+{
+	DWORD timeoutMs = SerialPumpPass(link, bMotion);
+
+	link.outstanding.store(link.writeCount + link.retransmitCount + InFlightCount(link), std::memory_order_relaxed);
+
+	return timeoutMs;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Writer thread, owns the link's port once it's started
+//
+static DWORD WINAPI SerialWriterThread(LPVOID pParam)
+{
+	SerialLink& link = *(SerialLink*)pParam;
+
+	while (!link.writerQuit.load(std::memory_order_acquire))
+	{
+		DWORD timeoutMs = SerialPump(link, true);
+
+		if (InFlightCount(link) && (0 != timeoutMs))
+		{
+			// An echo, or more to send, whichever shows up first
+			link.pSCC->WaitInput(link.hWriterWake, timeoutMs);
+		}
+		else
+		{
+			WaitForSingleObject(link.hWriterWake, timeoutMs);
+		}
+	}
+
+	// Don't leave anything behind, we may be holding break codes, but be
+	// gone by the deadline, whoever stopped us takes the port then
+	DWORD deadline = link.writerDeadline.load(std::memory_order_acquire);
+
+	while ((link.writeCount || link.retransmitCount || !link.commandRing.Empty()) && ((int)(deadline - GetTickCount()) > 0))
+	{
+		if (INFINITE != SerialPump(link, false))
+			Sleep(0);
+	}
+
+	for (int remainingMs; InFlightCount(link) && ((remainingMs = (int)(deadline - GetTickCount())) > 0); )
+	{
+		SerialWaitEcho(link, ((unsigned int)remainingMs < link.timeoutMs) ? (unsigned int)remainingMs : link.timeoutMs);
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void SerialStart()
+{
+	inputThreadId = GetCurrentThreadId();
+
+	if (!hSerialEvent)
+		hSerialEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+
+	lockMakeCodes[ 0 ] = KeyToLayoutCode(VK_NUMLOCK);
+	lockMakeCodes[ 1 ] = KeyToLayoutCode(VK_CAPITAL);
+	lockMakeCodes[ 2 ] = KeyToLayoutCode(VK_SCROLL);
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (link.pSCC && !link.hWriterThread)
+		{
+			link.writerQuit = false;
+			link.ledPollTick = GetTickCount() + kLedPollMs;
+			link.hWriterWake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+			link.hWriterThread = CreateThread(nullptr, 0, SerialWriterThread, &link, 0, &link.writerThreadId);
+
+			if (link.hWriterThread)
+			{
+				SetThreadPriority(link.hWriterThread, THREAD_PRIORITY_HIGHEST);
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void SerialStop()
+{
+	// Tell them all first, so they drain at the same time
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (link.hWriterThread)
+		{
+			SerialPublish(link);
+
+			link.writerDeadline.store(GetTickCount() + kStopDrainMs, std::memory_order_relaxed);
+			link.writerQuit = true;
+			SetEvent(link.hWriterWake);
+		}
+	}
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (link.hWriterThread)
+		{
+			WaitForSingleObject(link.hWriterThread, kStopDrainMs + kStopSlackMs);
+			CloseHandle(link.hWriterThread);
+			CloseHandle(link.hWriterWake);
+			link.hWriterThread = nullptr;
+			link.hWriterWake = nullptr;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Half the budget for the writers to drain, they're told when, and are
+// gone by then, so the port is ours after that.  One that still hasn't
+// stopped is stuck in the driver, and its port is left alone.  If we
+// are a writer, from the crash filter, we already own that port.
+//
+// From the input thread, the frame it was building goes out first.
+// From any other thread, the input thread is shut out, and whatever
+// frame it had half built is dropped, only the rings are drained.
+//
+// The breaks are for what the input side queued makes for, and not
+// breaks, keys, replayed or typed, and buttons.  They go out in one
+// write, and there's no waiting for the echoes, only for the driver to
+// put them on the wire before the close.
+//
+void SerialShutdown(DWORD budgetMs)
+{
+	DWORD start = GetTickCount();
+	DWORD drainMs = budgetMs / 2;
+	DWORD threadId = GetCurrentThreadId();
+	bool  bInputThread = (threadId == inputThreadId);
+
+	bool bStuck[ SerialMaxPorts ] = {};
+
+	inputClosed.store(true);
+
+	// Out of the gate, if it doesn't come out, it's the thread that
+	// crashed, and it's not coming back
+	bool bInputOut = bInputThread;
+
+	while (!bInputOut && ((GetTickCount() - start) < kStopSlackMs))
+	{
+		bInputOut = !inputBusy.load();
+
+		if (!bInputOut)
+			Sleep(0);
+	}
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (link.hWriterThread && (link.writerThreadId != threadId))
+		{
+			if (bInputThread)
+				SerialPublish(link);
+			else if (bInputOut)
+				link.queueCount = 0;
+
+			link.writerDeadline.store(start + drainMs, std::memory_order_relaxed);
+			link.writerQuit = true;
+			SetEvent(link.hWriterWake);
+		}
+	}
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (link.hWriterThread && (link.writerThreadId != threadId))
+		{
+			DWORD elapsed = GetTickCount() - start;
+			DWORD waitMs = drainMs + kStopSlackMs;
+
+			bStuck[ idx ] = (WAIT_OBJECT_0 != WaitForSingleObject(link.hWriterThread, (elapsed < waitMs) ? waitMs - elapsed : 0));
+
+			if (!bStuck[ idx ])
+			{
+				CloseHandle(link.hWriterThread);
+				CloseHandle(link.hWriterWake);
+				link.hWriterThread = nullptr;
+				link.hWriterWake = nullptr;
+			}
+		}
+	}
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (!link.pSCC || bStuck[ idx ])
+			continue;
+
+		DWORD elapsed = GetTickCount() - start;
+		DWORD remainingMs = (elapsed < budgetMs) ? budgetMs - elapsed : 1;
+
+		// Only settled once the input side is out
+		unsigned char breaks[ 128 ];
+		int count = 0;
+
+		for (unsigned int code = 1; bInputOut && (code < USB_BREAK); ++code)
+		{
+			if (link.heldBits[ code >> 5 ] & (1u << (code & 31)))
+				breaks[ count++ ] = (unsigned char)(code + USB_BREAK);
+		}
+
+		if (count > 0)
+		{
+			int num_bytes = link.pSCC->Write(breaks, count, remainingMs);
+
+			if ((num_bytes > 0) && link.pCounters)
+			{
+				CounterAdd(link.pCounters->bytesWritten, num_bytes);
+				CounterAdd(link.pCounters->writes, 1);
+			}
+
+			while (link.pSCC->OutputWaiting() && ((GetTickCount() - start) < budgetMs))
+				Sleep(1);
+		}
+
+		link.pSCC->Close();
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Signaled when a device stops answering, or starts again, nullptr until
+// SerialStart
+//
+HANDLE SerialEvent()
+{
+	return hSerialEvent;
+}
+
+// What the LEDs were, the last time they were read, -1 if they never were
+int SerialLEDs(int port)
+{
+	if ((port >= 0) && (port < serialLinkCount))
+		return serialLinks[ port ].ledStatus.load(std::memory_order_relaxed);
+
+	return -1;
+}
+
+bool SerialAnswering(int port)
+{
+	if ((port >= 0) && (port < serialLinkCount))
+		return !serialLinks[ port ].bSilent.load(std::memory_order_relaxed);
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Input thread side frame, between SerialBeginFrame and SerialEndFrame,
+// commands are collected in each link's queueFrame, and handed to the
+// writer all at once, with a single wake up
+//
+static int  frameDepth = 0;
+static LONGLONG captureTime = 0;
+
+// What a command does to the held keys and buttons
+static void SerialTrackHeld(SerialLink& link, unsigned char command)
+{
+	if (USB_BufferClear == command)
+	{
+		memset(link.heldBits, 0, sizeof(link.heldBits));
+		return;
+	}
+
+	// The wheel is a button to latency, but there's nothing to let go of
+	if ((USB_ScrollWheelUp == command) || (USB_ScrollWheelDown == command))
+		return;
+
+	LatencyClass kind = LatencyClassOf(command);
+
+	if ((LatencyKeyMake != kind) && (LatencyKeyBreak != kind) && (LatencyButton != kind))
+		return;
+
+	unsigned int code = command & ~USB_BREAK & 0xFF;
+
+	if (command & USB_BREAK)
+		link.heldBits[ code >> 5 ] &= ~(1u << (code & 31));
+	else
+		link.heldBits[ code >> 5 ] |= (1u << (code & 31));
+}
+
+static void SerialPublish(SerialLink& link)
+{
+	if (link.queueCount)
+	{
+		LONGLONG enqueue = LatencyNow();
+
+		for (unsigned int idx = 0; idx < link.queueCount; ++idx)
+		{
+			link.queueFrame[ idx ].stamps.enqueue = enqueue;
+		}
+
+		unsigned int pushed = link.commandRing.PushBatch(link.queueFrame, link.queueCount);
+
+		if (pushed < link.queueCount)
+		{
+			link.commandsDropped += link.queueCount - pushed;
+			CounterAdd(link.pCounters->dropped, link.queueCount - pushed);
+		}
+
+		CounterAdd(link.pCounters->queued, pushed);
+		CounterMax(link.pCounters->queueHighWater, link.commandRing.Count());
+
+		link.queueCount = 0;
+		link.bWakePending = true;
+	}
+
+	if (link.bWakePending)
+	{
+		link.bWakePending = false;
+		SetEvent(link.hWriterWake);
+	}
+}
+
+static void SerialPublishAll()
+{
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		if (serialLinks[ idx ].hWriterThread)
+		{
+			SerialPublish(serialLinks[ idx ]);
+		}
+	}
+}
+
+void SerialBeginFrame()
+{
+	frameDepth++;
+}
+
+void SerialEndFrame()
+{
+	SerialInputGate gate;
+
+	if (!gate.bOpen)
+		return;
+
+	if (frameDepth && (0 == --frameDepth))
+	{
+		SerialPublishAll();
+		captureTime = 0;
+	}
+}
+
+void SerialCaptureTime(LONGLONG qpcTime)
+{
+	captureTime = qpcTime;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Which links the next command goes to
+//
+bool SerialRouted(int port)
+{
+	return (SerialRouteBroadcast == serialRoute) || (port == serialTarget);
+}
+
+static int SerialQueue(SerialLink& link, unsigned char command)
+{
+	if (!link.hWriterThread)
+		return -1;
+
+	SerialTrackHeld(link, command);
+
+	if (link.queueCount == kQueueFrameMax)
+	{
+		SerialPublish(link);
+	}
+
+	SerialCommand& slot = link.queueFrame[ link.queueCount++ ];
+	slot.command = command;
+	slot.retries = 0;
+	slot.stamps.capture = captureTime ? captureTime : LatencyNow();
+	slot.stamps.write = 0;
+
+	if (0 == frameDepth)
+	{
+		SerialPublish(link);
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Called from the input thread, never blocks
+// if result < 0, the command was dropped
+//
+int SerialQueue(unsigned char command)
+{
+	SerialInputGate gate;
+
+	if (!gate.bOpen)
+		return -1;
+
+	int result = -1;
+
+	RecordCommand(command, captureTime);
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		if (SerialRouted(idx) && (SerialQueue(serialLinks[ idx ], command) >= 0))
+		{
+			result = 0;
+		}
+	}
+
+	return result;
+}
+
+// Only what the target gets is recorded, a broadcast records it once
+int SerialQueueTo(int port, unsigned char command)
+{
+	SerialInputGate gate;
+
+	if (!gate.bOpen || (port < 0) || (port >= serialLinkCount))
+		return -1;
+
+	if (port == serialTarget)
+		RecordCommand(command, captureTime);
+
+	return SerialQueue(serialLinks[ port ], command);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Called from the input thread, never blocks
+//
+void SerialMotion(int dx, int dy)
+{
+	SerialInputGate gate;
+
+	if (!gate.bOpen || (!dx && !dy))
+		return;
+
+	LONGLONG capture = captureTime ? captureTime : LatencyNow();
+
+	RecordMotion(dx, dy, capture);
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (!SerialRouted(idx) || !link.hWriterThread)
+			continue;
+
+		LONGLONG expected = 0;
+		link.motionCapture.compare_exchange_strong(expected, capture);
+
+		link.motionX += dx;
+		link.motionY += dy;
+
+		CounterAdd(link.pCounters->motionPixels, (ULONGLONG)(((dx < 0) ? -dx : dx) + ((dy < 0) ? -dy : dy)));
+
+		// Paced, the tick wakes the writer, not the motion
+		if (motionRate)
+			continue;
+
+		link.bWakePending = true;
+
+		if (0 == frameDepth)
+		{
+			SerialPublish(link);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+//
+// Paced motion, called from the input thread at the motion rate, each
+// link with motion waiting gets to send one burst
+//
+void SerialMotionTick()
+{
+	SerialInputGate gate;
+
+	if (!gate.bOpen)
+		return;
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (!link.hWriterThread)
+			continue;
+
+		if (link.motionX.load() || link.motionY.load())
+		{
+			link.motionTick = true;
+			SetEvent(link.hWriterWake);
+		}
+	}
+}
+
+// Any link with motion the next tick would send
+bool SerialMotionPending()
+{
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		const SerialLink& link = serialLinks[ idx ];
+
+		if (link.hWriterThread && (link.motionX.load() || link.motionY.load()))
+			return true;
+	}
+
+	return false;
+}
+
+void SerialSetMotionRate(int hz)
+{
+	motionRate = (hz > 0) ? hz : 0;
+}
+
+int SerialGetMotionRate()
+{
+	return motionRate;
+}
+
+//-----------------------------------------------------------------------------
+//
+// Called from the input thread, never blocks
+//
+void SerialWheel(int notches)
+{
+	SerialInputGate gate;
+
+	if (!gate.bOpen || !notches)
+		return;
+
+	LONGLONG capture = captureTime ? captureTime : LatencyNow();
+
+	for (int idx = 0; idx < ((notches > 0) ? notches : -notches); ++idx)
+	{
+		RecordCommand((notches > 0) ? USB_ScrollWheelUp : USB_ScrollWheelDown, capture);
+	}
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		SerialLink& link = serialLinks[ idx ];
+
+		if (!SerialRouted(idx) || !link.hWriterThread)
+			continue;
+
+		LONGLONG expected = 0;
+		link.wheelCapture.compare_exchange_strong(expected, capture);
+
+		link.wheel += notches;
+
+		CounterAdd(link.pCounters->wheelNotches, (ULONGLONG)((notches < 0) ? -notches : notches));
+
+		link.bWakePending = true;
+
+		if (0 == frameDepth)
+		{
+			SerialPublish(link);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void SerialSetRoute(SerialRoute route)
+{
+	serialRoute = route;
+}
+
+SerialRoute SerialGetRoute()
+{
+	return serialRoute;
+}
+
+void SerialSetTarget(int port)
+{
+	if ((port >= 0) && (port < serialLinkCount))
+	{
+		// Anything still in the frame belongs to the old target
+		SerialPublishAll();
+		serialTarget = port;
+	}
+}
+
+int SerialGetTarget()
+{
+	return serialTarget;
+}
+
+int SerialNextTarget()
+{
+	if (serialLinkCount)
+	{
+		SerialSetTarget((serialTarget + 1) % serialLinkCount);
+	}
+
+	return serialTarget;
+}
+
+//-----------------------------------------------------------------------------
+//
+// How far behind the slowest routed port is, in commands
+//
+int SerialBacklog()
+{
+	unsigned int backlog = 0;
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		const SerialLink& link = serialLinks[ idx ];
+
+		if (!SerialRouted(idx) || !link.hWriterThread)
+			continue;
+
+		unsigned int pending = link.queueCount + link.commandRing.Count() +
+							   link.outstanding.load(std::memory_order_relaxed);
+
+		if (pending > backlog)
+			backlog = pending;
+	}
+
+	return (int)backlog;
+}
+
+// Commands that were never echoed, on the routed ports, since the start
+unsigned int SerialLost()
+{
+	unsigned int lost = 0;
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		if (SerialRouted(idx))
+			lost += serialLinks[ idx ].commandsLost.load(std::memory_order_relaxed);
+	}
+
+	return lost;
+}
+
+// Commands that were lost, and sent again, or folded back into the motion
+unsigned int SerialResent()
+{
+	unsigned int resent = 0;
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		resent += serialLinks[ idx ].commandsResent.load(std::memory_order_relaxed);
+	}
+
+	return resent;
+}
+
+// Commands that made it, on every port, since the start
+unsigned int SerialEchoed()
+{
+	unsigned int echoed = 0;
+
+	for (int idx = 0; idx < serialLinkCount; ++idx)
+	{
+		echoed += serialLinks[ idx ].commandsEchoed.load(std::memory_order_relaxed);
+	}
+
+	return echoed;
+}
+
+int SerialPortCount()
+{
+	return serialLinkCount;
+}
+
+const char* SerialPortName(int port)
+{
+	return ((port >= 0) && (port < serialLinkCount)) ? serialLinks[ port ].portName : "";
+}
+
+const char* SerialProfileName(int port)
+{
+	if ((port >= 0) && (port < serialLinkCount) && serialLinks[ port ].pProfile)
+		return serialLinks[ port ].pProfile->name;
+
+	return "none";
+}
+
+//-----------------------------------------------------------------------------
+
+void SerialSetBackend(SerialBackend backend)
+{
+	serialBackend = backend;
+}
+
+SerialBackend SerialGetBackend()
+{
+	return serialBackend;
+}
+
+//-----------------------------------------------------------------------------
+
+bool SerialSetProfile(const char* name)
+{
+	if (0 == _stricmp(name, "auto"))
+	{
+		pRequestedProfile = nullptr;
+		return true;
+	}
+
+	const DeviceProfile* pFound = ProfileFind(name);
+
+	if (pFound)
+	{
+		pRequestedProfile = pFound;
+	}
+
+	return nullptr != pFound;
+}
+
+//-----------------------------------------------------------------------------
+
+static void SerialUseProfile(SerialLink& link, const DeviceProfile& profile)
+{
+	link.pProfile = &profile;
+
+	link.timeoutMs      = profile.timeoutMs;
+	link.motionBurstMax = profile.motionBurstMax;
+
+	if (windowOverride)
+	{
+		link.window = windowOverride;
+	}
+	else
+	{
+		link.window = (profile.window < (int)kMaxWindow) ? profile.window : (int)kMaxWindow;
+	}
+
+	MotionInit(link.motionEncoder, profile.motionFastStep, false);
+
+	RateReset(link);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Open the port with the profile's line settings, and see if anything
+// answers, if result < 0, then no answer, otherwise the LED status
+//
+static int SerialProbe(SerialLink& link, const DeviceProfile& profile, int& openResult)
+{
+	// One device, closed and opened again, a COM port only takes one handle
+	if (!link.pSCC)
+		link.pSCC = CreateSerialDevice(serialBackend);
+	else
+		link.pSCC->Close();
+
+	openResult = link.pSCC->Open(link.portName, profile.baudrate, profile.bRtsCts);
+
+	if (SERIAL_OK != openResult)
+	{
+		delete link.pSCC;
+		link.pSCC = nullptr;
+		return -1;
+	}
+
+	link.inFlightHead = link.inFlightTail;
+	link.lastEcho = -1;
+
+	SerialUseProfile(link, profile);
+
+	// Probably a good idea to reset the keyboard if it's out first connect
+	int result = SerialTransact( link, USB_BufferClear );
+
+	if (result >= 0)
+		result = SerialTransact( link, USB_StatusLEDRead );
+
+	if ((result < 0x30) || (result > 0x37))
+		result = -1;
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+
+bool InitSerialPort(const char* portName)
+{
+	if (serialLinkCount >= SerialMaxPorts)
+		return false;
+
+	bool bLive = false;
+	int openResult = SERIAL_NOT_FOUND;
+
+	int first = 0;
+	int last  = ProfileCount() - 1;
+
+	const DeviceProfile* pTry = pRequestedProfile;
+
+	ProbeResult probe;
+
+	if (!portName)
+	{
+		// Go find it
+		if (!ProbeFind(serialBackend, pRequestedProfile, probe))
+		{
+			StatusLine(0, "NO DEVICE FOUND");
+			return false;
+		}
+
+		portName = probe.portName;
+		pTry = probe.pProfile;
+	}
+
+	if (pTry)
+	{
+		first = last = (int)(pTry - &ProfileGet(0));
+	}
+
+	int port = serialLinkCount;
+	SerialLink& link = serialLinks[ port ];
+	snprintf(link.portName, sizeof(link.portName), "%s", portName);
+	link.pCounters = CountersLink(port, portName);
+
+	link.ledStatus = -1;
+
+	for (int idx = first; idx <= last; ++idx)
+	{
+		int leds = SerialProbe(link, ProfileGet(idx), openResult);
+
+		if (leds >= 0)
+		{
+			link.ledStatus = leds & (StatusNumLock | StatusCapsLock | StatusScrollLock);
+			bLive = true;
+			break;
+		}
+
+		// If the port isn't there, or won't open, another baud rate won't help
+		if (SERIAL_OK != openResult)
+			break;
+	}
+
+	if (link.pSCC)
+	{
+		// Keep the port, even with no answer, in case the device is just powered off
+		serialLinkCount++;
+	}
+
+	if (bLive)
+	{
+		if (link.pProfile->motionFastStep)
+		{
+			int result = SerialTransact( link, USB_MouseFast );
+			MotionInit(link.motionEncoder, link.pProfile->motionFastStep, result >= 0);
+		}
+
+		StatusLine(0, "%s live on %s", link.pProfile->name, portName);
+
+		// Only a local port, the mock answers on any name, and a remote
+		// port is a host name
+		if ((SerialBackendLibSerialPort == serialBackend) || (SerialBackendOverlapped == serialBackend))
+			ProbeSave(portName, *link.pProfile);
+	}
+	else if (link.pSCC)
+	{
+		StatusLine(0, "No Response on %s", portName);
+	}
+	else if (SERIAL_NOT_FOUND != openResult)
+	{
+		StatusLine(0, "FAILED TO OPEN - %s", portName);
+	}
+	else
+	{
+		StatusLine(0, "FAILED TO FIND PORT - %s", portName);
+	}
+
+	return bLive;
+}
+
+//-----------------------------------------------------------------------------
+
+int InitSerialPorts()
+{
+	ProbeResult found[ SerialMaxPorts ];
+	int numFound = ProbeFindAll(serialBackend, pRequestedProfile, found, SerialMaxPorts);
+	int numLive = 0;
+
+	for (int idx = 0; idx < numFound; ++idx)
+	{
+		const DeviceProfile* pSaved = pRequestedProfile;
+
+		pRequestedProfile = found[ idx ].pProfile;
+
+		if (InitSerialPort(found[ idx ].portName))
+			numLive++;
+
+		pRequestedProfile = pSaved;
+	}
+
+	if (0 == numFound)
+	{
+		StatusLine(0, "NO DEVICE FOUND");
+	}
+
+	return numLive;
+}
+
@@ -0,0 +1,119 @@
+//
+// serial.h - Serial link to the USB-KM232 / ASC232
+//
+// Commands are pipelined, SerialSend only waits for an echo when the
+// window of outstanding commands is full.  Echoes are checked against
+// the outstanding commands as they show up, and lost breaks are resent.
+//
+// Once SerialStart has been called, a writer thread owns the port, and
+// the input handlers should only use SerialQueue, which never blocks.
+//
+// Each InitSerialPort opens one more port, with its own writer thread.
+// Input goes to the focus target, or to every port, in broadcast.
+//
+#pragma once
+
+#include "km232.h"
+#include "device.h"
+
+const int SerialMaxPorts = 8;
+
+enum SerialRoute
+{
+	SerialRouteFocus,		// only the target port
+	SerialRouteBroadcast,	// every port
+};
+
+// Which port driver InitSerialPort uses, libserialport unless told otherwise
+void SerialSetBackend(SerialBackend backend);
+SerialBackend SerialGetBackend();
+
+// ASC232, KM232, or auto (the default) to try each until one answers
+// false if there's no profile by that name
+bool SerialSetProfile(const char* name);
+
+// Adds a port, false if there is no device answering on it
+// portName nullptr to probe every port, and use the one that answers
+bool InitSerialPort(const char* portName);
+
+// Adds every port that answers the probe, returns how many are live
+int  InitSerialPorts();
+
+int  SerialPortCount();
+const char* SerialPortName(int port);
+const char* SerialProfileName(int port);
+
+// Input thread side, where the input goes
+void SerialSetRoute(SerialRoute route);
+SerialRoute SerialGetRoute();
+void SerialSetTarget(int port);
+int  SerialGetTarget();
+int  SerialNextTarget();	// returns the new target
+bool SerialRouted(int port);	// the next command goes to port
+
+// Input thread side, hand a command to one port, whatever the route,
+// for what's already been translated for that port
+int  SerialQueueTo(int port, unsigned char command);
+
+// Pipeline depth, 1 is lock-step (the old behavior)
+// The rate controller keeps each port somewhere between 1 and this
+void SerialSetWindow(int window);
+int  SerialGetWindow();
+int  SerialGetRate(int port);
+
+// Start / Stop the writer threads
+void SerialStart();
+void SerialStop();
+
+// On the way out, maybe from a crash, from any thread.  What's queued
+// goes first, then the breaks for every key and button still down on
+// each port, in one write, and the ports are closed, all in about
+// budgetMs, whatever state the writers are in.  The input side queues
+// nothing after this
+void SerialShutdown(DWORD budgetMs);
+
+// Auto reset, signaled when a port stops answering, or starts again, or
+// its LEDs change
+HANDLE SerialEvent();
+bool   SerialAnswering(int port);
+
+// The device LEDs, StatusNumLock etc, as of the last background read,
+// never waits on the device, -1 if they haven't been read
+int    SerialLEDs(int port);
+
+// Input thread side, hand a command to the writer thread
+// if result < 0, then the queue is full (or there is no port)
+int  SerialQueue(unsigned char command);
+
+// Input thread side, add to the accumulated mouse motion
+void SerialMotion(int dx, int dy);
+
+// Input thread side, add to the accumulated wheel, in notches, up is positive
+void SerialWheel(int notches);
+
+// Paced motion, 0 (the default) sends motion as soon as there's room,
+// otherwise each SerialMotionTick lets one burst go out, set before
+// SerialStart
+void SerialSetMotionRate(int hz);
+int  SerialGetMotionRate();
+void SerialMotionTick();
+bool SerialMotionPending();
+
+// Input thread side, how many commands the slowest routed port has
+// yet to echo, and how many have been lost on them altogether
+int  SerialBacklog();
+unsigned int SerialLost();
+
+// Commands echoed, and lost commands sent again, on every port
+unsigned int SerialEchoed();
+unsigned int SerialResent();
+
+// Input thread side, everything queued between Begin and End is handed
+// to the writer thread in one go, so it can go out in one write
+void SerialBeginFrame();
+void SerialEndFrame();
+
+// Input thread side, when the input being relayed was captured (QPC)
+// so it can be timed all the way to the echo, good until SerialEndFrame
+void SerialCaptureTime(LONGLONG qpcTime);
+
@@ -0,0 +1,204 @@
+//
+// status.cpp - Status display
+//
+// The old way was SetConsoleCursorPosition, 64 spaces, and a printf, for
+// every line, on every input event.  Now we keep what is on the console
+// in a front buffer, draw into a back buffer, and only send the
+// rectangle that covers the differences, no more than ~30 times a second.
+//
+
+#include "status.h"
+#include "km232.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+//-----------------------------------------------------------------------------
+
+static const int StatusMaxWidth  = 132;
+static const int StatusMaxHeight = 60;
+static const DWORD StatusFlushMs = 33;
+
+static CHAR_INFO backBuffer[ StatusMaxWidth * StatusMaxHeight ];
+static CHAR_INFO frontBuffer[ StatusMaxWidth * StatusMaxHeight ];
+
+static int   statusWidth  = 0;
+static int   statusHeight = 0;
+static WORD  statusAttrib = 0;
+static bool  statusEnabled = false;
+static bool  statusDirty   = false;
+static DWORD lastFlush = 0;
+
+//-----------------------------------------------------------------------------
+
+void StatusInit(int width, int height, WORD wAttrib)
+{
+	if (width > StatusMaxWidth) width = StatusMaxWidth;
+	if (height > StatusMaxHeight) height = StatusMaxHeight;
+
+	statusWidth  = width;
+	statusHeight = height;
+	statusAttrib = wAttrib;
+
+	for (int idx = 0; idx < (width * height); ++idx)
+	{
+		backBuffer[ idx ].Char.UnicodeChar = L' ';
+		backBuffer[ idx ].Attributes = wAttrib;
+
+		// Nothing will match this, so the first flush paints everything
+		frontBuffer[ idx ].Char.UnicodeChar = 0;
+		frontBuffer[ idx ].Attributes = 0xFFFF;
+	}
+
+	statusEnabled = true;
+	statusDirty = true;
+	lastFlush = GetTickCount() - StatusFlushMs;
+}
+
+bool StatusEnabled()
+{
+	return statusEnabled;
+}
+
+//-----------------------------------------------------------------------------
+
+void StatusEnd()
+{
+	if (!statusEnabled)
+		return;
+
+	lastFlush = GetTickCount() - StatusFlushMs;
+	StatusFlush();
+
+	statusEnabled = false;
+
+	CONSOLE_CURSOR_INFO cursorInfo;
+	cursorInfo.dwSize = 100;
+	cursorInfo.bVisible = TRUE;
+	SetConsoleCursorInfo(hStdOut, &cursorInfo);
+
+	COORD dwCursorPosition;
+	dwCursorPosition.X = 0;
+	dwCursorPosition.Y = (SHORT)(statusHeight - 1);
+	SetConsoleCursorPosition(hStdOut, dwCursorPosition);
+}
+
+//-----------------------------------------------------------------------------
+
+void StatusLine(int row, const char* format, ...)
+{
+	if (!statusEnabled || (row < 0) || (row >= statusHeight))
+		return;
+
+	char text[ StatusMaxWidth + 1 ];
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	if (len < 0) len = 0;
+	if (len > statusWidth) len = statusWidth;
+
+	CHAR_INFO* pLine = backBuffer + (row * statusWidth);
+
+	for (int col = 0; col < statusWidth; ++col)
+	{
+		pLine[ col ].Char.UnicodeChar = (col < len) ? (WCHAR)(unsigned char)text[ col ] : L' ';
+		pLine[ col ].Attributes = statusAttrib;
+	}
+
+	statusDirty = true;
+}
+
+//-----------------------------------------------------------------------------
+
+void StatusText::Append(const char* format, ...)
+{
+	if (!statusEnabled || (len >= (int)sizeof(text) - 1))
+		return;
+
+	va_list args;
+	va_start(args, format);
+	int num_chars = vsnprintf(text + len, sizeof(text) - len, format, args);
+	va_end(args);
+
+	if (num_chars > 0)
+	{
+		len += num_chars;
+		if (len > (int)sizeof(text) - 1) len = (int)sizeof(text) - 1;
+	}
+}
+
+void StatusText::Show(int row) const
+{
+	StatusLine(row, "%s", text);
+}
+
+//-----------------------------------------------------------------------------
+
+DWORD StatusFlush()
+{
+	if (!statusEnabled || !statusDirty)
+		return INFINITE;
+
+	DWORD elapsed = GetTickCount() - lastFlush;
+
+	if (elapsed < StatusFlushMs)
+		return StatusFlushMs - elapsed;
+
+	// Find the rectangle that covers everything that changed
+	int left = statusWidth, right = -1;
+	int top = statusHeight, bottom = -1;
+
+	for (int y = 0; y < statusHeight; ++y)
+	{
+		const CHAR_INFO* pBack  = backBuffer + (y * statusWidth);
+		const CHAR_INFO* pFront = frontBuffer + (y * statusWidth);
+
+		for (int x = 0; x < statusWidth; ++x)
+		{
+			if ((pBack[ x ].Char.UnicodeChar != pFront[ x ].Char.UnicodeChar) ||
+				(pBack[ x ].Attributes != pFront[ x ].Attributes))
+			{
+				if (x < left) left = x;
+				if (x > right) right = x;
+				if (y < top) top = y;
+				bottom = y;
+			}
+		}
+	}
+
+	if (bottom >= 0)
+	{
+		COORD dwBufferSize;
+		dwBufferSize.X = (SHORT)statusWidth;
+		dwBufferSize.Y = (SHORT)statusHeight;
+
+		COORD dwBufferCoord;
+		dwBufferCoord.X = (SHORT)left;
+		dwBufferCoord.Y = (SHORT)top;
+
+		SMALL_RECT writeRegion;
+		writeRegion.Left   = (SHORT)left;
+		writeRegion.Top    = (SHORT)top;
+		writeRegion.Right  = (SHORT)right;
+		writeRegion.Bottom = (SHORT)bottom;
+
+		WriteConsoleOutput(hStdOut, backBuffer, dwBufferSize, dwBufferCoord, &writeRegion);
+
+		for (int y = top; y <= bottom; ++y)
+		{
+			for (int x = left; x <= right; ++x)
+			{
+				frontBuffer[ (y * statusWidth) + x ] = backBuffer[ (y * statusWidth) + x ];
+			}
+		}
+	}
+
+	statusDirty = false;
+	lastFlush = GetTickCount();
+
+	return INFINITE;
+}
+
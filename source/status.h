@@ -0,0 +1,43 @@
+//
+// status.h - Status display
+//
+// Status lines are drawn into an in-memory CHAR_INFO back buffer, which is
+// cheap enough to do from anywhere on the input thread.  StatusFlush
+// copies only the cells that changed out to the console, in a single
+// WriteConsoleOutput, at a capped rate.
+//
+// Until StatusInit is called, everything here is a no-op.
+//
+#pragma once
+
+#include <windows.h>
+
+void StatusInit(int width, int height, WORD wAttrib);
+bool StatusEnabled();
+
+// Flush, then put the cursor back, below the display, for anything
+// printed on the way out
+void StatusEnd();
+
+// Replace a whole line of the display (printf style)
+void StatusLine(int row, const char* format, ...);
+
+// Builds up one status line a piece at a time, does nothing at all
+// when the display is off
+class StatusText
+{
+public:
+	StatusText() : len(0) { text[ 0 ] = 0; }
+
+	void Append(const char* format, ...);
+	void Show(int row) const;
+
+private:
+	char text[ 256 ];
+	int  len;
+};
+
+// Write out what changed, if it's time.  Returns how many milliseconds
+// until it should be called again, INFINITE if nothing is waiting
+DWORD StatusFlush();
+